@@ -53,6 +53,10 @@ void ofApp::setup()
 	// gui
 	gui.setup( "App Controls", "settings.json" );
 	gui.add( alignBtn.setup( "perform alignment" ) );
+	gui.add( method.set( "method: icp, icp nl, gicp, ndt, point-to-plane", 0, 0, 4 ) );
+	gui.add( globalAlignBtn.setup( "perform global alignment" ) );
+	gui.add( globalLeafSize.set( "global alignment leaf size", 4., 0.5, 20. ) );
+	gui.add( featureCacheBtn.setup( "check feature cache" ) );
 	gui.add( showUnaligned.set( "show unaligned (pink)", true ) );
 	gui.add( showAligned.set( "show aligned (green)", true ) );
 	gui.add( scale.set( "mesh scale", 10., 0., 25. ) );
@@ -60,6 +64,8 @@ void ofApp::setup()
 	gui.add( rotateA.set( "rotate points A", glm::vec3( 0., 25., 3. ), glm::vec3( -180 ), glm::vec3( 180 ) ) );
 
 	alignBtn.addListener( this, &ofApp::alignIcp );
+	globalAlignBtn.addListener( this, &ofApp::alignGlobal );
+	featureCacheBtn.addListener( this, &ofApp::checkFeatureCache );
 
 	camera.setDistance( 700. );
 }
@@ -73,6 +79,15 @@ void ofApp::update()
 	// scale affects both
 	pointsA.setScale( scale.get() );
 	pointsB.setScale( scale.get() );
+
+	// pick up the background alignment results once they are ready
+	if ( alignFuture.valid() && alignFuture.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready ) {
+		applyAlignment( alignFuture.get() );
+	}
+	if ( globalFuture.valid() && globalFuture.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready ) {
+		ofxPcl::GlobalAlignmentResult result = globalFuture.get();
+		if ( !globalSuperseded ) applyGlobalAlignment( result );
+	}
 }
 
 //--------------------------------------------------------------
@@ -109,9 +124,16 @@ void ofApp::draw()
 	gui.draw();
 }
 
+//--------------------------------------------------------------
+void ofApp::exit()
+{
+	// the global alignment job uses globalAlignment, which is destroyed with the app
+	if ( globalFuture.valid() ) globalFuture.wait();
+}
+
 //
 // align points A to points B - 
-//	uses ofxPcl::Alignment::align(A,B)
+//	uses ofxPcl::Alignment::alignAsync(A,B), the result is applied in update()
 //--------------------------------------------------------------
 void ofApp::alignIcp()
 {
@@ -119,27 +141,142 @@ void ofApp::alignIcp()
 	std::vector<glm::vec3> sourcePoints, targetPoints;
 
 	// source points is the point cloud that needs alignment (points A)
-	sourcePoints = pointsA.getMesh().getVertices();
-	for ( auto& pt : sourcePoints ) {
-		pt = pointsA.getGlobalTransformMatrix() * glm::vec4( pt, 1. );	// apply pointsA of3dPrimitive transform to vertex data
-	}
+	// apply pointsA of3dPrimitive transform to vertex data
+	ofxPcl::transformCloud( pointsA.getMesh().getVertices(), pointsA.getGlobalTransformMatrix(), sourcePoints );
 
 	// points B = target mesh (source is aligned to this)
-	targetPoints = pointsB.getMesh().getVertices();
-	for ( auto& pt : targetPoints ) {
-		pt = pointsB.getGlobalTransformMatrix() * glm::vec4( pt, 1. );
+	ofxPcl::transformCloud( pointsB.getMesh().getVertices(), pointsB.getGlobalTransformMatrix(), targetPoints );
+
+	// runs on a worker thread, so the app keeps drawing while icp iterates.
+	// pressing the button again while busy replaces any request still waiting.
+	// an engine switch is queued too, the worker applies it before the next job
+	auto alignMethod = static_cast<ofxPcl::AlignmentMethod>( method.get() );
+	if ( alignment.getMethod() != alignMethod ) alignment.setMethodAsync( alignMethod );
+
+	alignSourceMat   = pointsA.getGlobalTransformMatrix();
+	alignFuture      = alignment.alignAsync( std::move( sourcePoints ), std::move( targetPoints ) );
+	globalSuperseded = true;  // the newest request wins
+}
+
+//
+// align points A to points B from any pose -
+//	keypoints, fpfh features and a sample consensus find the rough pose, point-to-plane icp refines it.
+//	no need to move points A close to points B first. runs on the ThreadPool, the result is applied in update()
+//--------------------------------------------------------------
+void ofApp::alignGlobal()
+{
+	// GlobalAlignment is not thread safe, one run at a time
+	if ( globalFuture.valid() ) {
+		ofLogNotice() << "Global alignment is still running";
+		return;
 	}
 
-	float t0       = ofGetElapsedTimef();
-	bool converged = alignment.align( sourcePoints, targetPoints );
-	float t1       = ofGetElapsedTimef();
+	std::vector<glm::vec3> sourcePoints, targetPoints;
+	ofxPcl::transformCloud( pointsA.getMesh().getVertices(), pointsA.getGlobalTransformMatrix(), sourcePoints );
+	ofxPcl::transformCloud( pointsB.getMesh().getVertices(), pointsB.getGlobalTransformMatrix(), targetPoints );
+
+	ofxPcl::GlobalAlignmentSettings settings = globalAlignment.getSettings();
+	settings.leafSize                         = globalLeafSize.get();
+	globalAlignment.setSettings( settings );
+
+	// a pending icp result would be applied on top of this one
+	alignment.cancel();
+	alignFuture = std::future<ofxPcl::AlignmentResult>();
+
+	globalSourceMat  = pointsA.getGlobalTransformMatrix();
+	globalSuperseded = false;
+	globalFuture     = ofxPcl::getThreadPool().submit( [this, sourcePoints = std::move( sourcePoints ), targetPoints = std::move( targetPoints )] {
+		return globalAlignment.align( sourcePoints, targetPoints );
+	} );
+}
 
-	alignMat = alignment.getAlignmentMatrix();
+//--------------------------------------------------------------
+void ofApp::applyGlobalAlignment( const ofxPcl::GlobalAlignmentResult& result )
+{
+	const auto& ms = result.timings;
+
+	ofLogNotice() << "Global alignment took " << ofToString( ms.totalMs, 2 ) << " ms, "
+	              << result.sourceKeypoints << " / " << result.targetKeypoints << " keypoints\n"
+	              << "\tkeypoints " << ofToString( ms.keypointsMs, 2 ) << " ms, normals " << ofToString( ms.normalsMs, 2 )
+	              << " ms, features " << ofToString( ms.featuresMs, 2 ) << " ms, matching " << ofToString( ms.matchingMs, 2 )
+	              << " ms, consensus " << ofToString( ms.consensusMs, 2 ) << " ms, refinement " << ofToString( ms.refinementMs, 2 ) << " ms\n"
+	              << "\tconverged: " << std::boolalpha << result.converged << ", inliers " << ofToString( result.inlierFraction * 100.f, 1 ) << "%\n"
+	              << "\tfitness score: " << result.fitnessScore;
+	if ( result.converged ) showAlignment( result.matrix, globalSourceMat );
+}
+
+//
+// check the incremental ofxPcl::FeatureCache against a full recompute -
+//	points B are fed in as a sweeping scan. after every batch the cache's normals and descriptors must equal
+//	computeNormals + computeFpfh over its keypoints, value for value. a diagnostic, runs on the calling thread
+//--------------------------------------------------------------
+void ofApp::checkFeatureCache()
+{
+	std::vector<glm::vec3> points;
+	ofxPcl::transformCloud( pointsB.getMesh().getVertices(), pointsB.getGlobalTransformMatrix(), points );
+	std::sort( points.begin(), points.end(), []( const glm::vec3& a, const glm::vec3& b ) { return a.x < b.x; } );
+
+	ofxPcl::FeatureCacheSettings settings;
+	settings.leafSize = globalLeafSize.get();
+	ofxPcl::FeatureCache cache( settings );
+
+	// equal, or both nan
+	auto same = []( const float* a, const float* b, size_t n ) {
+		for ( size_t i = 0; i < n; ++i ) {
+			if ( !( a[i] == b[i] ) && !( std::isnan( a[i] ) && std::isnan( b[i] ) ) ) return false;
+		}
+		return true;
+	};
+
+	const size_t batches = 8;
+	bool identical       = true;
+	for ( size_t b = 0; b < batches; ++b ) {
+		cache.addPoints( std::vector<glm::vec3>( points.begin() + points.size() * b / batches, points.begin() + points.size() * ( b + 1 ) / batches ) );
+
+		pcl::PointCloud<pcl::Normal> normals;
+		ofxPcl::FeatureCloud features;
+		ofxPcl::computeNormals( cache.getKeypoints(), settings.normalNeighbours, normals );
+		ofxPcl::computeFpfh( cache.getKeypoints(), normals, settings.featureRadius * settings.leafSize, features );
+
+		size_t mismatches = features.size() == cache.getFeatures()->size() ? 0 : features.size();
+		for ( size_t i = 0; i < features.size() && i < cache.getFeatures()->size(); ++i ) {
+			const pcl::Normal& normal = cache.getNormals()->points[i];
+			if ( !same( normals[i].normal, normal.normal, 3 ) || !same( &normals[i].curvature, &normal.curvature, 1 ) ||
+			     !same( features[i].histogram, cache.getFeatures()->points[i].histogram, 33 ) ) {
+				++mismatches;
+			}
+		}
+		identical &= mismatches == 0;
+
+		const auto& stats = cache.getStats();
+		ofLogNotice() << "Feature cache batch " << b + 1 << "/" << batches << ": " << stats.keypoints << " keypoints, "
+		              << stats.features << " descriptors recomputed in " << ofToString( stats.elapsedMs, 2 ) << " ms, "
+		              << mismatches << " differ from the full recompute";
+	}
+	if ( identical ) {
+		ofLogNotice() << "Feature cache matches computeNormals + computeFpfh";
+	} else {
+		ofLogError() << "Feature cache differs from computeNormals + computeFpfh";
+	}
+}
+
+//--------------------------------------------------------------
+void ofApp::applyAlignment( const ofxPcl::AlignmentResult& result )
+{
+	if ( result.cancelled ) return;
 
-	ofLogNotice() << "Alignment took " << ofToString( ( t1 - t0 ) * 1000., 2. ) << " ms\n"
-	              << "\tconverged: " << std::boolalpha << alignment.hasConverged() << "\n"
+	ofLogNotice() << "Alignment took " << ofToString( result.elapsedMs, 2 ) << " ms, " << result.iterations << " iterations\n"
+	              << "\tconverged: " << std::boolalpha << result.converged << "\n"
+	              << "\tfitness score: " << result.fitnessScore << "\n"
 	              << "\ttransformation matrix (glm::mat4):\n"
-	              << alignMat;
+	              << result.matrix;
+	showAlignment( result.matrix, alignSourceMat );
+}
+
+//--------------------------------------------------------------
+void ofApp::showAlignment( const glm::mat4& matrix, const glm::mat4& sourceMat )
+{
+	alignMat = matrix;
 
 	// points aligned model shows points A after alignment
 	pointsAligned = pointsA;
@@ -147,11 +284,11 @@ void ofApp::alignIcp()
 
 	// either manually apply the alignment matrix ( + initial points A transform ) to each vertex...
 	//for ( auto& vert : pointsAligned.getMesh().getVertices() ) {
-	//	vert = alignMat * pointsA.getGlobalTransformMatrix() * glm::vec4( vert, 1. );
+	//	vert = alignMat * sourceMat * glm::vec4( vert, 1. );
 	//}
 
 	// or decompose the alignment matrix, and apply the transformations to the ofNode
-	glm::mat4 combinedMat = alignMat * pointsA.getGlobalTransformMatrix();	// pointsA offset transform + alignment transform
+	glm::mat4 combinedMat = alignMat * sourceMat;	// pointsA offset transform + alignment transform
 	glm::vec3 scale;
 	glm::quat rotation;
 	glm::vec3 translation;
@@ -11,7 +11,13 @@ public:
 	void setup();
 	void update();
 	void draw();
+	void exit();
 	void alignIcp();
+	void alignGlobal();
+	void checkFeatureCache();
+	void applyAlignment( const ofxPcl::AlignmentResult& result );
+	void applyGlobalAlignment( const ofxPcl::GlobalAlignmentResult& result );
+	void showAlignment( const glm::mat4& matrix, const glm::mat4& sourceMat );
 
 	void keyPressed( int key );
 	void keyReleased( int key );
@@ -27,13 +33,23 @@ public:
 
 	ofMesh mesh;
 	of3dPrimitive pointsA, pointsB, pointsAligned;
-	ofxPcl::Alignment alignment;  // iterative closest point alignment
+	ofxPcl::Alignment alignment;              // point cloud alignment, engine picked in the gui
+	ofxPcl::GlobalAlignment globalAlignment;  // alignment from any initial pose
 	glm::mat4 alignMat = glm::mat4( 1. );
+	std::future<ofxPcl::AlignmentResult> alignFuture;  // pending background alignment
+	glm::mat4 alignSourceMat = glm::mat4( 1. );        // points A transform at the time alignment was requested
+	std::future<ofxPcl::GlobalAlignmentResult> globalFuture;  // pending global alignment
+	glm::mat4 globalSourceMat = glm::mat4( 1. );             // points A transform when it was requested
+	bool globalSuperseded     = false;                       // an icp request came in after it
 
 	ofEasyCam camera;
 
 	ofxPanel gui;
 	ofxButton alignBtn;                 // perform alignment
+	ofxButton globalAlignBtn;           // perform global alignment
+	ofxButton featureCacheBtn;          // check the incremental feature cache
+	ofParameter<float> globalLeafSize;  // keypoint voxel size of the global alignment
+	ofParameter<int> method;            // ofxPcl::AlignmentMethod
 	ofParameter<bool> showUnaligned;	// toggle draw unaligned point cloud A
 	ofParameter<bool> showAligned;		// toggle draw aligned point cloud A
 	ofParameter<float> scale;           // scale of mesh
@@ -1,5 +1,20 @@
 #pragma once
 #include "ofxPointCloudLibrary/Alignment.hpp"
+#include "ofxPointCloudLibrary/CloudPool.hpp"
+#include "ofxPointCloudLibrary/ColumnCloud.hpp"
+#include "ofxPointCloudLibrary/FeatureCache.hpp"
+#include "ofxPointCloudLibrary/Features.hpp"
+#include "ofxPointCloudLibrary/FilterPipeline.hpp"
+#include "ofxPointCloudLibrary/Filters.hpp"
+#include "ofxPointCloudLibrary/GlobalAlignment.hpp"
+#include "ofxPointCloudLibrary/IO.hpp"
+#include "ofxPointCloudLibrary/Normals.hpp"
+#include "ofxPointCloudLibrary/Organized.hpp"
+#include "ofxPointCloudLibrary/PointsView.hpp"
+#include "ofxPointCloudLibrary/Registration.hpp"
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/Segmentation.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
 #include "ofxPointCloudLibrary/Types.hpp"
 #include "ofxPointCloudLibrary/Utils.hpp"
 
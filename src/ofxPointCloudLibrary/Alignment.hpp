@@ -1,39 +1,558 @@
 #pragma once
+#include "ofxPointCloudLibrary/CloudPool.hpp"
+#include "ofxPointCloudLibrary/Filters.hpp"
+#include "ofxPointCloudLibrary/Registration.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
 #include "ofxPointCloudLibrary/Types.hpp"
 #include "ofxPointCloudLibrary/Utils.hpp"
 
 namespace ofxPointCloudLibrary {
 
-/* iterative closest point alignment */
+/* result of one alignment run */
+struct AlignmentResult
+{
+	glm::mat4 matrix   = glm::mat4( 1. );  // transform taking the source onto the target
+	float fitnessScore = 0.f;              // mean squared distance to the target, lower is better
+	bool converged     = false;
+	bool cancelled     = false;  // cancelled in flight, or superseded by a newer async request
+	int iterations     = 0;      // over all pyramid levels
+	float elapsedMs    = 0.f;    // wall time of the alignment, excluding queueing
+};
+
+/* rigid alignment of a source cloud to a target cloud, with a selectable registration engine */
 class Alignment
 {
 public:
-	/* use iterative closest point to align sourceCloud to targetCloud */
+	explicit Alignment( AlignmentMethod method = AlignmentMethod::ICP )
+	    : m_method( method )
+	{
+		createEngine();
+	}
+
+	~Alignment()
+	{
+		cancel();
+		waitForAsync();
+	}
+
+	Alignment( const Alignment& ) = delete;
+	Alignment& operator=( const Alignment& ) = delete;
+
+	/* align sourceCloud to targetCloud with the current method */
 	bool align( const std::vector<glm::vec3>& sourceCloud, const std::vector<glm::vec3>& targetCloud )
 	{
-		m_sourceCloud.reset( new PointCloud( toPcl( sourceCloud ) ) );
-		m_targetCloud.reset( new PointCloud( toPcl( targetCloud ) ) );
+		setTarget( targetCloud );
+		return alignTo( sourceCloud );
+	}
+
+	/* set the reference cloud that following alignTo() calls align against. the target kd-tree is built
+	 * here, so a cloud edited in place since the last call is searched at its new positions, and reused by
+	 * every alignTo() until the next setTarget() */
+	void setTarget( const std::vector<glm::vec3>& targetCloud )
+	{
+		PointCloud::Ptr target = getCloudPool().acquire( targetCloud.size() );
+		toPcl( targetCloud, *target );
+		setTarget( target );
+	}
+
+	void setTarget( const PointCloud::ConstPtr& targetCloud )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		getSearchCache().invalidate( targetCloud.get() );  // setTarget is the caller's "target changed"
+		setTargetUnlocked( targetCloud );
+	}
+
+	bool hasTarget() const
+	{
+		std::lock_guard<std::mutex> lock( m_stateMutex );
+		return m_targetCloud && !m_targetCloud->empty();
+	}
+	PointCloud::ConstPtr getTarget() const
+	{
+		std::lock_guard<std::mutex> lock( m_stateMutex );
+		return m_targetCloud;
+	}
+
+	/* align sourceCloud to the current target, reusing the source and output buffers between calls */
+	bool alignTo( const std::vector<glm::vec3>& sourceCloud, const glm::mat4& guess = glm::mat4( 1. ) )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		if ( !m_sourceCloud ) m_sourceCloud = getCloudPool().acquire( sourceCloud.size() );
+		toPcl( sourceCloud, *m_sourceCloud );
+		++m_sourceCloud->header.seq;  // refilled in place, the SearchCache must not hand back the last frame's tree
+		return compute( m_sourceCloud, guess ).converged;
+	}
+
+	bool alignTo( const PointCloud::ConstPtr& sourceCloud, const glm::mat4& guess = glm::mat4( 1. ) )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		return compute( sourceCloud, guess ).converged;
+	}
+
+	// --------------------------------------------------------------------------
+	// batch alignment
+	//
+	// aligns many sources to the current target at once on the ThreadPool. every
+	// alignment gets its own registration objects but shares the target's search
+	// trees, normals and covariances read-only, so the target is prepared once.
+	// results are in source order. the progress callback is not called, cancel()
+	// doesn't apply, and the getters keep reporting the last single alignment.
+	// --------------------------------------------------------------------------
+
+	// guesses is empty or holds one initial transform per source
+	std::vector<AlignmentResult> alignBatch( const std::vector<std::vector<glm::vec3>>& sourceClouds, const std::vector<glm::mat4>& guesses = {} )
+	{
+		return alignBatch( sourceClouds.size(), guesses, [&sourceClouds]( size_t i ) {
+			PointCloud::Ptr source = getCloudPool().acquire( sourceClouds[i].size() );
+			toPcl( sourceClouds[i], *source );
+			return PointCloud::ConstPtr( source );
+		} );
+	}
+
+	std::vector<AlignmentResult> alignBatch( const std::vector<PointCloud::ConstPtr>& sourceClouds, const std::vector<glm::mat4>& guesses = {} )
+	{
+		return alignBatch( sourceClouds.size(), guesses, [&sourceClouds]( size_t i ) { return sourceClouds[i]; } );
+	}
+
+	// --------------------------------------------------------------------------
+	// asynchronous alignment
+	//
+	// jobs run one at a time on the shared ThreadPool. if a new request arrives
+	// while one is running, it replaces any request still waiting, whose future
+	// then resolves as cancelled. while a job is running the synchronous calls
+	// block, the getters below keep reporting the last finished alignment.
+	// --------------------------------------------------------------------------
+
+	std::future<AlignmentResult> alignAsync( std::vector<glm::vec3> sourceCloud, std::vector<glm::vec3> targetCloud, const glm::mat4& guess = glm::mat4( 1. ) )
+	{
+		Job job;
+		job.source    = std::move( sourceCloud );
+		job.target    = std::move( targetCloud );
+		job.hasTarget = true;
+		job.guess     = guess;
+		return enqueue( std::move( job ) );
+	}
+
+	// align against the target set by setTarget() or by an earlier alignAsync()
+	std::future<AlignmentResult> alignToAsync( std::vector<glm::vec3> sourceCloud, const glm::mat4& guess = glm::mat4( 1. ) )
+	{
+		Job job;
+		job.source = std::move( sourceCloud );
+		job.guess  = guess;
+		return enqueue( std::move( job ) );
+	}
+
+	/* setMethod() for the async jobs: the worker switches engines before it starts the next job, so unlike
+	 * setMethod() this never waits for a running alignment. synchronous calls keep the current engine until then */
+	void setMethodAsync( AlignmentMethod method )
+	{
+		bool startWorker = false;
+		{
+			std::lock_guard<std::mutex> lock( m_jobMutex );
+			m_pendingMethod    = method;
+			m_hasPendingMethod = true;
+			if ( !m_jobRunning ) m_jobRunning = startWorker = true;
+		}
+		if ( startWorker ) getThreadPool().submit( [this] { runJobs(); } );
+	}
+
+	// abort the running async job and drop the waiting one
+	void cancel()
+	{
+		std::unique_ptr<Job> pending;
+		{
+			std::lock_guard<std::mutex> lock( m_jobMutex );
+			pending.swap( m_pendingJob );
+			if ( m_jobRunning ) m_cancelRequested = true;
+		}
+		if ( pending ) resolveCancelled( *pending );
+	}
+
+	// when true, a new async request also aborts the running job instead of waiting for it
+	void setCancelRunningOnNewRequest( bool cancelRunning ) { m_cancelRunningOnNew = cancelRunning; }
+
+	bool isBusy() const
+	{
+		std::lock_guard<std::mutex> lock( m_jobMutex );
+		return m_jobRunning;
+	}
+
+	// block until all queued async jobs have finished
+	void waitForAsync()
+	{
+		std::unique_lock<std::mutex> lock( m_jobMutex );
+		m_jobsFinished.wait( lock, [this] { return !m_jobRunning; } );
+	}
+
+	/* called once per iteration with the iteration number (starting at 1), from the thread running the alignment.
+	 * a running alignment keeps the callback it started with */
+	void setProgressCallback( std::function<void( int )> callback )
+	{
+		std::lock_guard<std::mutex> lock( m_stateMutex );
+		m_progressCallback = std::move( callback );
+	}
 
-		m_icp.setInputSource( m_sourceCloud );
-		m_icp.setInputTarget( m_targetCloud );
+	/* coarse-to-fine mode: source and target are voxel downsampled at each leaf size (coarsest first) and
+	 * aligned level by level, each level's transform seeding the next, before a final full resolution pass.
+	 * a level's max correspondence distance is leafSize * distanceScale, so it shrinks with the leaf size;
+	 * the full resolution pass uses setMaxCorrespondenceDistance(). an empty list disables the pyramid */
+	void setPyramid( std::vector<float> leafSizes, float distanceScale = 4.f, bool approximate = false )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		std::sort( leafSizes.begin(), leafSizes.end(), std::greater<float>() );
+		m_pyramid.clear();
+		for ( float leafSize : leafSizes ) {
+			if ( leafSize <= 0.f ) continue;
+			PyramidLevel level;
+			level.leafSize = leafSize;
+			m_pyramid.push_back( level );
+		}
+		m_pyramidDistanceScale = distanceScale;
+		m_pyramidApproximate   = approximate;
+		buildTargetPyramid();
+	}
 
-		m_outputCloud.clear();
-		m_icp.align( m_outputCloud );
+	void clearPyramid() { setPyramid( {} ); }
 
-		return hasConverged();
+	/* switch the registration engine. the per-target state (search trees, normals, covariances,
+	 * ndt grids) is rebuilt for the current target, the pyramid and other settings are kept */
+	void setMethod( AlignmentMethod method )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		m_method = method;
+		createEngine();
 	}
 
-	bool hasConverged() { return m_icp.hasConverged(); }
-	glm::mat4 getAlignmentMatrix() { return toOf( m_icp.getFinalTransformation() ); }
-	float getFitnessScore() { return m_icp.getFitnessScore(); }
+	AlignmentMethod getMethod() const { return m_method; }
+
+	/* replace all engine settings, rebuilding the per-target state */
+	void setSettings( const RegistrationSettings& settings )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		m_settings = settings;
+		createEngine();
+	}
 
-	const PointCloud& getOutput() { return m_outputCloud; }
+	const RegistrationSettings& getSettings() const { return m_settings; }
+
+	void setMaximumIterations( int iterations )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		m_settings.maxIterations = iterations;
+		m_engine->setSettings( m_settings );
+	}
+	void setTransformationEpsilon( float epsilon )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		m_settings.transformationEpsilon = epsilon;
+		m_engine->setSettings( m_settings );
+	}
+	// unused by NDT, <= 0 keeps the engine's default
+	void setMaxCorrespondenceDistance( float distance )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		m_maxCorrespondenceDistance = distance;
+	}
+
+	/* the last alignment that ran to the end, synchronous or async. safe to call while a job is running,
+	 * batch alignments and cancelled jobs don't change it */
+	AlignmentResult getLastResult() const
+	{
+		std::lock_guard<std::mutex> lock( m_stateMutex );
+		return m_lastResult;
+	}
+	bool hasConverged() const { return getLastResult().converged; }
+	glm::mat4 getAlignmentMatrix() const { return getLastResult().matrix; }
+	float getFitnessScore() const { return getLastResult().fitnessScore; }
+
+	// the source transformed by the last alignment. each alignment writes a new cloud, this one stays as is
+	PointCloud::ConstPtr getOutput() const
+	{
+		std::lock_guard<std::mutex> lock( m_stateMutex );
+		return m_lastOutput;
+	}
 
 protected:
-	pcl::IterativeClosestPoint<Point, Point> m_icp;
+	struct PyramidLevel
+	{
+		float leafSize = 0.f;
+		PointCloud::Ptr target;
+	};
+
+	struct Job
+	{
+		std::vector<glm::vec3> source;
+		std::vector<glm::vec3> target;
+		bool hasTarget  = false;
+		glm::mat4 guess = glm::mat4( 1. );
+		std::promise<AlignmentResult> promise;
+	};
+
+	void setTargetUnlocked( const PointCloud::ConstPtr& targetCloud )
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_stateMutex );
+			m_targetCloud = targetCloud;
+		}
+		buildTargetPyramid();
+	}
+
+	// downsampled targets are built once per target, and the engine prepares every level once
+	void buildTargetPyramid()
+	{
+		if ( !hasTarget() ) return;
+		for ( auto& level : m_pyramid ) {
+			level.target = getCloudPool().acquire();
+			downsample( m_targetCloud, level.leafSize, *level.target, m_pyramidApproximate );
+		}
+		setEngineTargets();
+	}
+
+	void createEngine()
+	{
+		m_engine = detail::createRegistrationEngine( m_method, m_settings, [this] { onIteration(); } );
+		if ( hasTarget() ) setEngineTargets();
+	}
+
+	// engine levels: the pyramid, coarsest first, then full resolution
+	void setEngineTargets()
+	{
+		std::vector<detail::TargetLevel> levels;
+		for ( const auto& level : m_pyramid ) {
+			detail::TargetLevel targetLevel;
+			targetLevel.cloud    = level.target;
+			targetLevel.leafSize = level.leafSize;
+			levels.push_back( targetLevel );
+		}
+		detail::TargetLevel full;
+		full.cloud = m_targetCloud;
+		levels.push_back( full );
+		m_engine->setTargets( levels );
+	}
+
+	// caller holds m_computeMutex
+	AlignmentResult compute( const PointCloud::ConstPtr& sourceCloud, const glm::mat4& guess )
+	{
+		AlignmentResult result;
+		if ( !hasTarget() || !sourceCloud || sourceCloud->empty() ) {
+			ofLogError( "ofxPcl::Alignment" ) << "align: source and target clouds must be non-empty";
+			return result;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock( m_stateMutex );
+			m_iterationCallback = m_progressCallback;
+		}
+		m_iteration            = 0;
+		PointCloud::Ptr output = getCloudPool().acquire( sourceCloud->size() );
+		result                 = alignLevels( *m_engine, sourceCloud, guess, m_levelSource, *output );
+		result.iterations      = m_iteration;
+		if ( !result.cancelled ) {
+			std::lock_guard<std::mutex> lock( m_stateMutex );
+			m_lastResult = result;
+			m_lastOutput = output;
+		}
+		return result;
+	}
+
+	/* coarse levels, each seeded with the previous level's result, then full resolution.
+	 * levelSource is scratch space for the downsampled source, drawn from the CloudPool on first use */
+	AlignmentResult alignLevels( detail::RegistrationEngine& engine, const PointCloud::ConstPtr& sourceCloud, const glm::mat4& guess, PointCloud::Ptr& levelSource, PointCloud& output ) const
+	{
+		AlignmentResult result;
+		uint64_t startTime        = ofGetElapsedTimeMicros();
+		Eigen::Matrix4f transform = toPcl( guess );
+		try {
+			for ( size_t i = 0; i < m_pyramid.size(); ++i ) {
+				const auto& level = m_pyramid[i];
+				if ( !levelSource ) levelSource = getCloudPool().acquire();
+				downsample( sourceCloud, level.leafSize, *levelSource, m_pyramidApproximate );
+				getSearchCache().invalidate( levelSource.get() );  // refilled in place with the source's header
+				if ( levelSource->empty() || level.target->empty() ) continue;
+
+				engine.align( i, levelSource, transform, level.leafSize * m_pyramidDistanceScale, output );
+				transform = engine.getFinalTransformation();
+			}
+
+			output.clear();
+			engine.align( m_pyramid.size(), sourceCloud, transform, m_maxCorrespondenceDistance, output );
+		} catch ( const AlignmentCancelled& ) {
+			result.cancelled = true;
+			result.elapsedMs = ( ofGetElapsedTimeMicros() - startTime ) / 1000.f;
+			return result;
+		}
+
+		result.converged    = engine.hasConverged();
+		result.matrix       = toOf( engine.getFinalTransformation() );
+		result.fitnessScore = static_cast<float>( engine.getFitnessScore() );
+		result.elapsedMs    = ( ofGetElapsedTimeMicros() - startTime ) / 1000.f;
+		return result;
+	}
+
+	std::vector<AlignmentResult> alignBatch( size_t count, const std::vector<glm::mat4>& guesses, const std::function<PointCloud::ConstPtr( size_t )>& getSource )
+	{
+		std::lock_guard<std::mutex> lock( m_computeMutex );
+		std::vector<AlignmentResult> results( count );
+		if ( !hasTarget() ) {
+			ofLogError( "ofxPcl::Alignment" ) << "alignBatch: no target set";
+			return results;
+		}
+		if ( !guesses.empty() && guesses.size() != count ) {
+			ofLogError( "ofxPcl::Alignment" ) << "alignBatch: got " << guesses.size() << " guesses for " << count << " sources";
+			return results;
+		}
+
+		// one engine per chunk of sources, forked from the prepared one
+		getThreadPool().parallelFor( 0, count, [&]( size_t begin, size_t end ) {
+			int iterations = 0;
+			auto engine    = m_engine->fork( [&iterations] { ++iterations; } );
+			PointCloud::Ptr levelSource;
+			PointCloud output;
+			for ( size_t i = begin; i < end; ++i ) {
+				PointCloud::ConstPtr source = getSource( i );
+				if ( !source || source->empty() ) {
+					ofLogError( "ofxPcl::Alignment" ) << "alignBatch: source " << i << " is empty";
+					continue;
+				}
+				iterations            = 0;
+				results[i]            = alignLevels( *engine, source, guesses.empty() ? glm::mat4( 1. ) : guesses[i], levelSource, output );
+				results[i].iterations = iterations;
+			}
+		} );
+		return results;
+	}
+
+	void onIteration()
+	{
+		if ( m_computingJob && m_cancelRequested ) throw AlignmentCancelled();
+		++m_iteration;
+		if ( m_iterationCallback ) m_iterationCallback( m_iteration );
+	}
+
+	std::future<AlignmentResult> enqueue( Job&& job )
+	{
+		std::future<AlignmentResult> future = job.promise.get_future();
+		std::unique_ptr<Job> superseded;
+		bool startWorker = false;
+		{
+			std::lock_guard<std::mutex> lock( m_jobMutex );
+			superseded = std::move( m_pendingJob );
+			m_pendingJob.reset( new Job( std::move( job ) ) );
+			if ( superseded && superseded->hasTarget && !m_pendingJob->hasTarget ) {
+				// keep the target of the dropped request
+				m_pendingJob->target    = std::move( superseded->target );
+				m_pendingJob->hasTarget = true;
+			}
+			if ( m_jobRunning ) {
+				if ( m_cancelRunningOnNew ) m_cancelRequested = true;
+			} else {
+				m_jobRunning = startWorker = true;
+			}
+		}
+		if ( superseded ) resolveCancelled( *superseded );
+		if ( startWorker ) getThreadPool().submit( [this] { runJobs(); } );
+		return future;
+	}
+
+	// worker loop: applies a pending method switch and runs the pending job until neither is left
+	void runJobs()
+	{
+		for ( ;; ) {
+			std::unique_ptr<Job> job;
+			bool switchMethod = false;
+			AlignmentMethod method = AlignmentMethod::ICP;
+			{
+				std::lock_guard<std::mutex> lock( m_jobMutex );
+				job                = std::move( m_pendingJob );
+				switchMethod       = m_hasPendingMethod;
+				method             = m_pendingMethod;
+				m_hasPendingMethod = false;
+				if ( !job && !switchMethod ) {
+					m_jobRunning      = false;
+					m_cancelRequested = false;  // a cancel that came in after the last job finished
+					m_jobsFinished.notify_all();
+					return;
+				}
+				m_cancelRequested = false;
+			}
+
+			if ( switchMethod ) setMethod( method );
+			if ( !job ) continue;
+
+			AlignmentResult result;
+			try {
+				std::lock_guard<std::mutex> lock( m_computeMutex );
+				JobScope scope( m_computingJob );
+				if ( job->hasTarget ) {
+					PointCloud::Ptr target = getCloudPool().acquire( job->target.size() );
+					toPcl( job->target, *target );
+					setTargetUnlocked( target );
+				}
+				if ( !m_sourceCloud ) m_sourceCloud = getCloudPool().acquire( job->source.size() );
+				toPcl( job->source, *m_sourceCloud );
+				++m_sourceCloud->header.seq;
+				result = compute( m_sourceCloud, job->guess );
+			} catch ( ... ) {
+				job->promise.set_exception( std::current_exception() );
+				continue;
+			}
+			job->promise.set_value( result );
+		}
+	}
+
+	// marks the compute as an async job's, cancel() only aborts those and never a synchronous align
+	struct JobScope
+	{
+		explicit JobScope( bool& computingJob )
+		    : m_computingJob( computingJob )
+		{
+			m_computingJob = true;
+		}
+		~JobScope() { m_computingJob = false; }
+		bool& m_computingJob;
+	};
+
+	static void resolveCancelled( Job& job )
+	{
+		AlignmentResult result;
+		result.cancelled = true;
+		job.promise.set_value( result );
+	}
+
+	std::atomic<AlignmentMethod> m_method;  // read by getMethod() while the worker switches engines
+	RegistrationSettings m_settings;
+	std::unique_ptr<detail::RegistrationEngine> m_engine;
 	PointCloud::Ptr m_sourceCloud;
-	PointCloud::Ptr m_targetCloud;
-	PointCloud m_outputCloud;
+	PointCloud::ConstPtr m_targetCloud;  // written under m_computeMutex and m_stateMutex, either guards reads
+
+	// coarse-to-fine levels, coarsest first
+	std::vector<PyramidLevel> m_pyramid;
+	float m_pyramidDistanceScale = 4.f;
+	bool m_pyramidApproximate    = false;
+	float m_maxCorrespondenceDistance = -1.f;
+	PointCloud::Ptr m_levelSource;
+
+	// compute state, guarded by m_computeMutex
+	std::mutex m_computeMutex;
+	int m_iteration     = 0;
+	bool m_computingJob = false;
+	std::function<void( int )> m_iterationCallback;  // m_progressCallback when the alignment started
+
+	// what other threads read while a job runs, guarded by m_stateMutex
+	mutable std::mutex m_stateMutex;
+	std::function<void( int )> m_progressCallback;
+	AlignmentResult m_lastResult;
+	PointCloud::ConstPtr m_lastOutput = PointCloud::ConstPtr( new PointCloud );
+
+	// async job state, guarded by m_jobMutex
+	mutable std::mutex m_jobMutex;
+	std::condition_variable m_jobsFinished;
+	std::unique_ptr<Job> m_pendingJob;
+	AlignmentMethod m_pendingMethod = AlignmentMethod::ICP;
+	bool m_hasPendingMethod         = false;
+	bool m_jobRunning = false;
+	std::atomic<bool> m_cancelRequested{ false };
+	std::atomic<bool> m_cancelRunningOnNew{ false };
 };
 
 }  // namespace ofxPointCloudLibrary
\ No newline at end of file
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Types.hpp"
+
+#include <mutex>
+
+namespace ofxPointCloudLibrary {
+
+struct CloudPoolStats
+{
+	size_t allocations = 0;  // clouds created because none was free
+	size_t reuses      = 0;  // acquires served from the pool
+	size_t outstanding = 0;  // clouds handed out and not returned yet
+	size_t pooled      = 0;  // free clouds waiting in the pool
+	size_t pooledBytes = 0;  // point capacity held by the free clouds
+};
+
+/* recycles the point buffers of transient clouds: acquire() hands out a cloud that returns itself to the pool
+ * when its last shared pointer is dropped, keeping its capacity. steady per-frame pipelines stop allocating once
+ * the pool has warmed up. clouds outliving the pool are simply deleted */
+template <typename PointT = Point>
+class CloudPool
+{
+public:
+	using Cloud    = pcl::PointCloud<PointT>;
+	using CloudPtr = typename Cloud::Ptr;
+
+	// at most maxPooled free clouds are kept, others are deleted when returned
+	explicit CloudPool( size_t maxPooled = 32 )
+	    : m_state( std::make_shared<State>() )
+	{
+		m_state->maxPooled = maxPooled;
+	}
+
+	~CloudPool()
+	{
+		std::lock_guard<std::mutex> lock( m_state->mutex );
+		for ( auto* cloud : m_state->free ) delete cloud;
+		m_state->free.clear();
+		m_state->maxPooled = 0;
+	}
+
+	CloudPool( const CloudPool& ) = delete;
+	CloudPool& operator=( const CloudPool& ) = delete;
+
+	/* empty cloud with room for at least reserve points. picks the smallest free cloud that fits,
+	 * or grows the largest one */
+	CloudPtr acquire( size_t reserve = 0 )
+	{
+		Cloud* cloud = nullptr;
+		{
+			std::lock_guard<std::mutex> lock( m_state->mutex );
+			auto& free = m_state->free;
+			if ( !free.empty() ) {
+				size_t best = free.size(), largest = 0;
+				for ( size_t i = 0; i < free.size(); ++i ) {
+					size_t capacity = free[i]->points.capacity();
+					if ( capacity >= reserve && ( best == free.size() || capacity < free[best]->points.capacity() ) ) best = i;
+					if ( capacity > free[largest]->points.capacity() ) largest = i;
+				}
+				if ( best == free.size() ) best = largest;
+				cloud = free[best];
+				free.erase( free.begin() + best );
+				++m_state->stats.reuses;
+			} else {
+				++m_state->stats.allocations;
+			}
+			++m_state->stats.outstanding;
+		}
+		if ( !cloud ) cloud = new Cloud;
+		cloud->points.reserve( reserve );
+
+		std::shared_ptr<State> state = m_state;
+		return CloudPtr( cloud, [state]( Cloud* returned ) { release( *state, returned ); } );
+	}
+
+	// delete free clouds beyond maxPooled, e.g. after a burst of larger frames
+	void trim( size_t maxPooled = 0 )
+	{
+		std::lock_guard<std::mutex> lock( m_state->mutex );
+		auto& free = m_state->free;
+		while ( free.size() > maxPooled ) {
+			delete free.back();
+			free.pop_back();
+		}
+	}
+
+	void setMaxPooled( size_t maxPooled )
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_state->mutex );
+			m_state->maxPooled = maxPooled;
+		}
+		trim( maxPooled );
+	}
+
+	CloudPoolStats getStats() const
+	{
+		std::lock_guard<std::mutex> lock( m_state->mutex );
+		CloudPoolStats stats = m_state->stats;
+		stats.pooled         = m_state->free.size();
+		stats.pooledBytes    = 0;
+		for ( const auto* cloud : m_state->free ) stats.pooledBytes += cloud->points.capacity() * sizeof( PointT );
+		return stats;
+	}
+
+protected:
+	// shared with the deleters of handed out clouds
+	struct State
+	{
+		std::mutex mutex;
+		std::vector<Cloud*> free;
+		size_t maxPooled = 0;
+		CloudPoolStats stats;
+	};
+
+	static void release( State& state, Cloud* cloud )
+	{
+		// back to an empty cloud, keeping the point capacity
+		cloud->points.clear();
+		cloud->header              = pcl::PCLHeader();
+		cloud->width               = 0;
+		cloud->height              = 0;
+		cloud->is_dense            = true;
+		cloud->sensor_origin_      = Eigen::Vector4f::Zero();
+		cloud->sensor_orientation_ = Eigen::Quaternionf::Identity();
+
+		std::lock_guard<std::mutex> lock( state.mutex );
+		--state.stats.outstanding;
+		if ( state.free.size() < state.maxPooled ) {
+			state.free.push_back( cloud );
+		} else {
+			delete cloud;
+		}
+	}
+
+	std::shared_ptr<State> m_state;
+};
+
+// process wide pool per point type used by default
+template <typename PointT = Point>
+CloudPool<PointT>& getCloudPool()
+{
+	static CloudPool<PointT> pool;
+	return pool;
+}
+
+}  // namespace ofxPointCloudLibrary
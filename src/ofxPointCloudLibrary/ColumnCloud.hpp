@@ -0,0 +1,389 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Types.hpp"
+
+#include <cstdlib>
+#include <new>
+
+namespace ofxPointCloudLibrary {
+
+namespace detail {
+
+/* std allocator for 64 byte (cache line) aligned columns */
+template <typename T>
+struct CacheAlignedAllocator
+{
+	using value_type = T;
+	static constexpr size_t alignment = 64;
+
+	CacheAlignedAllocator() {}
+	template <typename U>
+	CacheAlignedAllocator( const CacheAlignedAllocator<U>& ) {}
+
+	T* allocate( size_t n )
+	{
+#ifdef _WIN32
+		void* data = _aligned_malloc( n * sizeof( T ), alignment );
+#else
+		void* data = nullptr;
+		if ( posix_memalign( &data, alignment, n * sizeof( T ) ) != 0 ) data = nullptr;
+#endif
+		if ( !data ) throw std::bad_alloc();
+		return static_cast<T*>( data );
+	}
+
+	void deallocate( T* data, size_t )
+	{
+#ifdef _WIN32
+		_aligned_free( data );
+#else
+		free( data );
+#endif
+	}
+
+	template <typename U>
+	bool operator==( const CacheAlignedAllocator<U>& ) const { return true; }
+	template <typename U>
+	bool operator!=( const CacheAlignedAllocator<U>& ) const { return false; }
+};
+
+}  // namespace detail
+
+/* structure of arrays cloud: x, y, z and the optional normal, color and intensity attributes each live in their
+ * own 64 byte aligned column, so passes over a single attribute only stream that attribute.
+ * columns are viewed as Eigen vectors without copying. pcl's algorithms need packed points, use toPcl / toColumns */
+class ColumnCloud
+{
+public:
+	using Column          = std::vector<float, detail::CacheAlignedAllocator<float>>;
+	using ColorColumn     = std::vector<uint32_t, detail::CacheAlignedAllocator<uint32_t>>;
+	using ColumnView      = Eigen::Map<Eigen::VectorXf, Eigen::Aligned64>;
+	using ConstColumnView = Eigen::Map<const Eigen::VectorXf, Eigen::Aligned64>;
+
+	ColumnCloud() {}
+	explicit ColumnCloud( size_t size ) { resize( size ); }
+
+	size_t size() const { return m_x.size(); }
+	bool empty() const { return m_x.empty(); }
+
+	// resizes the position columns and every enabled attribute column
+	void resize( size_t size )
+	{
+		for ( auto* column : { &m_x, &m_y, &m_z } ) column->resize( size );
+		if ( m_hasNormals ) {
+			for ( auto* column : { &m_normalX, &m_normalY, &m_normalZ } ) column->resize( size );
+		}
+		if ( m_hasColors ) m_rgba.resize( size );
+		if ( m_hasIntensity ) m_intensity.resize( size );
+	}
+
+	void clear() { resize( 0 ); }
+
+	void swap( ColumnCloud& other )
+	{
+		m_x.swap( other.m_x );
+		m_y.swap( other.m_y );
+		m_z.swap( other.m_z );
+		m_normalX.swap( other.m_normalX );
+		m_normalY.swap( other.m_normalY );
+		m_normalZ.swap( other.m_normalZ );
+		m_rgba.swap( other.m_rgba );
+		m_intensity.swap( other.m_intensity );
+		std::swap( m_hasNormals, other.m_hasNormals );
+		std::swap( m_hasColors, other.m_hasColors );
+		std::swap( m_hasIntensity, other.m_hasIntensity );
+	}
+
+	void reserve( size_t size )
+	{
+		for ( auto* column : { &m_x, &m_y, &m_z, &m_normalX, &m_normalY, &m_normalZ, &m_intensity } ) column->reserve( size );
+		m_rgba.reserve( size );
+	}
+
+	// attribute columns are allocated on demand and freed when disabled
+	void setHasNormals( bool hasNormals )
+	{
+		m_hasNormals = hasNormals;
+		for ( auto* column : { &m_normalX, &m_normalY, &m_normalZ } ) {
+			if ( hasNormals ) {
+				column->resize( size() );
+			} else {
+				Column().swap( *column );
+			}
+		}
+	}
+
+	void setHasColors( bool hasColors )
+	{
+		m_hasColors = hasColors;
+		if ( hasColors ) {
+			m_rgba.resize( size() );
+		} else {
+			ColorColumn().swap( m_rgba );
+		}
+	}
+
+	void setHasIntensity( bool hasIntensity )
+	{
+		m_hasIntensity = hasIntensity;
+		if ( hasIntensity ) {
+			m_intensity.resize( size() );
+		} else {
+			Column().swap( m_intensity );
+		}
+	}
+
+	bool hasNormals() const { return m_hasNormals; }
+	bool hasColors() const { return m_hasColors; }
+	bool hasIntensity() const { return m_hasIntensity; }
+
+	float* x() { return m_x.data(); }
+	float* y() { return m_y.data(); }
+	float* z() { return m_z.data(); }
+	float* normalX() { return m_normalX.data(); }
+	float* normalY() { return m_normalY.data(); }
+	float* normalZ() { return m_normalZ.data(); }
+	uint32_t* rgba() { return m_rgba.data(); }  // pcl's packed bgra bytes
+	float* intensity() { return m_intensity.data(); }
+
+	const float* x() const { return m_x.data(); }
+	const float* y() const { return m_y.data(); }
+	const float* z() const { return m_z.data(); }
+	const float* normalX() const { return m_normalX.data(); }
+	const float* normalY() const { return m_normalY.data(); }
+	const float* normalZ() const { return m_normalZ.data(); }
+	const uint32_t* rgba() const { return m_rgba.data(); }
+	const float* intensity() const { return m_intensity.data(); }
+
+	// zero copy Eigen views of a float column, e.g. getView( cloud.z() ).maxCoeff()
+	ColumnView getView( float* column ) { return ColumnView( column, size() ); }
+	ConstColumnView getView( const float* column ) const { return ConstColumnView( column, size() ); }
+
+	glm::vec3 getPosition( size_t i ) const { return { m_x[i], m_y[i], m_z[i] }; }
+	void setPosition( size_t i, const glm::vec3& position )
+	{
+		m_x[i] = position.x;
+		m_y[i] = position.y;
+		m_z[i] = position.z;
+	}
+
+	// bounding box of the finite points, false if there are none
+	bool getBounds( glm::vec3& min, glm::vec3& max ) const
+	{
+		return simd::columnBounds( x(), y(), z(), size(), &min.x, &max.x ) > 0;
+	}
+
+	// mean of the finite points, false if there are none
+	bool getCentroid( glm::vec3& centroid ) const
+	{
+		double sum[3];
+		size_t count = simd::columnSum( x(), y(), z(), size(), sum );
+		if ( count == 0 ) return false;
+		centroid = glm::vec3( sum[0] / count, sum[1] / count, sum[2] / count );
+		return true;
+	}
+
+	// transform positions in place, normals are rotated by the linear part of matrix
+	void transform( const glm::mat4& matrix )
+	{
+		transform( matrix, *this );
+	}
+
+	void transform( const glm::mat4& matrix, ColumnCloud& output ) const
+	{
+		if ( &output != this ) {
+			output.setHasNormals( m_hasNormals );
+			output.setHasColors( m_hasColors );
+			output.setHasIntensity( m_hasIntensity );
+			output.resize( size() );
+			output.m_rgba      = m_rgba;
+			output.m_intensity = m_intensity;
+		}
+		const float* m = &matrix[0][0];
+		simd::columnTransform( m, true, x(), y(), z(), output.x(), output.y(), output.z(), size() );
+		if ( m_hasNormals ) simd::columnTransform( m, false, normalX(), normalY(), normalZ(), output.normalX(), output.normalY(), output.normalZ(), size() );
+	}
+
+	// indices of the points inside the box [min, max], as pcl::CropBox would return them
+	void cropBox( const glm::vec3& min, const glm::vec3& max, std::vector<int>& indices ) const
+	{
+		indices.clear();
+		simd::columnCropBox( x(), y(), z(), size(), &min.x, &max.x, indices );
+	}
+
+	// gather the points at indices into output, which may be this cloud
+	void extract( const std::vector<int>& indices, ColumnCloud& output ) const
+	{
+		if ( &output == this ) {
+			// gathering in place would overwrite points that are still to be read
+			ColumnCloud gathered;
+			extract( indices, gathered );
+			output.swap( gathered );
+			return;
+		}
+		output.setHasNormals( m_hasNormals );
+		output.setHasColors( m_hasColors );
+		output.setHasIntensity( m_hasIntensity );
+		output.resize( indices.size() );
+		auto gather = [&]( const float* src, float* dst ) {
+			for ( size_t i = 0; i < indices.size(); ++i ) dst[i] = src[indices[i]];
+		};
+		gather( x(), output.x() );
+		gather( y(), output.y() );
+		gather( z(), output.z() );
+		if ( m_hasNormals ) {
+			gather( normalX(), output.normalX() );
+			gather( normalY(), output.normalY() );
+			gather( normalZ(), output.normalZ() );
+		}
+		if ( m_hasIntensity ) gather( intensity(), output.intensity() );
+		if ( m_hasColors ) {
+			for ( size_t i = 0; i < indices.size(); ++i ) output.m_rgba[i] = m_rgba[indices[i]];
+		}
+	}
+
+protected:
+	Column m_x, m_y, m_z;
+	Column m_normalX, m_normalY, m_normalZ;
+	ColorColumn m_rgba;
+	Column m_intensity;
+	bool m_hasNormals   = false;
+	bool m_hasColors    = false;
+	bool m_hasIntensity = false;
+};
+
+namespace detail {
+
+// per attribute copies between pcl points and columns, no-ops for point types without the attribute
+template <typename PointT, bool = pcl::traits::has_normal<PointT>::value>
+struct NormalColumns
+{
+	static void toColumns( const pcl::PointCloud<PointT>&, ColumnCloud& ) {}
+	static void toPcl( const ColumnCloud&, pcl::PointCloud<PointT>& ) {}
+};
+
+template <typename PointT>
+struct NormalColumns<PointT, true>
+{
+	static void toColumns( const pcl::PointCloud<PointT>& cloud, ColumnCloud& columns )
+	{
+		columns.setHasNormals( true );
+		for ( size_t i = 0; i < cloud.size(); ++i ) {
+			columns.normalX()[i] = cloud[i].normal_x;
+			columns.normalY()[i] = cloud[i].normal_y;
+			columns.normalZ()[i] = cloud[i].normal_z;
+		}
+	}
+
+	static void toPcl( const ColumnCloud& columns, pcl::PointCloud<PointT>& cloud )
+	{
+		if ( !columns.hasNormals() ) return;
+		for ( size_t i = 0; i < cloud.size(); ++i ) {
+			cloud[i].normal_x = columns.normalX()[i];
+			cloud[i].normal_y = columns.normalY()[i];
+			cloud[i].normal_z = columns.normalZ()[i];
+		}
+	}
+};
+
+template <typename PointT, bool = pcl::traits::has_color<PointT>::value>
+struct ColorColumns
+{
+	static void toColumns( const pcl::PointCloud<PointT>&, ColumnCloud& ) {}
+	static void toPcl( const ColumnCloud&, pcl::PointCloud<PointT>& ) {}
+};
+
+template <typename PointT>
+struct ColorColumns<PointT, true>
+{
+	static void toColumns( const pcl::PointCloud<PointT>& cloud, ColumnCloud& columns )
+	{
+		columns.setHasColors( true );
+		for ( size_t i = 0; i < cloud.size(); ++i ) columns.rgba()[i] = cloud[i].rgba;
+	}
+
+	static void toPcl( const ColumnCloud& columns, pcl::PointCloud<PointT>& cloud )
+	{
+		if ( !columns.hasColors() ) return;
+		for ( size_t i = 0; i < cloud.size(); ++i ) cloud[i].rgba = columns.rgba()[i];
+	}
+};
+
+template <typename PointT, bool = pcl::traits::has_intensity<PointT>::value>
+struct IntensityColumns
+{
+	static void toColumns( const pcl::PointCloud<PointT>&, ColumnCloud& ) {}
+	static void toPcl( const ColumnCloud&, pcl::PointCloud<PointT>& ) {}
+};
+
+template <typename PointT>
+struct IntensityColumns<PointT, true>
+{
+	static void toColumns( const pcl::PointCloud<PointT>& cloud, ColumnCloud& columns )
+	{
+		columns.setHasIntensity( true );
+		for ( size_t i = 0; i < cloud.size(); ++i ) columns.intensity()[i] = cloud[i].intensity;
+	}
+
+	static void toPcl( const ColumnCloud& columns, pcl::PointCloud<PointT>& cloud )
+	{
+		if ( !columns.hasIntensity() ) return;
+		for ( size_t i = 0; i < cloud.size(); ++i ) cloud[i].intensity = columns.intensity()[i];
+	}
+};
+
+}  // namespace detail
+
+// ------------------------
+// ColumnCloud conversions
+// ------------------------
+
+// splits pcl points into columns, enabling the attributes PointT has
+template <typename PointT>
+void toColumns( const pcl::PointCloud<PointT>& pointCloud, ColumnCloud& columns )
+{
+	columns.setHasNormals( false );
+	columns.setHasColors( false );
+	columns.setHasIntensity( false );
+	columns.resize( pointCloud.size() );
+	for ( size_t i = 0; i < pointCloud.size(); ++i ) {
+		columns.x()[i] = pointCloud[i].x;
+		columns.y()[i] = pointCloud[i].y;
+		columns.z()[i] = pointCloud[i].z;
+	}
+	detail::NormalColumns<PointT>::toColumns( pointCloud, columns );
+	detail::ColorColumns<PointT>::toColumns( pointCloud, columns );
+	detail::IntensityColumns<PointT>::toColumns( pointCloud, columns );
+}
+
+// packs columns into pcl points, attributes missing on either side are left as PointT's defaults
+template <typename PointT>
+void toPcl( const ColumnCloud& columns, pcl::PointCloud<PointT>& pointCloud )
+{
+	pointCloud.resize( columns.size() );
+	pointCloud.width    = static_cast<uint32_t>( columns.size() );
+	pointCloud.height   = 1;
+	pointCloud.is_dense = false;
+	for ( size_t i = 0; i < columns.size(); ++i ) {
+		pointCloud[i].x = columns.x()[i];
+		pointCloud[i].y = columns.y()[i];
+		pointCloud[i].z = columns.z()[i];
+	}
+	detail::NormalColumns<PointT>::toPcl( columns, pointCloud );
+	detail::ColorColumns<PointT>::toPcl( columns, pointCloud );
+	detail::IntensityColumns<PointT>::toPcl( columns, pointCloud );
+}
+
+inline void toColumns( const std::vector<glm::vec3>& points, ColumnCloud& columns )
+{
+	columns.resize( points.size() );
+	for ( size_t i = 0; i < points.size(); ++i ) columns.setPosition( i, points[i] );
+}
+
+inline void toOf( const ColumnCloud& columns, std::vector<glm::vec3>& points )
+{
+	points.resize( columns.size() );
+	for ( size_t i = 0; i < columns.size(); ++i ) points[i] = columns.getPosition( i );
+}
+
+}  // namespace ofxPointCloudLibrary
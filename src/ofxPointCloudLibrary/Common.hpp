@@ -2,5 +2,26 @@
 
 // pcl
 #include <pcl/io/pcd_io.h>
+#include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/point_types.h>
-#include <pcl/registration/icp.h>
\ No newline at end of file
+#include <pcl/registration/correspondence_rejection_poly.h>
+#include <pcl/registration/gicp.h>
+#include <pcl/registration/icp.h>
+#include <pcl/registration/icp_nl.h>
+#include <pcl/registration/ndt.h>
+#include <pcl/registration/transformation_estimation_lm.h>
+#include <pcl/registration/transformation_estimation_point_to_plane_lls.h>
+#include <pcl/search/kdtree.h>
+#include <pcl/search/organized.h>
+
+// pcl modules shipped without import libs: instantiate their templates from the impl headers
+#include <pcl/features/normal_3d.h>
+#include <pcl/features/impl/normal_3d.hpp>
+#include <pcl/features/integral_image_normal.h>
+#include <pcl/features/impl/integral_image_normal.hpp>
+#include <pcl/filters/approximate_voxel_grid.h>
+#include <pcl/filters/impl/approximate_voxel_grid.hpp>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/filters/impl/voxel_grid.hpp>
+#include <pcl/filters/voxel_grid_covariance.h>
+#include <pcl/filters/impl/voxel_grid_covariance.hpp>
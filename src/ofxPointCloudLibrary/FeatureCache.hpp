@@ -0,0 +1,312 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Features.hpp"
+#include "ofxPointCloudLibrary/Filters.hpp"
+#include "ofxPointCloudLibrary/Normals.hpp"
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+/* parameters of the feature cache, the radius is a multiple of leafSize like in GlobalAlignmentSettings */
+struct FeatureCacheSettings
+{
+	float leafSize       = 1.f;  // keypoint voxel size, in cloud units
+	int normalNeighbours = 15;   // k for the keypoint normals
+	float featureRadius  = 5.f;  // fpfh neighborhood radius, * leafSize
+	int numThreads       = 0;    // 0 uses the whole ThreadPool
+};
+
+// what the last update() recomputed
+struct FeatureCacheStats
+{
+	size_t keypoints    = 0;  // keypoints in the cache
+	size_t newKeypoints = 0;  // voxels seen for the first time
+	size_t moved        = 0;  // keypoints that got points or were invalidated, new ones included
+	size_t normals      = 0;  // normals recomputed
+	size_t histograms   = 0;  // simplified histograms recomputed
+	size_t features     = 0;  // descriptors recomputed
+	float elapsedMs     = 0.f;
+};
+
+/* fpfh descriptors of a growing cloud, e.g. an incremental scan, kept up to date without recomputing the whole
+ * cloud. points are accumulated into voxels of leafSize, each voxel's centroid is a keypoint whose id is its
+ * index in getKeypoints(), stable for the lifetime of the cache. an update only recomputes what the changed
+ * voxels can reach: normals whose k neighbors may differ, the simplified histograms within featureRadius of
+ * those, and the descriptors within featureRadius of the histograms. the results are identical to
+ * computeNormals and computeFpfh over the final keypoints, the example's "check feature cache" button compares
+ * them batch by batch. points can only be added */
+class FeatureCache
+{
+public:
+	explicit FeatureCache( const FeatureCacheSettings& settings = FeatureCacheSettings() )
+	    : m_settings( settings )
+	{
+		clear();
+	}
+
+	FeatureCache( const FeatureCache& ) = delete;
+	FeatureCache& operator=( const FeatureCache& ) = delete;
+
+	// drops all keypoints and descriptors, the settings are kept
+	void clear()
+	{
+		m_map = detail::VoxelMap();
+		m_voxels.clear();
+		m_keypoints.reset( new PointCloud );
+		m_normals.reset( new pcl::PointCloud<pcl::Normal> );
+		m_features.reset( new FeatureCloud );
+		m_neighborRadii.clear();
+		m_spfh.clear();
+		m_moved.clear();
+		m_isMoved.clear();
+		m_updated.clear();
+		m_stats = FeatureCacheStats();
+	}
+
+	const FeatureCacheSettings& getSettings() const { return m_settings; }
+
+	/* accumulate points into their voxels and update the descriptors. non-finite points are skipped */
+	void addPoints( const std::vector<glm::vec3>& points )
+	{
+		accumulate( points.empty() ? nullptr : &points[0].x, 3, points.size() );
+		update();
+	}
+
+	void addPoints( const PointCloud& cloud )
+	{
+		accumulate( cloud.empty() ? nullptr : cloud.points[0].data, sizeof( Point ) / sizeof( float ), cloud.size() );
+		update();
+	}
+
+	/* mark the keypoints within radius of center as changed, e.g. after the points there were corrected
+	 * outside the cache. they and everything depending on them are recomputed by the next update() */
+	void invalidateRegion( const glm::vec3& center, float radius )
+	{
+		if ( m_keypoints->empty() ) return;
+		std::vector<int> indices;
+		std::vector<float> squaredDistances;
+		getSearchCache().getTree( m_keypoints )->radiusSearch( toPcl( center ), radius, indices, squaredDistances );
+		for ( int i : indices ) markMoved( i );
+	}
+
+	/* recompute what changed since the last update, called by addPoints() */
+	void update()
+	{
+		uint64_t startTime = ofGetElapsedTimeMicros();
+		const size_t n     = m_voxels.size();
+		const size_t nOld  = m_keypoints->size();
+		m_stats            = FeatureCacheStats();
+		m_stats.keypoints    = n;
+		m_stats.newKeypoints = n - nOld;
+		m_updated.clear();
+
+		std::vector<int> moved;
+		moved.swap( m_moved );
+		std::sort( moved.begin(), moved.end() );
+		for ( int i : moved ) m_isMoved[i] = 0;
+		m_stats.moved = moved.size();
+		if ( moved.empty() ) return;
+
+		// keypoints moved to their new centroids, new ones appended
+		m_keypoints->resize( n );
+		m_normals->resize( n );
+		m_features->resize( n );
+		m_neighborRadii.resize( n, 0.f );
+		m_spfh.resize( n * kBins, 0.f );
+		for ( int i : moved ) {
+			const Voxel& voxel = m_voxels[i];
+			Point& keypoint    = m_keypoints->points[i];
+			for ( int k = 0; k < 3; ++k ) keypoint.data[k] = static_cast<float>( voxel.sum[k] / voxel.count );
+			keypoint.data[3] = 1.f;
+		}
+		getSearchCache().invalidate( m_keypoints.get() );
+		auto tree                = getSearchCache().getTree( m_keypoints );
+		const float leafDiagonal = m_settings.leafSize * std::sqrt( 3.f );
+		const float radius       = m_settings.featureRadius * m_settings.leafSize;
+
+		// normals whose k nearest neighbors may have changed: a moved centroid now within the old k-th
+		// neighbor distance, plus the most it can have moved inside its voxel. keypoints that had fewer than
+		// k neighbors take in any keypoint, they are redone whatever moved
+		float maxReach = 0.f;
+		for ( size_t i = 0; i < nOld; ++i ) {
+			if ( std::isfinite( m_neighborRadii[i] ) ) maxReach = std::max( maxReach, m_neighborRadii[i] );
+		}
+		std::vector<char> marked = markAround( *tree, moved, maxReach + leafDiagonal, [this, leafDiagonal]( int i, float squaredDistance ) {
+			float reach = m_neighborRadii[i] + leafDiagonal;
+			return squaredDistance <= reach * reach ? 1 : 0;
+		} );
+		for ( int i : moved ) marked[i] = 1;
+		for ( size_t i = 0; i < nOld; ++i ) {
+			if ( std::isinf( m_neighborRadii[i] ) ) marked[i] = 1;
+		}
+		std::vector<int> normals = markedIds( marked, 1 );
+		updateNormals( *tree, normals );
+
+		// simplified histograms with a neighbor that moved or got a new normal, then the descriptors weighting
+		// them or a moved neighbor. moved keypoints are searched a voxel diagonal further, they may have left.
+		// a single search twice as far finds both, a few descriptors more than needed are recomputed
+		const float reach = radius + leafDiagonal;
+		marked            = markAround( *tree, normals, 2.f * reach, [reach]( int, float squaredDistance ) { return squaredDistance <= reach * reach ? 2 : 1; } );
+		std::vector<int> histograms = markedIds( marked, 2 );
+		updateHistograms( *tree, histograms, radius );
+		m_updated = markedIds( marked, 1 );
+		updateFeatures( *tree, m_updated, radius );
+
+		m_stats.normals    = normals.size();
+		m_stats.histograms = histograms.size();
+		m_stats.features   = m_updated.size();
+		m_stats.elapsedMs  = ( ofGetElapsedTimeMicros() - startTime ) / 1000.f;
+	}
+
+	// one keypoint per voxel, indexed by keypoint id
+	PointCloud::ConstPtr getKeypoints() const { return m_keypoints; }
+	pcl::PointCloud<pcl::Normal>::ConstPtr getNormals() const { return m_normals; }
+	FeatureCloud::ConstPtr getFeatures() const { return m_features; }
+
+	/* ids of the keypoints whose descriptor changed in the last update, ascending. ids from
+	 * keypoints - newKeypoints on are new. downstream matching only has to redo these */
+	const std::vector<int>& getUpdatedKeypoints() const { return m_updated; }
+
+	const FeatureCacheStats& getStats() const { return m_stats; }
+
+protected:
+	static const int kBins = 3 * detail::fpfhBins;
+
+	void accumulate( const float* points, size_t stride, size_t count )
+	{
+		const float inverseLeafSize = 1.f / m_settings.leafSize;
+		for ( size_t i = 0; i < count; ++i ) {
+			const float* p = points + i * stride;
+			detail::VoxelKey key;
+			if ( !detail::getVoxelKey( p, inverseLeafSize, key ) ) continue;
+			bool inserted;
+			uint32_t index = m_map.findOrInsert( key, detail::hashVoxel( key ), static_cast<uint32_t>( m_voxels.size() ), inserted );
+			if ( inserted ) {
+				m_voxels.push_back( { { 0., 0., 0. }, 0 } );
+				m_isMoved.push_back( 0 );
+			}
+			Voxel& voxel = m_voxels[index];
+			for ( int k = 0; k < 3; ++k ) voxel.sum[k] += p[k];
+			++voxel.count;
+			markMoved( static_cast<int>( index ) );
+		}
+	}
+
+	void markMoved( int i )
+	{
+		if ( m_isMoved[i] ) return;
+		m_isMoved[i] = 1;
+		m_moved.push_back( i );
+	}
+
+	/* marks of the keypoints within radius of the seeds, searched in parallel. level( id, squaredDistance )
+	 * gives the mark of a neighbor, each keypoint keeps its highest */
+	template <typename Level>
+	std::vector<char> markAround( const pcl::search::Search<Point>& tree, const std::vector<int>& seeds, float radius, const Level& level ) const
+	{
+		std::vector<char> marked( m_keypoints->size(), 0 );
+		std::mutex markMutex;
+		getThreadPool().parallelFor( 0, seeds.size(), [&]( size_t begin, size_t end ) {
+			std::vector<std::pair<int, char>> found;
+			std::vector<int> indices;
+			std::vector<float> squaredDistances;
+			for ( size_t s = begin; s < end; ++s ) {
+				tree.radiusSearch( m_keypoints->points[seeds[s]], radius, indices, squaredDistances );
+				for ( size_t j = 0; j < indices.size(); ++j ) {
+					char mark = static_cast<char>( level( indices[j], squaredDistances[j] ) );
+					if ( mark > 0 ) found.emplace_back( indices[j], mark );
+				}
+			}
+			std::lock_guard<std::mutex> lock( markMutex );
+			for ( const auto& f : found ) marked[f.first] = std::max( marked[f.first], f.second );
+		}, numThreads() );
+		return marked;
+	}
+
+	// ascending ids of the keypoints marked at least minimum
+	static std::vector<int> markedIds( const std::vector<char>& marked, char minimum )
+	{
+		std::vector<int> ids;
+		for ( size_t i = 0; i < marked.size(); ++i ) {
+			if ( marked[i] >= minimum ) ids.push_back( static_cast<int>( i ) );
+		}
+		return ids;
+	}
+
+	// computeNormals for the listed keypoints, keeping each one's k-th neighbor distance (infinite with fewer)
+	void updateNormals( const pcl::search::Search<Point>& tree, const std::vector<int>& ids )
+	{
+		const int k = m_settings.normalNeighbours;
+		getThreadPool().parallelFor( 0, ids.size(), [&]( size_t begin, size_t end ) {
+			std::vector<int> indices;
+			std::vector<float> squaredDistances;
+			for ( size_t j = begin; j < end; ++j ) {
+				const int i         = ids[j];
+				pcl::Normal& normal = m_normals->points[i];
+				const int found     = tree.nearestKSearch( m_keypoints->points[i], k, indices, squaredDistances );
+				m_neighborRadii[i]  = found >= k ? std::sqrt( squaredDistances.back() ) : std::numeric_limits<float>::infinity();
+				detail::estimateNormal( *m_keypoints, i, found > 0 ? &indices : nullptr, m_keypoints->sensor_origin_, normal.normal, normal.curvature );
+			}
+		}, numThreads() );
+	}
+
+	void updateHistograms( const pcl::search::Search<Point>& tree, const std::vector<int>& ids, float radius )
+	{
+		getThreadPool().parallelFor( 0, ids.size(), [&]( size_t begin, size_t end ) {
+			std::vector<int> indices;
+			std::vector<float> squaredDistances;
+			for ( size_t j = begin; j < end; ++j ) {
+				const int i = ids[j];
+				float* spfh = &m_spfh[i * kBins];
+				std::fill( spfh, spfh + kBins, 0.f );
+				if ( tree.radiusSearch( m_keypoints->points[i], radius, indices, squaredDistances ) > 0 ) detail::computeSpfh( *m_keypoints, *m_normals, i, indices, spfh );
+			}
+		}, numThreads() );
+	}
+
+	void updateFeatures( const pcl::search::Search<Point>& tree, const std::vector<int>& ids, float radius )
+	{
+		getThreadPool().parallelFor( 0, ids.size(), [&]( size_t begin, size_t end ) {
+			std::vector<int> indices;
+			std::vector<float> squaredDistances;
+			for ( size_t j = begin; j < end; ++j ) {
+				float* histogram = m_features->points[ids[j]].histogram;
+				if ( tree.radiusSearch( m_keypoints->points[ids[j]], radius, indices, squaredDistances ) > 0 ) {
+					detail::weightSpfh( m_spfh, indices, squaredDistances, histogram );
+				} else {
+					std::fill( histogram, histogram + kBins, std::numeric_limits<float>::quiet_NaN() );
+				}
+			}
+		}, numThreads() );
+		m_features->is_dense = std::all_of( m_features->points.begin(), m_features->points.end(), []( const pcl::FPFHSignature33& feature ) { return std::isfinite( feature.histogram[0] ); } );
+	}
+
+	size_t numThreads() const { return static_cast<size_t>( std::max( 0, m_settings.numThreads ) ); }
+
+	FeatureCacheSettings m_settings;
+	FeatureCacheStats m_stats;
+
+	struct Voxel
+	{
+		double sum[3];  // centroid
+		uint32_t count;
+	};
+
+	// voxel accumulators, indexed by keypoint id
+	detail::VoxelMap m_map;
+	std::vector<Voxel> m_voxels;
+
+	PointCloud::Ptr m_keypoints;
+	pcl::PointCloud<pcl::Normal>::Ptr m_normals;
+	FeatureCloud::Ptr m_features;
+	std::vector<float> m_neighborRadii;  // distance to each keypoint's k-th neighbor when its normal was computed, or infinity
+	std::vector<float> m_spfh;           // simplified histograms, kBins per keypoint
+
+	std::vector<int> m_moved;  // keypoints changed since the last update
+	std::vector<char> m_isMoved;
+	std::vector<int> m_updated;
+};
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+// fast point feature histograms, 33 bins per point
+using FeatureCloud = pcl::PointCloud<pcl::FPFHSignature33>;
+
+namespace detail {
+
+const int fpfhBins = 11;  // per angle feature, pcl's split of the 33 bins
+
+/* pcl::computePairFeatures, which lives in the features library the addon has no import lib for: the angles
+ * of the darboux frame between two oriented points, and their distance. false for coincident points or
+ * a degenerate frame */
+inline bool computePairFeatures( const Eigen::Vector4f& p1, const Eigen::Vector4f& n1, const Eigen::Vector4f& p2, const Eigen::Vector4f& n2, float& f1, float& f2, float& f3, float& f4 )
+{
+	Eigen::Vector4f dp2p1 = p2 - p1;
+	dp2p1[3]              = 0.f;
+	f4                    = dp2p1.norm();
+	if ( f4 == 0.f ) {
+		f1 = f2 = f3 = f4 = 0.f;
+		return false;
+	}
+
+	Eigen::Vector4f n1Copy = n1, n2Copy = n2;
+	n1Copy[3] = n2Copy[3] = 0.f;
+	float angle1          = n1Copy.dot( dp2p1 ) / f4;
+	float angle2          = n2Copy.dot( dp2p1 ) / f4;
+	// the point whose normal is closer to the connecting line comes first, so both orders give the same features
+	if ( std::acos( std::fabs( angle1 ) ) > std::acos( std::fabs( angle2 ) ) ) {
+		n1Copy    = n2;
+		n2Copy    = n1;
+		n1Copy[3] = n2Copy[3] = 0.f;
+		dp2p1 *= -1;
+		f3 = -angle2;
+	} else {
+		f3 = angle1;
+	}
+
+	// darboux frame u = n1, v = dp2p1 x u, w = u x v
+	Eigen::Vector4f v = dp2p1.cross3( n1Copy );
+	float vNorm       = v.norm();
+	if ( vNorm == 0.f ) {
+		f1 = f2 = f3 = f4 = 0.f;
+		return false;
+	}
+	v /= vNorm;
+	Eigen::Vector4f w = n1Copy.cross3( v );
+	v[3]              = 0.f;
+	f2                = v.dot( n2Copy );
+	w[3]              = 0.f;
+	f1                = std::atan2( w.dot( n2Copy ), n1Copy.dot( n2Copy ) );
+	return true;
+}
+
+// pcl::FPFHEstimation::computePointSPFHSignature: point i's pair features with its neighbors, binned into spfh
+inline void computeSpfh( const PointCloud& cloud, const pcl::PointCloud<pcl::Normal>& normals, int i, const std::vector<int>& neighbors, float* spfh )
+{
+	const float inversePi2 = 1.f / ( 2.f * static_cast<float>( M_PI ) );
+	const float increment  = 100.f / static_cast<float>( neighbors.size() - 1 );
+	auto bin               = []( double value ) { return std::min( std::max( static_cast<int>( std::floor( value ) ), 0 ), fpfhBins - 1 ); };
+
+	float f1, f2, f3, f4;
+	for ( int neighbor : neighbors ) {
+		if ( neighbor == i ) continue;
+		// like pcl's member computePairFeatures the result is ignored, degenerate pairs are binned as all zero angles
+		computePairFeatures( cloud.points[i].getVector4fMap(), normals.points[i].getNormalVector4fMap(), cloud.points[neighbor].getVector4fMap(), normals.points[neighbor].getNormalVector4fMap(), f1, f2, f3, f4 );
+		spfh[bin( fpfhBins * ( ( f1 + M_PI ) * inversePi2 ) )] += increment;
+		spfh[fpfhBins + bin( fpfhBins * ( ( f2 + 1.0 ) * 0.5 ) )] += increment;
+		spfh[2 * fpfhBins + bin( fpfhBins * ( ( f3 + 1.0 ) * 0.5 ) )] += increment;
+	}
+}
+
+/* pcl::FPFHEstimation::weightPointSPFHSignature: the neighbors' spfh weighted by inverse squared distance,
+ * each angle feature's bins scaled to sum to 100 */
+inline void weightSpfh( const std::vector<float>& spfh, const std::vector<int>& neighbors, const std::vector<float>& squaredDistances, float* fpfh )
+{
+	const int nBins = 3 * fpfhBins;
+	double sums[3]  = { 0.0, 0.0, 0.0 };
+	std::fill( fpfh, fpfh + nBins, 0.f );
+	for ( size_t j = 0; j < neighbors.size(); ++j ) {
+		if ( squaredDistances[j] == 0 ) continue;  // the point itself
+		const float weight    = 1.f / squaredDistances[j];
+		const float* neighbor = &spfh[neighbors[j] * nBins];
+		for ( int b = 0; b < nBins; ++b ) {
+			float value = neighbor[b] * weight;
+			sums[b / fpfhBins] += value;
+			fpfh[b] += value;
+		}
+	}
+	for ( int b = 0; b < nBins; ++b ) {
+		double sum = sums[b / fpfhBins];
+		if ( sum != 0 ) fpfh[b] *= static_cast<float>( 100.0 / sum );
+	}
+}
+
+}  // namespace detail
+
+/* pcl::FPFHEstimationOMP's two passes on the ThreadPool (numThreads == 0 uses the whole pool), for every point
+ * with the cloud itself as search surface. the radius neighborhoods come from the SearchCache and are searched
+ * once for both passes, where pcl searches twice (a cloud changed in place needs a new header.seq or
+ * getSearchCache().invalidate() for that). points that aren't finite or have no neighbors get nan
+ * histograms and clear is_dense */
+inline void computeFpfh( const PointCloud::ConstPtr& pointCloud, const pcl::PointCloud<pcl::Normal>& normals, float radius, FeatureCloud& features, size_t numThreads = 0 )
+{
+	const size_t n = pointCloud->size();
+	features.resize( n );
+	features.header   = pointCloud->header;
+	features.width    = pointCloud->width;
+	features.height   = pointCloud->height;
+	features.is_dense = true;
+	if ( normals.size() != n ) {
+		ofLogError( "ofxPcl::computeFpfh" ) << normals.size() << " normals for " << n << " points";
+		return;
+	}
+	if ( n == 0 ) return;
+	const int nBins = 3 * detail::fpfhBins;
+
+	// radius neighborhoods, shared by both passes
+	std::vector<std::vector<int>> neighbors( n );
+	std::vector<std::vector<float>> squaredDistances( n );
+	auto search = getSearchCache().getSearch( pointCloud );
+	getThreadPool().parallelFor( 0, n, [&]( size_t begin, size_t end ) {
+		for ( size_t i = begin; i < end; ++i ) {
+			const Point& point = pointCloud->points[i];
+			if ( pcl::isFinite( point ) ) search->radiusSearch( point, radius, neighbors[i], squaredDistances[i] );
+		}
+	}, numThreads );
+
+	// simplified histograms of every point, one row each
+	std::vector<float> spfh( n * nBins, 0.f );
+	getThreadPool().parallelFor( 0, n, [&]( size_t begin, size_t end ) {
+		for ( size_t i = begin; i < end; ++i ) {
+			if ( !neighbors[i].empty() ) detail::computeSpfh( *pointCloud, normals, static_cast<int>( i ), neighbors[i], &spfh[i * nBins] );
+		}
+	}, numThreads );
+
+	std::atomic<bool> dense{ true };
+	getThreadPool().parallelFor( 0, n, [&]( size_t begin, size_t end ) {
+		bool chunkDense = true;
+		for ( size_t i = begin; i < end; ++i ) {
+			float* histogram = features.points[i].histogram;
+			if ( neighbors[i].empty() ) {
+				std::fill( histogram, histogram + nBins, std::numeric_limits<float>::quiet_NaN() );
+				chunkDense = false;
+				continue;
+			}
+			detail::weightSpfh( spfh, neighbors[i], squaredDistances[i], histogram );
+		}
+		if ( !chunkDense ) dense = false;
+	}, numThreads );
+	features.is_dense = dense;
+}
+
+}  // namespace ofxPointCloudLibrary
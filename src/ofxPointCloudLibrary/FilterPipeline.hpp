@@ -0,0 +1,356 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/CloudPool.hpp"
+#include "ofxPointCloudLibrary/Filters.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+#include <string>
+
+namespace ofxPointCloudLibrary {
+
+// time spent in one step of a FilterPipeline, fused stages share a step
+struct FilterStageTiming
+{
+	std::string name;  // stage names joined by '+' when fused, e.g. "cropBox+passThrough+voxelGrid"
+	size_t inputPoints  = 0;
+	size_t outputPoints = 0;
+	float elapsedMs     = 0.f;
+};
+
+namespace detail {
+
+// axis aligned box test, infinite bounds for the axes a pass through doesn't filter
+struct FilterBox
+{
+	float min[3];
+	float max[3];
+	bool negative;
+};
+
+// true for finite points that pass every box, inclusive bounds like pcl::CropBox and pcl::PassThrough
+struct FilterBoxes
+{
+	const FilterBox* boxes;
+	size_t count;
+
+	bool operator()( const float* p ) const
+	{
+		if ( !std::isfinite( p[0] ) || !std::isfinite( p[1] ) || !std::isfinite( p[2] ) ) return false;
+		for ( size_t b = 0; b < count; ++b ) {
+			const FilterBox& box = boxes[b];
+			bool inside          = p[0] >= box.min[0] && p[0] <= box.max[0] && p[1] >= box.min[1] && p[1] <= box.max[1] && p[2] >= box.min[2] && p[2] <= box.max[2];
+			if ( inside == box.negative ) return false;
+		}
+		return true;
+	}
+};
+
+/* indices of the points keep accepts, over all n points or the n listed in indices. chunks are tested in
+ * parallel and concatenated in order, so the result is ascending */
+template <typename Keep>
+void selectPoints( const float* points, size_t stride, const int* indices, size_t n, const Keep& keep, std::vector<int>& output )
+{
+	auto& pool              = getThreadPool();
+	const size_t numThreads = std::max<size_t>( 1, std::min( pool.getNumThreads(), n / 65536 ) );
+	const size_t numChunks  = numThreads == 1 ? 1 : numThreads * 4;
+	const size_t chunkSize  = ( n + numChunks - 1 ) / numChunks;
+	std::vector<std::vector<int>> selected( numChunks );
+	pool.parallelFor( 0, numChunks, [&]( size_t chunkBegin, size_t chunkEnd ) {
+		for ( size_t chunk = chunkBegin; chunk < chunkEnd; ++chunk ) {
+			auto& chunkSelected = selected[chunk];
+			for ( size_t j = chunk * chunkSize; j < std::min( n, ( chunk + 1 ) * chunkSize ); ++j ) {
+				int i = indices ? indices[j] : static_cast<int>( j );
+				if ( keep( points + size_t( i ) * stride ) ) chunkSelected.push_back( i );
+			}
+		}
+	}, numThreads );
+
+	size_t total = 0;
+	for ( const auto& chunkSelected : selected ) total += chunkSelected.size();
+	output.clear();
+	output.reserve( total );
+	for ( const auto& chunkSelected : selected ) output.insert( output.end(), chunkSelected.begin(), chunkSelected.end() );
+}
+
+}  // namespace detail
+
+/* declarative chain of the usual per frame preprocessing: crop box, pass through, voxel grid and statistical
+ * or radius outlier removal. instead of copying a cloud per stage, stages narrow down a shared index list over the input.
+ * consecutive crop and pass through stages are fused into one pass, and into the voxel grid when one follows.
+ * results match chaining the pcl filters (the voxel grid as voxelDownsample); non-finite points are dropped.
+ * getTimings() reports every step of the last filter() call */
+class FilterPipeline
+{
+public:
+	// keep points inside [min, max], or outside when negative
+	FilterPipeline& cropBox( const glm::vec3& min, const glm::vec3& max, bool negative = false )
+	{
+		Stage stage;
+		stage.type = Stage::CROP_BOX;
+		stage.box  = { { min.x, min.y, min.z }, { max.x, max.y, max.z }, negative };
+		m_stages.push_back( stage );
+		return *this;
+	}
+
+	// keep points whose fieldName ("x", "y" or "z") is inside [min, max], or outside when negative
+	FilterPipeline& passThrough( const std::string& fieldName, float min, float max, bool negative = false )
+	{
+		int axis = fieldName == "x" ? 0 : fieldName == "y" ? 1 : fieldName == "z" ? 2 : -1;
+		if ( axis < 0 ) {
+			ofLogError( "ofxPcl::FilterPipeline" ) << "passThrough: unknown field " << fieldName << ", expected x, y or z";
+			return *this;
+		}
+		const float inf = std::numeric_limits<float>::infinity();
+		Stage stage;
+		stage.type = Stage::PASS_THROUGH;
+		stage.box  = { { -inf, -inf, -inf }, { inf, inf, inf }, negative };
+		stage.box.min[axis] = min;
+		stage.box.max[axis] = max;
+		m_stages.push_back( stage );
+		return *this;
+	}
+
+	FilterPipeline& voxelGrid( float leafSize, VoxelSelection selection = VoxelSelection::CENTROID )
+	{
+		Stage stage;
+		stage.type      = Stage::VOXEL_GRID;
+		stage.leafSize  = leafSize;
+		stage.selection = selection;
+		m_stages.push_back( stage );
+		return *this;
+	}
+
+	/* pcl::StatisticalOutlierRemoval: drop points whose mean distance to their meanK neighbors is above
+	 * mean + stddevMul * stddev. approximateLeafSize as in removeStatisticalOutliers */
+	FilterPipeline& statisticalOutlierRemoval( int meanK, double stddevMul, float approximateLeafSize = 0.f )
+	{
+		if ( meanK < 1 ) {
+			ofLogError( "ofxPcl::FilterPipeline" ) << "statisticalOutlierRemoval: meanK must be at least 1";
+			return *this;
+		}
+		Stage stage;
+		stage.type                = Stage::STATISTICAL_OUTLIERS;
+		stage.meanK               = meanK;
+		stage.stddevMul           = stddevMul;
+		stage.approximateLeafSize = approximateLeafSize;
+		m_stages.push_back( stage );
+		return *this;
+	}
+
+	// pcl::RadiusOutlierRemoval: drop points with less than minNeighbors others within radius
+	FilterPipeline& radiusOutlierRemoval( double radius, int minNeighbors, float approximateLeafSize = 0.f )
+	{
+		if ( !( radius > 0. ) || minNeighbors < 0 ) {
+			ofLogError( "ofxPcl::FilterPipeline" ) << "radiusOutlierRemoval: radius must be positive and minNeighbors not negative";
+			return *this;
+		}
+		Stage stage;
+		stage.type                = Stage::RADIUS_OUTLIERS;
+		stage.radius              = radius;
+		stage.minNeighbors        = minNeighbors;
+		stage.approximateLeafSize = approximateLeafSize;
+		m_stages.push_back( stage );
+		return *this;
+	}
+
+	void clear() { m_stages.clear(); }
+	bool empty() const { return m_stages.empty(); }
+
+	bool filter( const PointCloud::ConstPtr& input, PointCloud& output )
+	{
+		if ( !input ) {
+			ofLogError( "ofxPcl::FilterPipeline" ) << "filter: input cloud is null";
+			return false;
+		}
+		Frame frame;
+		frame.cloud  = input;
+		frame.points = input->empty() ? nullptr : input->points[0].data;
+		frame.stride = sizeof( Point ) / sizeof( float );
+		frame.size   = input->size();
+		run( frame );
+
+		PointCloud result;
+		if ( frame.cloud && frame.indices ) {
+			pcl::copyPointCloud( *frame.cloud, *frame.indices, result );
+		} else if ( frame.cloud ) {
+			result = *frame.cloud;
+		} else {
+			std::vector<glm::vec3> points;
+			gather( frame, points );
+			toPcl( points, result );
+		}
+		result.header   = input->header;
+		result.is_dense = result.is_dense || !m_stages.empty();
+		output.swap( result );
+		return true;
+	}
+
+	PointCloud::Ptr filter( const PointCloud::ConstPtr& input )
+	{
+		PointCloud::Ptr output( new PointCloud );
+		filter( input, *output );
+		return output;
+	}
+
+	bool filter( const std::vector<glm::vec3>& input, std::vector<glm::vec3>& output )
+	{
+		Frame frame;
+		frame.points = input.empty() ? nullptr : &input[0].x;
+		frame.stride = 3;
+		frame.size   = input.size();
+		run( frame );
+
+		std::vector<glm::vec3> result;
+		if ( frame.cloud && !frame.indices ) {
+			toOf( *frame.cloud, result );
+		} else if ( frame.points == ( frame.voxels.empty() ? nullptr : &frame.voxels[0].x ) && !frame.indices ) {
+			result.swap( frame.voxels );
+		} else {
+			gather( frame, result );
+		}
+		output.swap( result );
+		return true;
+	}
+
+	// steps of the last filter() call in order
+	const std::vector<FilterStageTiming>& getTimings() const { return m_timings; }
+
+protected:
+	struct Stage
+	{
+		enum Type
+		{
+			CROP_BOX,
+			PASS_THROUGH,
+			VOXEL_GRID,
+			STATISTICAL_OUTLIERS,
+			RADIUS_OUTLIERS
+		};
+		Type type = CROP_BOX;
+		detail::FilterBox box;
+		float leafSize            = 0.f;
+		VoxelSelection selection  = VoxelSelection::CENTROID;
+		int meanK                 = 0;
+		double stddevMul          = 0.;
+		double radius             = 0.;
+		int minNeighbors          = 0;
+		float approximateLeafSize = 0.f;
+
+		const char* getName() const
+		{
+			switch ( type ) {
+				case CROP_BOX: return "cropBox";
+				case PASS_THROUGH: return "passThrough";
+				case VOXEL_GRID: return "voxelGrid";
+				case STATISTICAL_OUTLIERS: return "statisticalOutlierRemoval";
+				default: return "radiusOutlierRemoval";
+			}
+		}
+	};
+
+	/* the points a step works on: strided xyz floats, narrowed down by indices when set. cloud is the pcl cloud
+	 * the floats belong to, if any. voxels holds the output of a voxel grid step */
+	struct Frame
+	{
+		PointCloud::ConstPtr cloud;
+		const float* points = nullptr;
+		size_t stride       = 3;
+		size_t size         = 0;
+		pcl::IndicesPtr indices;
+		std::vector<glm::vec3> voxels;
+
+		size_t getNumPoints() const { return indices ? indices->size() : size; }
+	};
+
+	void run( Frame& frame )
+	{
+		m_timings.clear();
+		std::vector<detail::FilterBox> boxes;
+		for ( size_t s = 0; s < m_stages.size(); ) {
+			FilterStageTiming timing;
+			timing.inputPoints = frame.getNumPoints();
+			uint64_t startTime = ofGetElapsedTimeMicros();
+
+			// fuse a run of crop box and pass through stages, and the voxel grid after them
+			boxes.clear();
+			while ( s < m_stages.size() && ( m_stages[s].type == Stage::CROP_BOX || m_stages[s].type == Stage::PASS_THROUGH ) ) {
+				boxes.push_back( m_stages[s].box );
+				timing.name += timing.name.empty() ? "" : "+";
+				timing.name += m_stages[s++].getName();
+			}
+			const Stage* stage = s < m_stages.size() && ( boxes.empty() || m_stages[s].type == Stage::VOXEL_GRID ) ? &m_stages[s++] : nullptr;
+			if ( stage ) {
+				timing.name += timing.name.empty() ? "" : "+";
+				timing.name += stage->getName();
+			}
+
+			detail::FilterBoxes keep = { boxes.data(), boxes.size() };
+			const int* indices       = frame.indices ? frame.indices->data() : nullptr;
+			if ( stage && stage->type == Stage::VOXEL_GRID ) {
+				std::vector<glm::vec3> voxels;
+				detail::voxelDownsample( frame.points, frame.stride, indices, frame.getNumPoints(), stage->leafSize, stage->selection, voxels, keep );
+				setVoxels( frame, voxels );
+			} else if ( stage ) {
+				removeOutliers( frame, *stage );
+			} else {
+				pcl::IndicesPtr selected( new std::vector<int> );
+				detail::selectPoints( frame.points, frame.stride, indices, frame.getNumPoints(), keep, *selected );
+				frame.indices = selected;
+			}
+
+			timing.outputPoints = frame.getNumPoints();
+			timing.elapsedMs    = ( ofGetElapsedTimeMicros() - startTime ) / 1000.f;
+			m_timings.push_back( timing );
+		}
+	}
+
+	// copy of the frame's points
+	static void gather( const Frame& frame, std::vector<glm::vec3>& output )
+	{
+		output.resize( frame.getNumPoints() );
+		for ( size_t j = 0; j < output.size(); ++j ) {
+			const float* p = frame.points + ( frame.indices ? size_t( ( *frame.indices )[j] ) : j ) * frame.stride;
+			output[j]      = { p[0], p[1], p[2] };
+		}
+	}
+
+	static void setVoxels( Frame& frame, std::vector<glm::vec3>& voxels )
+	{
+		frame.voxels.swap( voxels );
+		frame.cloud.reset();
+		frame.points = frame.voxels.empty() ? nullptr : &frame.voxels[0].x;
+		frame.stride = 3;
+		frame.size   = frame.voxels.size();
+		frame.indices.reset();
+	}
+
+	static void removeOutliers( Frame& frame, const Stage& stage )
+	{
+		// the search needs a pcl cloud, only vector input and voxel output have to be converted
+		if ( !frame.cloud ) {
+			std::vector<glm::vec3> points;
+			gather( frame, points );
+			auto cloud = getCloudPool().acquire( points.size() );
+			toPcl( points, *cloud );
+			frame.voxels.clear();
+			frame.cloud   = cloud;
+			frame.points  = cloud->empty() ? nullptr : cloud->points[0].data;
+			frame.stride  = sizeof( Point ) / sizeof( float );
+			frame.size    = cloud->size();
+			frame.indices.reset();
+		}
+		pcl::IndicesPtr inliers( new std::vector<int> );
+		if ( stage.type == Stage::STATISTICAL_OUTLIERS ) {
+			detail::removeStatisticalOutliers( frame.cloud, frame.indices, stage.meanK, stage.stddevMul, stage.approximateLeafSize, *inliers );
+		} else {
+			detail::removeRadiusOutliers( frame.cloud, frame.indices, stage.radius, stage.minNeighbors, stage.approximateLeafSize, *inliers );
+		}
+		frame.indices = inliers;
+	}
+
+	std::vector<Stage> m_stages;
+	std::vector<FilterStageTiming> m_timings;
+};
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,486 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+#include <queue>
+
+namespace ofxPointCloudLibrary {
+
+/* voxel grid downsampling: one centroid per occupied voxel of size leafSize
+ * approximate uses pcl::ApproximateVoxelGrid (hashed, faster, may split voxels on hash collisions) */
+inline void downsample( const PointCloud::ConstPtr& pointCloud, float leafSize, PointCloud& output, bool approximate = false )
+{
+	if ( approximate ) {
+		pcl::ApproximateVoxelGrid<Point> grid;
+		grid.setLeafSize( leafSize, leafSize, leafSize );
+		grid.setInputCloud( pointCloud );
+		grid.filter( output );
+	} else {
+		pcl::VoxelGrid<Point> grid;
+		grid.setLeafSize( leafSize, leafSize, leafSize );
+		grid.setInputCloud( pointCloud );
+		grid.filter( output );
+	}
+}
+
+inline PointCloud::Ptr downsample( const PointCloud::ConstPtr& pointCloud, float leafSize, bool approximate = false )
+{
+	PointCloud::Ptr output( new PointCloud );
+	downsample( pointCloud, leafSize, *output, approximate );
+	return output;
+}
+
+// which point voxelDownsample keeps for each occupied voxel
+enum class VoxelSelection
+{
+	CENTROID,          // mean of the voxel's points, like pcl::VoxelGrid
+	FIRST,             // the voxel's first point in input order
+	CLOSEST_TO_CENTER  // the input point nearest the voxel center
+};
+
+namespace detail {
+
+struct VoxelKey
+{
+	int32_t x, y, z;
+	bool operator==( const VoxelKey& other ) const { return x == other.x && y == other.y && z == other.z; }
+};
+
+inline uint64_t hashVoxel( const VoxelKey& key )
+{
+	uint64_t h = uint64_t( uint32_t( key.x ) ) * 0x9E3779B97F4A7C15ull ^ uint64_t( uint32_t( key.y ) ) * 0xC2B2AE3D27D4EB4Full ^ uint64_t( uint32_t( key.z ) ) * 0x165667B19E3779F9ull;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ull;
+	return h ^ ( h >> 32 );
+}
+
+// false for points that aren't finite or whose voxel coordinates don't fit 32 bits.
+// voxels are floor( p * inverseLeafSize ) in float, as in pcl::VoxelGrid
+inline bool getVoxelKey( const float* p, float inverseLeafSize, VoxelKey& key )
+{
+	const float limit = 2147483520.f;  // largest float below 2^31
+	float v[3];
+	for ( int k = 0; k < 3; ++k ) {
+		v[k] = std::floor( p[k] * inverseLeafSize );
+		if ( !( v[k] >= -limit && v[k] <= limit ) ) return false;  // also catches nan
+	}
+	key = { int32_t( v[0] ), int32_t( v[1] ), int32_t( v[2] ) };
+	return true;
+}
+
+/* open addressing map from voxel to a dense voxel index, grown at half load */
+class VoxelMap
+{
+public:
+	explicit VoxelMap( size_t expected = 16 )
+	{
+		size_t capacity = 16;
+		while ( capacity < expected * 2 ) capacity *= 2;
+		m_slots.assign( capacity, Slot() );
+	}
+
+	// index of key, inserting nextIndex if it is new
+	uint32_t findOrInsert( const VoxelKey& key, uint64_t hash, uint32_t nextIndex, bool& inserted )
+	{
+		if ( ( m_size + 1 ) * 2 > m_slots.size() ) grow();
+		size_t mask = m_slots.size() - 1;
+		for ( size_t i = hash & mask;; i = ( i + 1 ) & mask ) {
+			Slot& slot = m_slots[i];
+			if ( slot.value == kEmpty ) {
+				slot.key   = key;
+				slot.value = nextIndex;
+				++m_size;
+				inserted = true;
+				return nextIndex;
+			}
+			if ( slot.key == key ) {
+				inserted = false;
+				return slot.value;
+			}
+		}
+	}
+
+	// index of key, false if it isn't in the map
+	bool find( const VoxelKey& key, uint64_t hash, uint32_t& index ) const
+	{
+		size_t mask = m_slots.size() - 1;
+		for ( size_t i = hash & mask;; i = ( i + 1 ) & mask ) {
+			const Slot& slot = m_slots[i];
+			if ( slot.value == kEmpty ) return false;
+			if ( slot.key == key ) {
+				index = slot.value;
+				return true;
+			}
+		}
+	}
+
+protected:
+	enum : uint32_t { kEmpty = 0xffffffff };
+
+	struct Slot
+	{
+		VoxelKey key   = { 0, 0, 0 };
+		uint32_t value = kEmpty;
+	};
+
+	void grow()
+	{
+		std::vector<Slot> slots( m_slots.size() * 2 );
+		size_t mask = slots.size() - 1;
+		for ( const auto& slot : m_slots ) {
+			if ( slot.value == kEmpty ) continue;
+			size_t i = hashVoxel( slot.key ) & mask;
+			while ( slots[i].value != kEmpty ) i = ( i + 1 ) & mask;
+			slots[i] = slot;
+		}
+		m_slots.swap( slots );
+	}
+
+	std::vector<Slot> m_slots;
+	size_t m_size = 0;
+};
+
+struct KeepAll
+{
+	bool operator()( const float* ) const { return true; }
+};
+
+/* hashed voxel grid over n strided xyz points, or over the n points listed in indices (ascending) when it isn't null.
+ * points for which keep( p ) is false are dropped in the same pass. points are partitioned by voxel hash into
+ * buckets that are reduced in parallel, each voxel lands in exactly one bucket. output is ordered by each voxel's
+ * first point, so it doesn't depend on the number of threads */
+template <typename Keep = KeepAll>
+void voxelDownsample( const float* points, size_t stride, const int* indices, size_t n, float leafSize, VoxelSelection selection, std::vector<glm::vec3>& output, const Keep& keep = Keep() )
+{
+	output.clear();
+	if ( n == 0 || !( leafSize > 0.f ) ) return;
+	if ( n >= 0xffffffffull ) {
+		ofLogError( "ofxPcl::voxelDownsample" ) << "more than 2^32 - 1 points";
+		return;
+	}
+	const float inverseLeafSize = 1.f / leafSize;
+	auto& pool                  = getThreadPool();
+	const size_t numThreads     = std::max<size_t>( 1, std::min( pool.getNumThreads(), n / 65536 ) );
+	const size_t numBuckets     = numThreads == 1 ? 1 : numThreads * 4;
+
+	struct Voxel
+	{
+		uint32_t first;
+		uint32_t count;
+		double sum[3];  // centroid
+		uint32_t best;  // closest to center
+		float bestDistance;
+	};
+	std::vector<std::vector<Voxel>> bucketVoxels( numBuckets );
+	std::atomic<size_t> skipped{ 0 };
+
+	// reduce a bucket's points, given in input order (all points if indices is null). voxels come out in order of their first point
+	auto reduce = [&]( std::vector<Voxel>& voxels, const uint32_t* order, size_t count, auto accept ) {
+		VoxelMap map( count / 8 );
+		size_t bucketSkipped = 0;
+		for ( size_t j = 0; j < count; ++j ) {
+			uint32_t i     = order ? order[j] : static_cast<uint32_t>( j );
+			const float* p = points + size_t( i ) * stride;
+			if ( !accept( p ) ) continue;
+			VoxelKey key;
+			if ( !getVoxelKey( p, inverseLeafSize, key ) ) {
+				++bucketSkipped;
+				continue;
+			}
+			bool inserted;
+			uint32_t index = map.findOrInsert( key, hashVoxel( key ), static_cast<uint32_t>( voxels.size() ), inserted );
+			if ( inserted ) voxels.push_back( { i, 0, { 0., 0., 0. }, i, std::numeric_limits<float>::max() } );
+			Voxel& voxel = voxels[index];
+			++voxel.count;
+			if ( selection == VoxelSelection::CENTROID ) {
+				for ( int k = 0; k < 3; ++k ) voxel.sum[k] += p[k];
+			} else if ( selection == VoxelSelection::CLOSEST_TO_CENTER ) {
+				float dx = p[0] - ( key.x + 0.5f ) * leafSize, dy = p[1] - ( key.y + 0.5f ) * leafSize, dz = p[2] - ( key.z + 0.5f ) * leafSize;
+				float distance = dx * dx + dy * dy + dz * dz;
+				if ( distance < voxel.bestDistance ) {
+					voxel.bestDistance = distance;
+					voxel.best         = i;
+				}
+			}
+		}
+		skipped += bucketSkipped;
+	};
+
+	if ( numBuckets == 1 ) {
+		reduce( bucketVoxels[0], reinterpret_cast<const uint32_t*>( indices ), n, keep );
+	} else {
+		// bucket of every point, counted per chunk of input. points keep rejects get no bucket,
+		// invalid voxels go to any bucket and reduce drops them
+		const uint16_t kRejected = static_cast<uint16_t>( numBuckets );
+		const size_t numChunks = numThreads * 4;
+		const size_t chunkSize = ( n + numChunks - 1 ) / numChunks;
+		std::vector<uint16_t> buckets( n );
+		std::vector<size_t> counts( numChunks * numBuckets, 0 );
+		pool.parallelFor( 0, numChunks, [&]( size_t chunkBegin, size_t chunkEnd ) {
+			for ( size_t chunk = chunkBegin; chunk < chunkEnd; ++chunk ) {
+				size_t* chunkCounts = &counts[chunk * numBuckets];
+				for ( size_t j = chunk * chunkSize; j < std::min( n, ( chunk + 1 ) * chunkSize ); ++j ) {
+					const float* p = points + size_t( indices ? indices[j] : j ) * stride;
+					if ( !keep( p ) ) {
+						buckets[j] = kRejected;
+						continue;
+					}
+					VoxelKey key = { 0, 0, 0 };
+					getVoxelKey( p, inverseLeafSize, key );
+					buckets[j] = static_cast<uint16_t>( ( hashVoxel( key ) >> 40 ) % numBuckets );
+					++chunkCounts[buckets[j]];
+				}
+			}
+		}, numThreads );
+
+		// stable scatter of point indices into their buckets
+		std::vector<size_t> offsets( numChunks * numBuckets );
+		std::vector<size_t> bucketBegin( numBuckets + 1, 0 );
+		size_t total = 0;
+		for ( size_t b = 0; b < numBuckets; ++b ) {
+			bucketBegin[b] = total;
+			for ( size_t chunk = 0; chunk < numChunks; ++chunk ) {
+				offsets[chunk * numBuckets + b] = total;
+				total += counts[chunk * numBuckets + b];
+			}
+		}
+		bucketBegin[numBuckets] = total;
+		std::vector<uint32_t> order( total );
+		pool.parallelFor( 0, numChunks, [&]( size_t chunkBegin, size_t chunkEnd ) {
+			for ( size_t chunk = chunkBegin; chunk < chunkEnd; ++chunk ) {
+				size_t* next = &offsets[chunk * numBuckets];
+				for ( size_t j = chunk * chunkSize; j < std::min( n, ( chunk + 1 ) * chunkSize ); ++j ) {
+					if ( buckets[j] != kRejected ) order[next[buckets[j]]++] = static_cast<uint32_t>( indices ? indices[j] : j );
+				}
+			}
+		}, numThreads );
+		std::vector<uint16_t>().swap( buckets );
+
+		pool.parallelFor( 0, numBuckets, [&]( size_t begin, size_t end ) {
+			for ( size_t b = begin; b < end; ++b ) reduce( bucketVoxels[b], order.data() + bucketBegin[b], bucketBegin[b + 1] - bucketBegin[b], KeepAll() );
+		}, numThreads );
+	}
+
+	// merge the buckets by first point
+	size_t numVoxels = 0;
+	for ( const auto& voxels : bucketVoxels ) numVoxels += voxels.size();
+	output.reserve( numVoxels );
+	using Head = std::pair<uint32_t, size_t>;  // first point, bucket
+	std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+	std::vector<size_t> position( numBuckets, 0 );
+	for ( size_t b = 0; b < numBuckets; ++b ) {
+		if ( !bucketVoxels[b].empty() ) heads.push( { bucketVoxels[b][0].first, b } );
+	}
+	while ( !heads.empty() ) {
+		size_t b = heads.top().second;
+		heads.pop();
+		const Voxel& voxel = bucketVoxels[b][position[b]++];
+		if ( position[b] < bucketVoxels[b].size() ) heads.push( { bucketVoxels[b][position[b]].first, b } );
+
+		if ( selection == VoxelSelection::CENTROID ) {
+			output.emplace_back( voxel.sum[0] / voxel.count, voxel.sum[1] / voxel.count, voxel.sum[2] / voxel.count );
+		} else {
+			const float* p = points + size_t( selection == VoxelSelection::FIRST ? voxel.first : voxel.best ) * stride;
+			output.emplace_back( p[0], p[1], p[2] );
+		}
+	}
+	if ( skipped ) ofLogVerbose( "ofxPcl::voxelDownsample" ) << skipped << " points skipped, not finite or too far out for leafSize";
+}
+
+
+// shared search from the SearchCache for whole clouds (organized like pcl's filters), a tree of its own for a subset
+inline pcl::search::Search<Point>::Ptr getSearch( const PointCloud::ConstPtr& cloud, const pcl::IndicesConstPtr& indices )
+{
+	if ( !indices ) return getSearchCache().getSearch( cloud );
+	pcl::search::KdTree<Point>::Ptr tree( new pcl::search::KdTree<Point>( false ) );
+	tree->setInputCloud( cloud, indices );
+	return tree;
+}
+
+/* value of query( point, neighbors, squaredDistances ) for each of the n points (listed in indices when it
+ * isn't null), nan for non-finite points. queries are split across the ThreadPool, each thread with its own
+ * result buffers. with approximateLeafSize > 0 only the first point of every voxel of that size is queried and
+ * the voxel's other points share its value */
+template <typename Query>
+void queryPoints( const PointCloud& cloud, const int* indices, size_t n, float approximateLeafSize, std::vector<float>& values, const Query& query )
+{
+	values.assign( n, std::numeric_limits<float>::quiet_NaN() );
+	auto pointAt = [&]( size_t j ) -> const Point& { return cloud.points[indices ? indices[j] : j]; };
+
+	// query all points, or one representative per voxel
+	std::vector<uint32_t> queried;
+	std::vector<uint32_t> voxelOf;
+	if ( approximateLeafSize > 0.f ) {
+		const float inverseLeafSize = 1.f / approximateLeafSize;
+		VoxelMap map( n / 8 );
+		voxelOf.assign( n, 0xffffffff );
+		for ( size_t j = 0; j < n; ++j ) {
+			const Point& point = pointAt( j );
+			VoxelKey key;
+			if ( !pcl::isFinite( point ) || !getVoxelKey( point.data, inverseLeafSize, key ) ) continue;
+			bool inserted;
+			voxelOf[j] = map.findOrInsert( key, hashVoxel( key ), static_cast<uint32_t>( queried.size() ), inserted );
+			if ( inserted ) queried.push_back( static_cast<uint32_t>( j ) );
+		}
+	} else {
+		queried.reserve( n );
+		for ( size_t j = 0; j < n; ++j ) {
+			if ( pcl::isFinite( pointAt( j ) ) ) queried.push_back( static_cast<uint32_t>( j ) );
+		}
+	}
+
+	std::vector<float> queriedValues( queried.size() );
+	getThreadPool().parallelFor( 0, queried.size(), [&]( size_t begin, size_t end ) {
+		std::vector<int> neighbors;
+		std::vector<float> squaredDistances;
+		for ( size_t q = begin; q < end; ++q ) queriedValues[q] = query( pointAt( queried[q] ), neighbors, squaredDistances );
+	} );
+
+	if ( voxelOf.empty() ) {
+		for ( size_t q = 0; q < queried.size(); ++q ) values[queried[q]] = queriedValues[q];
+	} else {
+		for ( size_t j = 0; j < n; ++j ) {
+			if ( voxelOf[j] != 0xffffffff ) values[j] = queriedValues[voxelOf[j]];
+		}
+	}
+}
+
+/* pcl::StatisticalOutlierRemoval over the n points listed in indices (all points when null), neighbors are
+ * searched among those points only. the per point kNN queries run in parallel, the statistics are summed
+ * in point order as in pcl, so inliers are identical to the serial filter. unlike pcl, non-finite points are
+ * dropped rather than kept */
+inline void removeStatisticalOutliers( const PointCloud::ConstPtr& cloud, const pcl::IndicesConstPtr& indices, int meanK, double stddevMul, float approximateLeafSize, std::vector<int>& inliers )
+{
+	inliers.clear();
+	size_t n = indices ? indices->size() : cloud->size();
+	if ( n == 0 ) return;
+	auto search = getSearch( cloud, indices );
+
+	// mean distance to the meanK neighbors, -1 when the search fails (pcl counts those as 0 and keeps them)
+	std::vector<float> distances;
+	queryPoints( *cloud, indices ? indices->data() : nullptr, n, approximateLeafSize, distances, [&]( const Point& point, std::vector<int>& neighbors, std::vector<float>& squaredDistances ) {
+		int found = search->nearestKSearch( point, meanK + 1, neighbors, squaredDistances );
+		if ( found == 0 ) return -1.f;
+		double sum = 0.;
+		for ( int k = 1; k < found; ++k ) sum += std::sqrt( squaredDistances[k] );  // k = 0 is the point itself
+		return static_cast<float>( sum / meanK );
+	} );
+
+	double sum = 0., squaredSum = 0.;
+	int validDistances = 0;
+	for ( float distance : distances ) {
+		if ( !( distance >= 0.f ) ) continue;
+		sum += distance;
+		squaredSum += distance * distance;
+		++validDistances;
+	}
+	// pcl's threshold is nan without two distances, and as it drops points above it that keeps them all
+	double threshold = std::numeric_limits<double>::infinity();
+	if ( validDistances >= 2 ) {
+		double mean     = sum / validDistances;
+		double variance = ( squaredSum - sum * sum / validDistances ) / ( validDistances - 1 );
+		threshold       = mean + stddevMul * std::sqrt( variance );
+	}
+
+	inliers.reserve( n );
+	for ( size_t j = 0; j < n; ++j ) {
+		if ( std::max( distances[j], 0.f ) <= threshold ) inliers.push_back( indices ? ( *indices )[j] : static_cast<int>( j ) );
+	}
+}
+
+/* pcl::RadiusOutlierRemoval over the n points listed in indices (all points when null): keeps points with at
+ * least minNeighbors other points within radius. queries run in parallel, inliers are identical to the serial
+ * filter on dense clouds. non-finite points are dropped */
+inline void removeRadiusOutliers( const PointCloud::ConstPtr& cloud, const pcl::IndicesConstPtr& indices, double radius, int minNeighbors, float approximateLeafSize, std::vector<int>& inliers )
+{
+	inliers.clear();
+	size_t n = indices ? indices->size() : cloud->size();
+	if ( n == 0 ) return;
+	auto search = getSearch( cloud, indices );
+
+	// the search includes the point itself, as in pcl's dense code path
+	const int k                   = minNeighbors + 1;
+	const double maxSquaredRadius = radius * radius;
+	std::vector<float> kept;
+	queryPoints( *cloud, indices ? indices->data() : nullptr, n, approximateLeafSize, kept, [&]( const Point& point, std::vector<int>& neighbors, std::vector<float>& squaredDistances ) {
+		return search->nearestKSearch( point, k, neighbors, squaredDistances ) == k && !( maxSquaredRadius < squaredDistances[k - 1] ) ? 1.f : 0.f;
+	} );
+
+	inliers.reserve( n );
+	for ( size_t j = 0; j < n; ++j ) {
+		if ( kept[j] == 1.f ) inliers.push_back( indices ? ( *indices )[j] : static_cast<int>( j ) );
+	}
+}
+
+}  // namespace detail
+
+/* voxel grid downsampling on a hashed sparse grid, split across the ThreadPool.
+ * unlike pcl::VoxelGrid there's no limit on the number of voxels the bounding box spans, only each voxel
+ * coordinate has to fit 32 bits. non-finite points are skipped. output is ordered by each voxel's first point */
+inline void voxelDownsample( const std::vector<glm::vec3>& points, float leafSize, std::vector<glm::vec3>& output, VoxelSelection selection = VoxelSelection::CENTROID )
+{
+	std::vector<glm::vec3> voxels;
+	detail::voxelDownsample( points.empty() ? nullptr : &points[0].x, 3, nullptr, points.size(), leafSize, selection, voxels );
+	output.swap( voxels );
+}
+
+inline void voxelDownsample( const PointCloud& pointCloud, float leafSize, PointCloud& output, VoxelSelection selection = VoxelSelection::CENTROID )
+{
+	std::vector<glm::vec3> voxels;
+	detail::voxelDownsample( pointCloud.empty() ? nullptr : pointCloud.points[0].data, sizeof( Point ) / sizeof( float ), nullptr, pointCloud.size(), leafSize, selection, voxels );
+	toPcl( voxels, output );
+	output.header   = pointCloud.header;
+	output.is_dense = true;
+}
+
+/* pcl::StatisticalOutlierRemoval with the kNN queries split across the ThreadPool, same inliers as the serial
+ * filter. approximateLeafSize > 0 queries one point per voxel of that size and applies
+ * its mean distance to the whole voxel, trading accuracy for fewer queries. non-finite points are dropped.
+ * the kd-tree is the SearchCache's, bump header.seq or invalidate() it after editing the cloud in place */
+inline bool removeStatisticalOutliers( const PointCloud::ConstPtr& pointCloud, int meanK, double stddevMul, PointCloud& output, float approximateLeafSize = 0.f )
+{
+	if ( meanK < 1 ) {
+		ofLogError( "ofxPcl::removeStatisticalOutliers" ) << "meanK must be at least 1";
+		return false;
+	}
+	std::vector<int> inliers;
+	detail::removeStatisticalOutliers( pointCloud, nullptr, meanK, stddevMul, approximateLeafSize, inliers );
+	pcl::copyPointCloud( *pointCloud, inliers, output );
+	output.is_dense = true;
+	return true;
+}
+
+inline PointCloud::Ptr removeStatisticalOutliers( const PointCloud::ConstPtr& pointCloud, int meanK, double stddevMul, float approximateLeafSize = 0.f )
+{
+	PointCloud::Ptr output( new PointCloud );
+	removeStatisticalOutliers( pointCloud, meanK, stddevMul, *output, approximateLeafSize );
+	return output;
+}
+
+/* pcl::RadiusOutlierRemoval with the queries split across the ThreadPool: keeps points with at least
+ * minNeighbors others within radius, same inliers as the serial filter on dense clouds.
+ * approximateLeafSize > 0 decides once per voxel of that size from the voxel's first point.
+ * searches the SearchCache's tree like removeStatisticalOutliers */
+inline bool removeRadiusOutliers( const PointCloud::ConstPtr& pointCloud, double radius, int minNeighbors, PointCloud& output, float approximateLeafSize = 0.f )
+{
+	if ( !( radius > 0. ) || minNeighbors < 0 ) {
+		ofLogError( "ofxPcl::removeRadiusOutliers" ) << "radius must be positive and minNeighbors not negative";
+		return false;
+	}
+	std::vector<int> inliers;
+	detail::removeRadiusOutliers( pointCloud, nullptr, radius, minNeighbors, approximateLeafSize, inliers );
+	pcl::copyPointCloud( *pointCloud, inliers, output );
+	output.is_dense = true;
+	return true;
+}
+
+inline PointCloud::Ptr removeRadiusOutliers( const PointCloud::ConstPtr& pointCloud, double radius, int minNeighbors, float approximateLeafSize = 0.f )
+{
+	PointCloud::Ptr output( new PointCloud );
+	removeRadiusOutliers( pointCloud, radius, minNeighbors, *output, approximateLeafSize );
+	return output;
+}
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,446 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Alignment.hpp"
+#include "ofxPointCloudLibrary/CloudPool.hpp"
+#include "ofxPointCloudLibrary/Features.hpp"
+#include "ofxPointCloudLibrary/Filters.hpp"
+#include "ofxPointCloudLibrary/Normals.hpp"
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+#include "ofxPointCloudLibrary/Utils.hpp"
+
+#include <random>
+
+namespace ofxPointCloudLibrary {
+
+/* parameters of the global alignment. distances are multiples of leafSize, so only leafSize depends on the
+ * units of the clouds. the sample consensus defaults are those of pcl's alignment prerejective tutorial,
+ * with pcl::SampleConsensusPrerejective's default iteration count */
+struct GlobalAlignmentSettings
+{
+	float leafSize               = 1.f;     // keypoint voxel size, in cloud units
+	int normalNeighbours         = 15;      // k for the keypoint normals
+	float featureRadius          = 5.f;     // fpfh neighborhood radius, * leafSize
+	int maxIterations            = 5000;    // hypotheses drawn
+	int numSamples               = 3;       // correspondences per hypothesis
+	int correspondenceRandomness = 5;       // a sample's target is picked among its k most similar features
+	float similarityThreshold    = 0.9f;    // edge length ratio the polygon prerejection requires, in [0, 1)
+	float inlierDistance         = 2.5f;    // * leafSize
+	float inlierFraction         = 0.25f;   // of the source keypoints, for a hypothesis to be accepted
+	bool refine                  = true;    // finish with the refinement Alignment
+	float refineLeafSize         = 1.f;     // voxel size of the clouds it refines on, * leafSize, 0 uses the full clouds
+	uint32_t seed                = 0;       // same seed, clouds and thread count give the same result
+	int numThreads               = 0;       // 0 uses the whole ThreadPool
+};
+
+// wall time of each stage, keypoints / normals / features include the target's when it was prepared in the same call
+struct GlobalAlignmentTimings
+{
+	float keypointsMs  = 0.f;
+	float normalsMs    = 0.f;
+	float featuresMs   = 0.f;
+	float matchingMs   = 0.f;
+	float consensusMs  = 0.f;
+	float refinementMs = 0.f;
+	float totalMs      = 0.f;
+};
+
+struct GlobalAlignmentResult
+{
+	glm::mat4 matrix       = glm::mat4( 1. );  // transform taking the source onto the target
+	glm::mat4 coarseMatrix = glm::mat4( 1. );  // the sample consensus estimate the refinement started from
+	float fitnessScore     = 0.f;              // mean squared inlier distance of the consensus, or the refinement's score
+	float inlierFraction   = 0.f;              // source keypoints within inlierDistance of a target keypoint
+	bool converged         = false;            // a hypothesis reached inlierFraction, and the refinement converged
+	size_t sourceKeypoints = 0;
+	size_t targetKeypoints = 0;
+	GlobalAlignmentTimings timings;
+};
+
+namespace detail {
+
+// whether all bins are finite, pcl marks points without a descriptor with nan histograms
+inline bool isFinite( const pcl::FPFHSignature33& feature )
+{
+	return std::all_of( feature.histogram, feature.histogram + pcl::FPFHSignature33::descriptorSize(), []( float bin ) { return std::isfinite( bin ); } );
+}
+
+/* the k most similar target features of every source feature, searched in parallel on a flann kd-tree over
+ * the target features. source keypoints without a descriptor get empty lists */
+inline void matchFeatures( const FeatureCloud& source, const pcl::KdTreeFLANN<pcl::FPFHSignature33>& targetTree, int k, std::vector<std::vector<int>>& matches, size_t numThreads )
+{
+	matches.resize( source.size() );
+	getThreadPool().parallelFor( 0, source.size(), [&]( size_t begin, size_t end ) {
+		std::vector<float> squaredDistances;
+		for ( size_t i = begin; i < end; ++i ) {
+			matches[i].clear();
+			if ( isFinite( source.points[i] ) ) targetTree.nearestKSearch( source.points[i], k, matches[i], squaredDistances );
+		}
+	}, numThreads );
+}
+
+/* nearest neighbor within a fixed radius on a hashed grid with cells of that size, so only the 27 cells
+ * around a query can hold points in range. cheaper than the kd-tree for the many short range queries
+ * of hypothesis scoring */
+class NeighborGrid
+{
+public:
+	NeighborGrid( const PointCloud& cloud, float radius )
+	    : m_inverseCellSize( 1.f / radius ), m_squaredRadius( radius * radius ), m_map( cloud.size() )
+	{
+		// points sorted by cell, each cell a range of m_points
+		std::vector<uint32_t> cellOf( cloud.size(), kNone );
+		for ( size_t i = 0; i < cloud.size(); ++i ) {
+			VoxelKey key;
+			if ( !getVoxelKey( cloud.points[i].data, m_inverseCellSize, key ) ) continue;
+			bool inserted;
+			cellOf[i] = m_map.findOrInsert( key, hashVoxel( key ), static_cast<uint32_t>( m_cellBegin.size() ), inserted );
+			if ( inserted ) m_cellBegin.push_back( 0 );
+			++m_cellBegin[cellOf[i]];
+		}
+		uint32_t begin = 0;
+		for ( auto& cell : m_cellBegin ) {
+			uint32_t count = cell;
+			cell           = begin;
+			begin += count;
+		}
+		m_cellBegin.push_back( begin );
+		m_points.resize( begin );
+		std::vector<uint32_t> fill( m_cellBegin.begin(), m_cellBegin.end() - 1 );
+		for ( size_t i = 0; i < cloud.size(); ++i ) {
+			if ( cellOf[i] != kNone ) m_points[fill[cellOf[i]]++] = cloud.points[i].getVector3fMap();
+		}
+	}
+
+	// squared distance to the nearest point closer than radius, false if there is none
+	bool nearest( const Eigen::Vector3f& query, float& squaredDistance ) const
+	{
+		VoxelKey center;
+		if ( !getVoxelKey( query.data(), m_inverseCellSize, center ) ) return false;
+		squaredDistance = m_squaredRadius;
+		for ( int dz = -1; dz <= 1; ++dz ) {
+			for ( int dy = -1; dy <= 1; ++dy ) {
+				for ( int dx = -1; dx <= 1; ++dx ) {
+					VoxelKey key = { center.x + dx, center.y + dy, center.z + dz };
+					uint32_t cell;
+					if ( !m_map.find( key, hashVoxel( key ), cell ) ) continue;
+					for ( uint32_t i = m_cellBegin[cell]; i < m_cellBegin[cell + 1]; ++i ) {
+						squaredDistance = std::min( squaredDistance, ( m_points[i] - query ).squaredNorm() );
+					}
+				}
+			}
+		}
+		return squaredDistance < m_squaredRadius;
+	}
+
+protected:
+	enum : uint32_t { kNone = 0xffffffff };
+
+	float m_inverseCellSize;
+	float m_squaredRadius;
+	VoxelMap m_map;
+	std::vector<uint32_t> m_cellBegin;
+	std::vector<Eigen::Vector3f> m_points;
+};
+
+struct ConsensusHypothesis
+{
+	Eigen::Matrix4f transform = Eigen::Matrix4f::Identity();
+	float error               = std::numeric_limits<float>::max();  // mean squared inlier distance
+	size_t inliers            = 0;
+	size_t chunk              = 0;  // first iteration of the chunk that drew it, breaks ties between chunks
+};
+
+/* pcl::SampleConsensusPrerejective::getFitness for one transform, visiting the source points in order. stops
+ * as soon as so many points missed that the inlier fraction can't be reached, and, as a cheap preview test,
+ * when fewer than half the expected inliers are among the first previewPoints. order is shuffled, so the
+ * preview is a random sample */
+inline bool scoreHypothesis( const PointCloud& source, const std::vector<int>& order, const NeighborGrid& target, const Eigen::Matrix4f& transform, float inlierFraction, ConsensusHypothesis& hypothesis )
+{
+	const size_t previewPoints = 64;
+	const float n              = static_cast<float>( order.size() );
+	size_t inliers = 0, outliers = 0;
+	float error    = 0.f;
+	float squaredDistance;
+	for ( size_t i = 0; i < order.size(); ++i ) {
+		if ( i == previewPoints && inliers < 0.5f * inlierFraction * previewPoints ) return false;
+		const Point& point = source.points[order[i]];
+		if ( target.nearest( transform.topLeftCorner<3, 3>() * point.getVector3fMap() + transform.topRightCorner<3, 1>(), squaredDistance ) ) {
+			++inliers;
+			error += squaredDistance;
+		} else if ( ( n - ++outliers ) / n < inlierFraction ) {
+			return false;
+		}
+	}
+	if ( inliers == 0 || inliers / n < inlierFraction ) return false;
+	hypothesis.transform = transform;
+	hypothesis.error     = error / inliers;
+	hypothesis.inliers   = inliers;
+	return true;
+}
+
+/* pcl::SampleConsensusPrerejective's loop with the iterations split across the ThreadPool. every chunk draws
+ * from its own generator seeded with ( seed, first iteration ) and keeps its best hypothesis; the lowest error
+ * over all chunks wins. samples are drawn among the source keypoints with matches, the hypotheses go through
+ * pcl's polygon prerejection and svd estimation. returns false when no hypothesis reached the inlier fraction */
+inline bool sampleConsensus( const PointCloud::ConstPtr& source, const PointCloud::ConstPtr& target, const std::vector<std::vector<int>>& matches, const GlobalAlignmentSettings& settings, ConsensusHypothesis& best )
+{
+	std::vector<int> candidates;
+	for ( size_t i = 0; i < matches.size(); ++i ) {
+		if ( !matches[i].empty() ) candidates.push_back( static_cast<int>( i ) );
+	}
+	const int numSamples = settings.numSamples;
+	if ( numSamples < 2 || candidates.size() < static_cast<size_t>( numSamples ) ) return false;
+
+	std::vector<int> order( source->size() );
+	std::iota( order.begin(), order.end(), 0 );
+	std::shuffle( order.begin(), order.end(), std::mt19937( settings.seed ) );
+
+	const NeighborGrid targetGrid( *target, settings.inlierDistance * settings.leafSize );
+	bool found = false;
+	std::mutex bestMutex;
+
+	getThreadPool().parallelFor( 0, std::max( 0, settings.maxIterations ), [&]( size_t begin, size_t end ) {
+		std::seed_seq seeds{ settings.seed, static_cast<uint32_t>( begin ) };
+		std::mt19937 random( seeds );
+		std::uniform_int_distribution<size_t> pickCandidate( 0, candidates.size() - 1 );
+
+		pcl::registration::CorrespondenceRejectorPoly<Point, Point> rejector;
+		rejector.setInputSource( source );
+		rejector.setInputTarget( target );
+		rejector.setCardinality( numSamples );
+		rejector.setSimilarityThreshold( settings.similarityThreshold );
+		pcl::registration::TransformationEstimationSVD<Point, Point> estimation;
+
+		std::vector<int> samples( numSamples ), corresponding( numSamples );
+		Eigen::Matrix4f transform;
+		ConsensusHypothesis chunkBest, hypothesis;
+		bool chunkFound = false;
+		for ( size_t iteration = begin; iteration < end; ++iteration ) {
+			// distinct source keypoints, each with one of its most similar target keypoints
+			for ( int s = 0; s < numSamples; ++s ) {
+				do {
+					samples[s] = candidates[pickCandidate( random )];
+				} while ( std::find( samples.begin(), samples.begin() + s, samples[s] ) != samples.begin() + s );
+				const auto& sampleMatches = matches[samples[s]];
+				corresponding[s]          = sampleMatches[std::uniform_int_distribution<size_t>( 0, sampleMatches.size() - 1 )( random )];
+			}
+			if ( !rejector.thresholdPolygon( samples, corresponding ) ) continue;
+
+			estimation.estimateRigidTransformation( *source, samples, *target, corresponding, transform );
+			if ( !scoreHypothesis( *source, order, targetGrid, transform, settings.inlierFraction, hypothesis ) ) continue;
+			if ( hypothesis.error < chunkBest.error ) {
+				chunkBest  = hypothesis;
+				chunkFound = true;
+			}
+		}
+		if ( !chunkFound ) return;
+
+		chunkBest.chunk = begin;
+		std::lock_guard<std::mutex> lock( bestMutex );
+		if ( !found || chunkBest.error < best.error || ( chunkBest.error == best.error && chunkBest.chunk < best.chunk ) ) best = chunkBest;
+		found = true;
+	}, static_cast<size_t>( std::max( 0, settings.numThreads ) ) );
+	return found;
+}
+
+}  // namespace detail
+
+/* alignment from any initial pose: both clouds are reduced to voxel keypoints, described with fpfh features
+ * and matched on a flann index, then a prerejective sample consensus estimates the transform, which an
+ * Alignment refines (point-to-plane icp by default, it converges in a few iterations from there). every
+ * stage runs on the ThreadPool and is timed. the target is prepared once in setTarget() and reused until
+ * it or the settings change */
+class GlobalAlignment
+{
+public:
+	explicit GlobalAlignment( const GlobalAlignmentSettings& settings = GlobalAlignmentSettings() )
+	{
+		setSettings( settings );
+	}
+
+	GlobalAlignment( const GlobalAlignment& ) = delete;
+	GlobalAlignment& operator=( const GlobalAlignment& ) = delete;
+
+	/* replace the settings. the current target is re-prepared by the next alignTo(), or not at all when a new
+	 * one is set first. also sets the refinement's max correspondence distance to inlierDistance, configure
+	 * the refinement after this to change it */
+	void setSettings( const GlobalAlignmentSettings& settings )
+	{
+		m_settings = settings;
+		m_refinement.setMaxCorrespondenceDistance( m_settings.inlierDistance * m_settings.leafSize );
+		m_targetStale = true;
+	}
+
+	const GlobalAlignmentSettings& getSettings() const { return m_settings; }
+
+	// the refinement stage, pick its method, pyramid or iterations here
+	Alignment& getRefinement() { return m_refinement; }
+
+	/* align sourceCloud to targetCloud from any initial pose */
+	GlobalAlignmentResult align( const std::vector<glm::vec3>& sourceCloud, const std::vector<glm::vec3>& targetCloud )
+	{
+		setTarget( targetCloud );
+		GlobalAlignmentResult result = alignTo( sourceCloud );
+		addTargetTimings( result.timings );
+		return result;
+	}
+
+	GlobalAlignmentResult align( const PointCloud::ConstPtr& sourceCloud, const PointCloud::ConstPtr& targetCloud )
+	{
+		setTarget( targetCloud );
+		GlobalAlignmentResult result = alignTo( sourceCloud );
+		addTargetTimings( result.timings );
+		return result;
+	}
+
+	/* set the reference cloud: its keypoints, normals, features and feature index are computed here,
+	 * and the refinement prepares its search trees */
+	void setTarget( const std::vector<glm::vec3>& targetCloud )
+	{
+		PointCloud::Ptr target = getCloudPool().acquire( targetCloud.size() );
+		toPcl( targetCloud, *target );
+		setTarget( target );
+	}
+
+	void setTarget( const PointCloud::ConstPtr& targetCloud )
+	{
+		m_targetStale   = false;
+		m_targetTimings = GlobalAlignmentTimings();
+		uint64_t startTime = ofGetElapsedTimeMicros();
+		describe( targetCloud, m_target, m_targetTimings );
+
+		uint64_t stageTime = ofGetElapsedTimeMicros();
+		m_featureTree.reset( new pcl::KdTreeFLANN<pcl::FPFHSignature33> );
+		if ( !m_target.features->empty() ) m_featureTree->setInputCloud( m_target.features );
+		m_targetTimings.matchingMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+
+		stageTime = ofGetElapsedTimeMicros();
+		if ( m_settings.refine && !targetCloud->empty() ) m_refinement.setTarget( getRefinementCloud( targetCloud, m_refineTarget ) );
+		m_targetTimings.refinementMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+		m_targetTimings.totalMs      = ( ofGetElapsedTimeMicros() - startTime ) / 1000.f;
+	}
+
+	bool hasTarget() const { return m_target.cloud && !m_target.keypoints->empty(); }
+
+	// time spent preparing the current target
+	const GlobalAlignmentTimings& getTargetTimings() const { return m_targetTimings; }
+
+	/* align sourceCloud to the current target */
+	GlobalAlignmentResult alignTo( const std::vector<glm::vec3>& sourceCloud )
+	{
+		if ( !m_sourceCloud ) m_sourceCloud = getCloudPool().acquire( sourceCloud.size() );
+		toPcl( sourceCloud, *m_sourceCloud );
+		++m_sourceCloud->header.seq;  // refilled in place
+		return alignTo( m_sourceCloud );
+	}
+
+	GlobalAlignmentResult alignTo( const PointCloud::ConstPtr& sourceCloud )
+	{
+		GlobalAlignmentResult result;
+		// the settings changed since the target was prepared, its time is added to the result's
+		const bool prepareTarget = m_targetStale && m_target.cloud;
+		if ( prepareTarget ) setTarget( m_target.cloud );
+		if ( !hasTarget() || !sourceCloud || sourceCloud->empty() ) {
+			ofLogError( "ofxPcl::GlobalAlignment" ) << "align: source and target clouds must be non-empty";
+			return result;
+		}
+		uint64_t startTime = ofGetElapsedTimeMicros();
+		describe( sourceCloud, m_source, result.timings );
+		result.sourceKeypoints = m_source.keypoints->size();
+		result.targetKeypoints = m_target.keypoints->size();
+
+		uint64_t stageTime = ofGetElapsedTimeMicros();
+		detail::matchFeatures( *m_source.features, *m_featureTree, m_settings.correspondenceRandomness, m_matches, numThreads() );
+		result.timings.matchingMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+
+		stageTime = ofGetElapsedTimeMicros();
+		detail::ConsensusHypothesis consensus;
+		bool found                 = detail::sampleConsensus( m_source.keypoints, m_target.keypoints, m_matches, m_settings, consensus );
+		result.timings.consensusMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+
+		if ( found ) {
+			result.coarseMatrix   = result.matrix = toOf( consensus.transform );
+			result.fitnessScore   = consensus.error;
+			result.inlierFraction = static_cast<float>( consensus.inliers ) / result.sourceKeypoints;
+			result.converged      = true;
+
+			if ( m_settings.refine ) {
+				stageTime                   = ofGetElapsedTimeMicros();
+				result.converged            = m_refinement.alignTo( getRefinementCloud( sourceCloud, m_refineSource ), result.coarseMatrix );
+				result.matrix               = m_refinement.getAlignmentMatrix();
+				result.fitnessScore         = m_refinement.getFitnessScore();
+				result.timings.refinementMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+			}
+		}
+		result.timings.totalMs = ( ofGetElapsedTimeMicros() - startTime ) / 1000.f;
+		if ( prepareTarget ) addTargetTimings( result.timings );
+		return result;
+	}
+
+protected:
+	// one cloud reduced to what the matching needs
+	struct Description
+	{
+		PointCloud::ConstPtr cloud;
+		PointCloud::Ptr keypoints = PointCloud::Ptr( new PointCloud );
+		pcl::PointCloud<pcl::Normal> normals;
+		FeatureCloud::Ptr features = FeatureCloud::Ptr( new FeatureCloud );
+	};
+
+	void describe( const PointCloud::ConstPtr& cloud, Description& description, GlobalAlignmentTimings& timings )
+	{
+		description.cloud  = cloud;
+		uint64_t stageTime = ofGetElapsedTimeMicros();
+		voxelDownsample( *cloud, m_settings.leafSize, *description.keypoints );
+		description.keypoints->sensor_origin_      = cloud->sensor_origin_;
+		description.keypoints->sensor_orientation_ = cloud->sensor_orientation_;
+		getSearchCache().invalidate( description.keypoints.get() );  // refilled in place
+		timings.keypointsMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+
+		stageTime = ofGetElapsedTimeMicros();
+		computeNormals( description.keypoints, m_settings.normalNeighbours, description.normals, numThreads() );
+		timings.normalsMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+
+		stageTime = ofGetElapsedTimeMicros();
+		computeFpfh( description.keypoints, description.normals, m_settings.featureRadius * m_settings.leafSize, *description.features, numThreads() );
+		timings.featuresMs = ( ofGetElapsedTimeMicros() - stageTime ) / 1000.f;
+	}
+
+	// the cloud voxel downsampled at refineLeafSize into buffer, or itself
+	PointCloud::ConstPtr getRefinementCloud( const PointCloud::ConstPtr& cloud, PointCloud::Ptr& buffer ) const
+	{
+		if ( m_settings.refineLeafSize <= 0.f ) return cloud;
+		if ( !buffer ) buffer = getCloudPool().acquire();
+		voxelDownsample( *cloud, m_settings.refineLeafSize * m_settings.leafSize, *buffer );
+		getSearchCache().invalidate( buffer.get() );
+		return buffer;
+	}
+
+	void addTargetTimings( GlobalAlignmentTimings& timings ) const
+	{
+		timings.keypointsMs += m_targetTimings.keypointsMs;
+		timings.normalsMs += m_targetTimings.normalsMs;
+		timings.featuresMs += m_targetTimings.featuresMs;
+		timings.matchingMs += m_targetTimings.matchingMs;
+		timings.refinementMs += m_targetTimings.refinementMs;
+		timings.totalMs += m_targetTimings.totalMs;
+	}
+
+	size_t numThreads() const { return static_cast<size_t>( std::max( 0, m_settings.numThreads ) ); }
+
+	GlobalAlignmentSettings m_settings;
+	GlobalAlignmentTimings m_targetTimings;
+	bool m_targetStale = false;  // prepared with older settings
+	Description m_source;
+	Description m_target;
+	pcl::KdTreeFLANN<pcl::FPFHSignature33>::Ptr m_featureTree;
+	std::vector<std::vector<int>> m_matches;
+	PointCloud::Ptr m_sourceCloud;
+	PointCloud::Ptr m_refineSource;
+	PointCloud::Ptr m_refineTarget;
+	Alignment m_refinement{ AlignmentMethod::POINT_TO_PLANE };
+};
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,858 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+#include <pcl/io/low_level_io.h>
+#include <pcl/io/lzf.h>
+#include <pcl/io/ply_io.h>
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <sstream>
+
+namespace ofxPointCloudLibrary {
+
+namespace detail {
+
+/* read-only memory mapping of a whole file */
+class MappedFile
+{
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+
+	bool open( const std::string& path )
+	{
+		close();
+#ifdef _WIN32
+		m_file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+		if ( m_file == INVALID_HANDLE_VALUE ) return false;
+		LARGE_INTEGER size;
+		if ( !GetFileSizeEx( m_file, &size ) || size.QuadPart == 0 ) {
+			close();
+			return false;
+		}
+		m_size    = static_cast<size_t>( size.QuadPart );
+		m_mapping = CreateFileMappingA( m_file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+		if ( !m_mapping ) {
+			close();
+			return false;
+		}
+		m_data = static_cast<const uint8_t*>( MapViewOfFile( m_mapping, FILE_MAP_READ, 0, 0, 0 ) );
+		if ( !m_data ) {
+			close();
+			return false;
+		}
+#else
+		m_fd = pcl::io::raw_open( path.c_str(), O_RDONLY );
+		if ( m_fd < 0 ) return false;
+		struct stat info;
+		if ( fstat( m_fd, &info ) != 0 || info.st_size == 0 ) {
+			close();
+			return false;
+		}
+		m_size     = static_cast<size_t>( info.st_size );
+		void* data = mmap( nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0 );
+		if ( data == MAP_FAILED ) {
+			close();
+			return false;
+		}
+		madvise( data, m_size, MADV_SEQUENTIAL );
+		m_data = static_cast<const uint8_t*>( data );
+#endif
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if ( m_data ) UnmapViewOfFile( m_data );
+		if ( m_mapping ) CloseHandle( m_mapping );
+		if ( m_file != INVALID_HANDLE_VALUE ) CloseHandle( m_file );
+		m_mapping = nullptr;
+		m_file    = INVALID_HANDLE_VALUE;
+#else
+		if ( m_data ) munmap( const_cast<uint8_t*>( m_data ), m_size );
+		if ( m_fd >= 0 ) pcl::io::raw_close( m_fd );
+		m_fd = -1;
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+
+	const uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+protected:
+	const uint8_t* m_data = nullptr;
+	size_t m_size         = 0;
+#ifdef _WIN32
+	HANDLE m_file    = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#else
+	int m_fd = -1;
+#endif
+};
+
+/* where x, y and z live inside each record of a binary point file */
+struct XyzLayout
+{
+	const uint8_t* data = nullptr;  // first record
+	size_t count        = 0;        // number of records
+	size_t stride       = 0;        // bytes per record
+	size_t offset[3]    = { 0, 0, 0 };
+	bool isDouble       = false;  // float64 fields, otherwise float32
+	bool swapBytes      = false;  // file endianness differs from the host
+};
+
+inline bool isLittleEndianHost()
+{
+	const uint16_t one = 1;
+	return *reinterpret_cast<const uint8_t*>( &one ) == 1;
+}
+
+inline float readField( const uint8_t* src, bool isDouble, bool swapBytes )
+{
+	uint8_t bytes[8];
+	size_t size = isDouble ? 8 : 4;
+	std::memcpy( bytes, src, size );
+	if ( swapBytes ) std::reverse( bytes, bytes + size );
+	if ( isDouble ) {
+		double value;
+		std::memcpy( &value, bytes, 8 );
+		return static_cast<float>( value );
+	}
+	float value;
+	std::memcpy( &value, bytes, 4 );
+	return value;
+}
+
+/* decode records [begin, end) into dst, which receives record begin. dstStride in floats (3 for glm::vec3, 4 for PointXYZ)
+ * returns false if any point is not finite */
+inline bool decodeXyz( const XyzLayout& layout, size_t begin, size_t end, float* dst, size_t dstStride )
+{
+	const bool packedFloats = !layout.isDouble && !layout.swapBytes && layout.offset[1] == layout.offset[0] + 4 && layout.offset[2] == layout.offset[0] + 8;
+
+	bool finite = true;
+	for ( size_t i = begin; i < end; ++i, dst += dstStride ) {
+		const uint8_t* record = layout.data + i * layout.stride;
+		if ( packedFloats ) {
+			std::memcpy( dst, record + layout.offset[0], 3 * sizeof( float ) );
+		} else {
+			for ( int k = 0; k < 3; ++k ) dst[k] = readField( record + layout.offset[k], layout.isDouble, layout.swapBytes );
+		}
+		finite = finite && std::isfinite( dst[0] ) && std::isfinite( dst[1] ) && std::isfinite( dst[2] );
+	}
+	return finite;
+}
+
+// next header line starting at pos, without the line break. returns false at the end of the mapping
+inline bool readHeaderLine( const MappedFile& file, size_t& pos, std::string& line )
+{
+	if ( pos >= file.size() ) return false;
+	const char* begin = reinterpret_cast<const char*>( file.data() ) + pos;
+	const char* end   = static_cast<const char*>( std::memchr( begin, '\n', file.size() - pos ) );
+	size_t length     = end ? end - begin : file.size() - pos;
+	pos += length + ( end ? 1 : 0 );
+	if ( length && begin[length - 1] == '\r' ) --length;
+	line.assign( begin, length );
+	return true;
+}
+
+/* binary pcd header. fields are parsed in file order */
+struct PcdHeader
+{
+	std::vector<std::string> fields;
+	std::vector<size_t> sizes;
+	std::vector<char> types;
+	std::vector<size_t> counts;
+	uint32_t width  = 0;
+	uint32_t height = 1;
+	size_t points   = 0;
+	std::string dataType;  // ascii, binary or binary_compressed
+	size_t dataOffset = 0;  // first byte after the DATA line
+
+	// binary_compressed files written by savePointCloudChunked: points per chunk and compressed chunk sizes, field major
+	size_t chunkPoints = 0;
+	std::vector<size_t> chunkSizes;
+
+	int fieldIndex( const std::string& name ) const
+	{
+		for ( size_t i = 0; i < fields.size(); ++i ) {
+			if ( fields[i] == name ) return static_cast<int>( i );
+		}
+		return -1;
+	}
+
+	// byte offset of a field inside a binary record
+	size_t fieldOffset( int index ) const
+	{
+		size_t offset = 0;
+		for ( int i = 0; i < index; ++i ) offset += sizes[i] * counts[i];
+		return offset;
+	}
+
+	size_t recordSize() const { return fieldOffset( static_cast<int>( fields.size() ) ); }
+};
+
+inline bool parsePcdHeader( const MappedFile& file, PcdHeader& header )
+{
+	size_t pos = 0;
+	std::string line;
+	while ( readHeaderLine( file, pos, line ) ) {
+		std::istringstream stream( line );
+		std::string key;
+		stream >> key;
+		if ( key == "#" ) {
+			std::string tag, type;
+			stream >> tag >> type;
+			if ( tag == "ofxPcl" && type == "chunks" ) {
+				stream >> header.chunkPoints;
+				size_t size;
+				while ( stream >> size ) header.chunkSizes.push_back( size );
+			}
+			continue;
+		}
+		if ( key.empty() || key[0] == '#' ) continue;
+
+		if ( key == "FIELDS" ) {
+			std::string name;
+			while ( stream >> name ) header.fields.push_back( name );
+		} else if ( key == "SIZE" ) {
+			size_t size;
+			while ( stream >> size ) header.sizes.push_back( size );
+		} else if ( key == "TYPE" ) {
+			char type;
+			while ( stream >> type ) header.types.push_back( type );
+		} else if ( key == "COUNT" ) {
+			size_t count;
+			while ( stream >> count ) header.counts.push_back( count );
+		} else if ( key == "WIDTH" ) {
+			stream >> header.width;
+		} else if ( key == "HEIGHT" ) {
+			stream >> header.height;
+		} else if ( key == "POINTS" ) {
+			stream >> header.points;
+		} else if ( key == "DATA" ) {
+			stream >> header.dataType;
+			header.dataOffset = pos;
+			break;
+		}
+	}
+
+	if ( header.counts.empty() ) header.counts.assign( header.fields.size(), 1 );
+	if ( header.points == 0 ) header.points = size_t( header.width ) * header.height;
+	return !header.dataType.empty() && !header.fields.empty() && header.sizes.size() == header.fields.size() && header.types.size() == header.fields.size() && header.counts.size() == header.fields.size();
+}
+
+// layout of x y z in a binary pcd, false if the file needs pcl's reader
+inline bool getPcdLayout( const MappedFile& file, const PcdHeader& header, XyzLayout& layout )
+{
+	if ( header.dataType != "binary" ) return false;
+	const char* names[3] = { "x", "y", "z" };
+	for ( int k = 0; k < 3; ++k ) {
+		int index = header.fieldIndex( names[k] );
+		if ( index < 0 || header.types[index] != 'F' || ( header.sizes[index] != 4 && header.sizes[index] != 8 ) ) return false;
+		if ( header.sizes[index] != header.sizes[header.fieldIndex( "x" )] ) return false;
+		layout.offset[k] = header.fieldOffset( index );
+	}
+	layout.isDouble = header.sizes[header.fieldIndex( "x" )] == 8;
+	layout.stride   = header.recordSize();
+	layout.count    = header.points;
+	layout.data     = file.data() + header.dataOffset;
+	if ( header.dataOffset + layout.stride * layout.count > file.size() ) {
+		ofLogError( "ofxPcl::load" ) << "pcd data is truncated";
+		return false;
+	}
+	return true;
+}
+
+inline size_t plyTypeSize( const std::string& type )
+{
+	if ( type == "char" || type == "uchar" || type == "int8" || type == "uint8" ) return 1;
+	if ( type == "short" || type == "ushort" || type == "int16" || type == "uint16" ) return 2;
+	if ( type == "int" || type == "uint" || type == "float" || type == "int32" || type == "uint32" || type == "float32" ) return 4;
+	if ( type == "double" || type == "float64" ) return 8;
+	return 0;
+}
+
+// layout of x y z in a binary ply vertex element, false if the file needs pcl's reader.
+// elements before the vertices must have fixed size records
+inline bool getPlyLayout( const MappedFile& file, XyzLayout& layout )
+{
+	size_t pos = 0;
+	std::string line;
+	if ( !readHeaderLine( file, pos, line ) || line != "ply" ) return false;
+
+	bool binary = false, bigEndian = false, inVertex = false, vertexDone = false, hasList = false, headerDone = false;
+	size_t skipBytes = 0, elementSize = 0, elementCount = 0, fieldSize = 0;
+	int found        = 0;
+	while ( !headerDone && readHeaderLine( file, pos, line ) ) {
+		std::istringstream stream( line );
+		std::string key;
+		stream >> key;
+		if ( key == "format" ) {
+			std::string format;
+			stream >> format;
+			binary    = format == "binary_little_endian" || format == "binary_big_endian";
+			bigEndian = format == "binary_big_endian";
+		} else if ( key == "element" || key == "end_header" ) {
+			if ( inVertex ) {
+				vertexDone    = true;
+				layout.stride = elementSize;
+			} else if ( !vertexDone ) {
+				if ( hasList ) return false;  // can't skip variable size elements before the vertices
+				skipBytes += elementSize * elementCount;
+			}
+			headerDone = key == "end_header";
+			std::string name;
+			stream >> name >> elementCount;
+			inVertex    = !vertexDone && name == "vertex";
+			elementSize = 0;
+			hasList     = false;
+			if ( inVertex ) layout.count = elementCount;
+		} else if ( key == "property" ) {
+			std::string type, name;
+			stream >> type;
+			if ( type == "list" ) {
+				if ( inVertex ) return false;
+				hasList = true;
+				continue;
+			}
+			stream >> name;
+			size_t size = plyTypeSize( type );
+			if ( size == 0 ) return false;
+			int k = name == "x" ? 0 : name == "y" ? 1 : name == "z" ? 2 : -1;
+			if ( inVertex && k >= 0 ) {
+				if ( ( type != "float" && type != "float32" && type != "double" && type != "float64" ) || ( fieldSize && size != fieldSize ) ) return false;
+				fieldSize        = size;
+				layout.offset[k] = elementSize;
+				found |= 1 << k;
+			}
+			elementSize += size;
+		}
+	}
+	if ( !headerDone || !binary || !vertexDone || found != 7 ) return false;
+
+	layout.isDouble  = fieldSize == 8;
+	layout.swapBytes = bigEndian == isLittleEndianHost();
+	layout.data      = file.data() + pos + skipBytes;
+	if ( pos + skipBytes + layout.stride * layout.count > file.size() ) {
+		ofLogError( "ofxPcl::load" ) << "ply data is truncated";
+		return false;
+	}
+	return true;
+}
+
+/* x y z of a memory mapped pcd or ply file, decoded in independent batches that can be spread over the ThreadPool.
+ * binary files are split every 65536 records, chunked binary_compressed files along their chunks */
+class MappedPoints
+{
+public:
+	// false if the file can't be opened. isMapped() is false if it needs pcl's reader
+	bool open( const std::string& fullPath )
+	{
+		m_mapped = false;
+		if ( !m_file.open( fullPath ) ) return false;
+
+		m_isPly = m_file.size() >= 3 && std::memcmp( m_file.data(), "ply", 3 ) == 0;
+		if ( m_isPly ) {
+			m_mapped = getPlyLayout( m_file, m_layout );
+			m_width  = static_cast<uint32_t>( m_layout.count );
+			m_height = 1;
+		} else if ( parsePcdHeader( m_file, m_header ) ) {
+			m_mapped = m_header.chunkPoints ? getChunkLayout() : getPcdLayout( m_file, m_header, m_layout );
+			m_width  = m_header.width;
+			m_height = m_header.height;
+		}
+		if ( size_t( m_width ) * m_height != m_layout.count ) {
+			m_width  = static_cast<uint32_t>( m_layout.count );
+			m_height = 1;
+		}
+		m_batchSize = m_header.chunkPoints ? m_header.chunkPoints : 65536;
+		return true;
+	}
+
+	void close() { m_file.close(); }
+
+	bool isMapped() const { return m_mapped; }
+	bool isPly() const { return m_isPly; }
+	size_t size() const { return m_layout.count; }
+	uint32_t getWidth() const { return m_width; }
+	uint32_t getHeight() const { return m_height; }
+
+	size_t getNumBatches() const { return ( size() + m_batchSize - 1 ) / m_batchSize; }
+	size_t getBatchBegin( size_t batch ) const { return batch * m_batchSize; }
+	size_t getBatchEnd( size_t batch ) const { return std::min( size(), ( batch + 1 ) * m_batchSize ); }
+
+	/* decode a batch into dst, which receives the batch's first point. scratch holds decompressed chunks and
+	 * can be reused between calls. returns false on corrupt data, clears finite if a point is not finite */
+	bool decodeBatch( size_t batch, float* dst, size_t dstStride, std::vector<uint8_t>& scratch, bool& finite ) const
+	{
+		size_t begin = getBatchBegin( batch );
+		size_t count = getBatchEnd( batch ) - begin;
+		if ( !m_header.chunkPoints ) {
+			finite = decodeXyz( m_layout, begin, begin + count, dst, dstStride ) && finite;
+			return true;
+		}
+
+		// x, y and z planes of this chunk, decompressed next to each other
+		XyzLayout planes;
+		planes.count      = count;
+		planes.stride     = m_fieldSize;
+		planes.isDouble   = m_layout.isDouble;
+		size_t planeBytes = count * m_fieldSize;
+		scratch.resize( 3 * planeBytes );
+		for ( int k = 0; k < 3; ++k ) {
+			size_t chunk = m_xyzFields[k] * getNumBatches() + batch;
+			unsigned int bytes = pcl::lzfDecompress( m_file.data() + m_chunkOffsets[chunk], static_cast<unsigned int>( m_header.chunkSizes[chunk] ), &scratch[k * planeBytes], static_cast<unsigned int>( planeBytes ) );
+			if ( bytes != planeBytes ) return false;
+			planes.offset[k] = k * planeBytes;
+		}
+		planes.data = scratch.data();
+		finite      = decodeXyz( planes, 0, count, dst, dstStride ) && finite;
+		return true;
+	}
+
+protected:
+	// chunk table of a binary_compressed file written by savePointCloudChunked
+	bool getChunkLayout()
+	{
+		const char* names[3] = { "x", "y", "z" };
+		for ( int k = 0; k < 3; ++k ) {
+			int index = m_header.fieldIndex( names[k] );
+			if ( index < 0 || m_header.types[index] != 'F' || m_header.counts[index] != 1 || ( m_header.sizes[index] != 4 && m_header.sizes[index] != 8 ) ) return false;
+			if ( m_header.sizes[index] != m_header.sizes[m_header.fieldIndex( "x" )] ) return false;
+			m_xyzFields[k] = index;
+		}
+		m_fieldSize       = m_header.sizes[m_xyzFields[0]];
+		m_layout.isDouble = m_fieldSize == 8;
+		m_layout.count    = m_header.points;
+
+		size_t numChunks = ( m_header.points + m_header.chunkPoints - 1 ) / m_header.chunkPoints;
+		if ( m_header.dataType != "binary_compressed" || m_header.chunkSizes.size() != numChunks * m_header.fields.size() ) {
+			ofLogError( "ofxPcl::load" ) << "pcd chunk table doesn't match the header";
+			return false;
+		}
+		// chunks follow pcl's compressed and uncompressed size words
+		m_chunkOffsets.resize( m_header.chunkSizes.size() );
+		size_t offset = m_header.dataOffset + 8;
+		for ( size_t i = 0; i < m_chunkOffsets.size(); ++i ) {
+			m_chunkOffsets[i] = offset;
+			offset += m_header.chunkSizes[i];
+		}
+		if ( offset > m_file.size() ) {
+			ofLogError( "ofxPcl::load" ) << "pcd data is truncated";
+			return false;
+		}
+		return true;
+	}
+
+	MappedFile m_file;
+	PcdHeader m_header;
+	XyzLayout m_layout;
+	bool m_isPly        = false;
+	bool m_mapped       = false;
+	uint32_t m_width    = 0;
+	uint32_t m_height   = 1;
+	size_t m_batchSize  = 65536;
+	size_t m_fieldSize  = 4;
+	int m_xyzFields[3]  = { 0, 1, 2 };
+	std::vector<size_t> m_chunkOffsets;
+};
+
+// decode all batches across the ThreadPool. returns false on corrupt data
+inline bool decodePoints( const MappedPoints& points, float* dst, size_t dstStride, bool& dense )
+{
+	std::atomic<bool> ok{ true }, finite{ true };
+	getThreadPool().parallelFor( 0, points.getNumBatches(), [&]( size_t begin, size_t end ) {
+		std::vector<uint8_t> scratch;
+		bool rangeFinite = true;
+		for ( size_t batch = begin; batch < end && ok; ++batch ) {
+			if ( !points.decodeBatch( batch, dst + points.getBatchBegin( batch ) * dstStride, dstStride, scratch, rangeFinite ) ) ok = false;
+		}
+		if ( !rangeFinite ) finite = false;
+	} );
+	dense = finite;
+	return ok;
+}
+
+}  // namespace detail
+
+/* load the points of a pcd or ply file.
+ * binary pcd, binary ply and pcds written by savePointCloudChunked are memory mapped and decoded straight
+ * into the output, in parallel, without an intermediate pcl::PCLPointCloud2 blob. other encodings fall back
+ * to pcl's readers. paths are relative to the data folder */
+inline bool loadPointCloud( const std::string& path, PointCloud& cloud )
+{
+	std::string fullPath = ofToDataPath( path, true );
+	detail::MappedPoints mapped;
+	if ( !mapped.open( fullPath ) ) {
+		ofLogError( "ofxPcl::load" ) << "couldn't open " << fullPath;
+		return false;
+	}
+
+	if ( !mapped.isMapped() ) {
+		mapped.close();
+		int status = mapped.isPly() ? pcl::io::loadPLYFile( fullPath, cloud ) : pcl::io::loadPCDFile( fullPath, cloud );
+		if ( status < 0 ) ofLogError( "ofxPcl::load" ) << "couldn't read " << fullPath;
+		return status >= 0;
+	}
+
+	cloud.points.resize( mapped.size() );
+	if ( !detail::decodePoints( mapped, cloud.points.empty() ? nullptr : cloud.points[0].data, sizeof( Point ) / sizeof( float ), cloud.is_dense ) ) {
+		ofLogError( "ofxPcl::load" ) << "corrupt compressed data in " << fullPath;
+		cloud.clear();
+		return false;
+	}
+	cloud.width  = mapped.getWidth();
+	cloud.height = mapped.getHeight();
+	return true;
+}
+
+inline bool loadPointCloud( const std::string& path, std::vector<glm::vec3>& points )
+{
+	std::string fullPath = ofToDataPath( path, true );
+	detail::MappedPoints mapped;
+	if ( !mapped.open( fullPath ) ) {
+		ofLogError( "ofxPcl::load" ) << "couldn't open " << fullPath;
+		return false;
+	}
+
+	if ( !mapped.isMapped() ) {
+		mapped.close();
+		PointCloud cloud;
+		if ( !loadPointCloud( path, cloud ) ) return false;
+		toOf( cloud, points );
+		return true;
+	}
+
+	points.resize( mapped.size() );
+	bool dense;
+	if ( !detail::decodePoints( mapped, points.empty() ? nullptr : &points[0].x, 3, dense ) ) {
+		ofLogError( "ofxPcl::load" ) << "corrupt compressed data in " << fullPath;
+		points.clear();
+		return false;
+	}
+	return true;
+}
+
+/* decode a pcd or ply file batch by batch and hand each batch to onBatch as soon as it is ready, so processing
+ * can start before the whole file is in. batches are called from pool threads in completion order, one at a time.
+ * files that need pcl's reader arrive as a single batch */
+inline bool streamPointCloud( const std::string& path, const std::function<void( size_t firstPoint, const glm::vec3* points, size_t count )>& onBatch )
+{
+	std::string fullPath = ofToDataPath( path, true );
+	detail::MappedPoints mapped;
+	if ( !mapped.open( fullPath ) ) {
+		ofLogError( "ofxPcl::load" ) << "couldn't open " << fullPath;
+		return false;
+	}
+
+	if ( !mapped.isMapped() ) {
+		mapped.close();
+		std::vector<glm::vec3> points;
+		if ( !loadPointCloud( path, points ) ) return false;
+		if ( !points.empty() ) onBatch( 0, points.data(), points.size() );
+		return true;
+	}
+
+	std::mutex mutex;
+	std::atomic<bool> ok{ true };
+	getThreadPool().parallelFor( 0, mapped.getNumBatches(), [&]( size_t begin, size_t end ) {
+		std::vector<uint8_t> scratch;
+		std::vector<glm::vec3> points;
+		bool finite = true;  // decodeBatch only clears it, the result is unused here
+		for ( size_t batch = begin; batch < end && ok; ++batch ) {
+			points.resize( mapped.getBatchEnd( batch ) - mapped.getBatchBegin( batch ) );
+			if ( !mapped.decodeBatch( batch, &points[0].x, 3, scratch, finite ) ) {
+				ok = false;
+				break;
+			}
+			std::lock_guard<std::mutex> lock( mutex );
+			onBatch( mapped.getBatchBegin( batch ), points.data(), points.size() );
+		}
+	} );
+	if ( !ok ) ofLogError( "ofxPcl::load" ) << "corrupt compressed data in " << fullPath;
+	return ok;
+}
+
+/* save a cloud as a binary_compressed pcd whose lzf stream is cut into chunks of pointsPerChunk points, compressed
+ * in parallel. the chunks concatenate into a regular binary_compressed body, so pcl's reader still opens the file,
+ * while loadPointCloud and streamPointCloud decompress just the x y z chunks across the ThreadPool */
+template <typename PointT>
+bool savePointCloudChunked( const std::string& path, const pcl::PointCloud<PointT>& cloud, size_t pointsPerChunk = 262144 )
+{
+	std::string fullPath = ofToDataPath( path, true );
+	if ( cloud.points.empty() || pointsPerChunk == 0 ) {
+		ofLogError( "ofxPcl::save" ) << "nothing to save to " << fullPath;
+		return false;
+	}
+
+	// the same fields pcl writes, laid out as one plane per field
+	std::vector<pcl::PCLPointField> allFields, fields;
+	pcl::getFields( cloud, allFields );
+	std::vector<size_t> fieldSizes;
+	size_t recordSize = 0;
+	for ( const auto& field : allFields ) {
+		if ( field.name == "_" ) continue;
+		fields.push_back( field );
+		fieldSizes.push_back( pcl::getFieldSize( field.datatype ) * std::max<uint32_t>( field.count, 1 ) );
+		recordSize += fieldSizes.back();
+	}
+	if ( pointsPerChunk * *std::max_element( fieldSizes.begin(), fieldSizes.end() ) > std::numeric_limits<uint32_t>::max() / 2 ) {
+		ofLogError( "ofxPcl::save" ) << "pointsPerChunk is too large";
+		return false;
+	}
+
+	size_t numPoints = cloud.points.size();
+	size_t numChunks = ( numPoints + pointsPerChunk - 1 ) / pointsPerChunk;
+	std::vector<std::vector<uint8_t>> chunks( fields.size() * numChunks );
+	std::atomic<bool> ok{ true };
+	getThreadPool().parallelFor( 0, numChunks, [&]( size_t begin, size_t end ) {
+		std::vector<uint8_t> plane;
+		for ( size_t c = begin; c < end && ok; ++c ) {
+			size_t first = c * pointsPerChunk;
+			size_t count = std::min( pointsPerChunk, numPoints - first );
+			for ( size_t f = 0; f < fields.size(); ++f ) {
+				size_t size = fieldSizes[f];
+				plane.resize( count * size );
+				for ( size_t i = 0; i < count; ++i ) {
+					std::memcpy( &plane[i * size], reinterpret_cast<const uint8_t*>( &cloud.points[first + i] ) + fields[f].offset, size );
+				}
+				// lzf grows incompressible data by less than 4%
+				auto& chunk = chunks[f * numChunks + c];
+				chunk.resize( plane.size() + plane.size() / 16 + 64 );
+				unsigned int bytes = pcl::lzfCompress( plane.data(), static_cast<unsigned int>( plane.size() ), chunk.data(), static_cast<unsigned int>( chunk.size() ) );
+				if ( bytes == 0 ) ok = false;
+				chunk.resize( bytes );
+			}
+		}
+	} );
+	if ( !ok ) {
+		ofLogError( "ofxPcl::save" ) << "compression failed for " << fullPath;
+		return false;
+	}
+
+	std::ostringstream header;
+	header.imbue( std::locale::classic() );
+	header << pcl::PCDWriter::generateHeader( cloud ) << "# ofxPcl chunks " << pointsPerChunk;
+	size_t compressedSize = 0;
+	for ( const auto& chunk : chunks ) {
+		header << " " << chunk.size();
+		compressedSize += chunk.size();
+	}
+	header << "\nDATA binary_compressed\n";
+
+	size_t uncompressedSize = numPoints * recordSize;
+	if ( uncompressedSize > std::numeric_limits<uint32_t>::max() || compressedSize > std::numeric_limits<uint32_t>::max() ) {
+		ofLogWarning( "ofxPcl::save" ) << fullPath << " exceeds the 4 GB limit of binary_compressed, only ofxPcl can read it back";
+	}
+	uint32_t sizes[2] = { static_cast<uint32_t>( std::min<size_t>( compressedSize, std::numeric_limits<uint32_t>::max() ) ),
+	                      static_cast<uint32_t>( std::min<size_t>( uncompressedSize, std::numeric_limits<uint32_t>::max() ) ) };
+
+	std::ofstream file( fullPath, std::ios::binary | std::ios::trunc );
+	std::string text = header.str();
+	file.write( text.data(), text.size() );
+	file.write( reinterpret_cast<const char*>( sizes ), sizeof( sizes ) );
+	for ( const auto& chunk : chunks ) file.write( reinterpret_cast<const char*>( chunk.data() ), chunk.size() );
+	if ( !file ) {
+		ofLogError( "ofxPcl::save" ) << "couldn't write " << fullPath;
+		return false;
+	}
+	return true;
+}
+
+// what CloudWriter::write does when its queue is full
+enum class WriterOverflow
+{
+	BLOCK,        // wait for the writer to catch up
+	DROP_OLDEST,  // discard the oldest queued cloud
+	DROP_NEWEST   // discard the incoming cloud
+};
+
+enum class PcdEncoding
+{
+	BINARY,
+	BINARY_COMPRESSED  // chunked, see savePointCloudChunked
+};
+
+struct CloudWriterStats
+{
+	size_t queueDepth     = 0;  // clouds waiting, not counting the one being written
+	size_t written        = 0;
+	size_t dropped        = 0;  // discarded by the overflow policy
+	size_t failed         = 0;
+	uint64_t bytesWritten = 0;
+	double bytesPerSecond = 0;  // over the last second of writes
+	float lastWriteMs     = 0;
+};
+
+/* writes clouds to pcd files in the background so capture threads never wait on the disk.
+ * pcl::PointCloud has no move constructor, so write() swaps the cloud into a bounded queue and hands back
+ * an empty, previously written buffer in its place: refilling it doesn't reallocate */
+template <typename PointT = Point>
+class CloudWriter
+{
+public:
+	explicit CloudWriter( size_t maxQueued = 8, WriterOverflow overflow = WriterOverflow::BLOCK, PcdEncoding encoding = PcdEncoding::BINARY_COMPRESSED )
+	    : m_maxQueued( std::max<size_t>( maxQueued, 1 ) ), m_overflow( overflow ), m_encoding( encoding ) {}
+
+	~CloudWriter() { flush(); }
+
+	CloudWriter( const CloudWriter& ) = delete;
+	CloudWriter& operator=( const CloudWriter& ) = delete;
+
+	/* queue cloud for writing to path (relative to the data folder). cloud is left empty with spare capacity.
+	 * returns false if DROP_NEWEST discarded it, cloud is untouched then */
+	bool write( const std::string& path, pcl::PointCloud<PointT>&& cloud )
+	{
+		bool startWorker = false;
+		{
+			std::unique_lock<std::mutex> lock( m_mutex );
+			std::unique_ptr<Frame> frame;
+			if ( m_queue.size() >= m_maxQueued ) {
+				if ( m_overflow == WriterOverflow::DROP_NEWEST ) {
+					++m_stats.dropped;
+					return false;
+				} else if ( m_overflow == WriterOverflow::DROP_OLDEST ) {
+					frame = std::move( m_queue.front() );
+					m_queue.pop_front();
+					++m_stats.dropped;
+				} else {
+					m_queueChanged.wait( lock, [this] { return m_queue.size() < m_maxQueued; } );
+				}
+			}
+			if ( !frame && !m_spare.empty() ) {
+				frame = std::move( m_spare.back() );
+				m_spare.pop_back();
+			}
+			if ( !frame ) frame.reset( new Frame );
+
+			frame->path = ofToDataPath( path, true );
+			frame->cloud.swap( cloud );
+			cloud.clear();
+			m_queue.push_back( std::move( frame ) );
+			if ( !m_running ) m_running = startWorker = true;
+		}
+		if ( startWorker ) getThreadPool().submit( [this] { runJobs(); } );
+		return true;
+	}
+
+	// block until every queued cloud is written
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock( m_mutex );
+		m_queueChanged.wait( lock, [this] { return !m_running; } );
+	}
+
+	CloudWriterStats getStats() const
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		CloudWriterStats stats = m_stats;
+		stats.queueDepth       = m_queue.size();
+		return stats;
+	}
+
+	void setMaxQueued( size_t maxQueued )
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_maxQueued = std::max<size_t>( maxQueued, 1 );
+		m_queueChanged.notify_all();
+	}
+
+	void setOverflow( WriterOverflow overflow )
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_overflow = overflow;
+	}
+
+	void setEncoding( PcdEncoding encoding )
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_encoding = encoding;
+	}
+
+protected:
+	struct Frame
+	{
+		EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+		std::string path;
+		pcl::PointCloud<PointT> cloud;
+	};
+
+	// worker loop: writes queued clouds until none is left
+	void runJobs()
+	{
+		for ( ;; ) {
+			std::unique_ptr<Frame> frame;
+			PcdEncoding encoding;
+			{
+				std::lock_guard<std::mutex> lock( m_mutex );
+				if ( m_queue.empty() ) {
+					m_running = false;
+					m_queueChanged.notify_all();
+					return;
+				}
+				frame = std::move( m_queue.front() );
+				m_queue.pop_front();
+				encoding = m_encoding;
+				m_queueChanged.notify_all();
+			}
+
+			uint64_t start = ofGetElapsedTimeMicros();
+			bool ok        = false;
+			try {
+				if ( encoding == PcdEncoding::BINARY_COMPRESSED ) {
+					ok = savePointCloudChunked( frame->path, frame->cloud );
+				} else {
+					ok = pcl::io::savePCDFileBinary( frame->path, frame->cloud ) >= 0;
+				}
+			} catch ( const std::exception& e ) {
+				ofLogError( "ofxPcl::CloudWriter" ) << "couldn't write " << frame->path << ": " << e.what();
+			}
+			uint64_t bytes = ok ? static_cast<uint64_t>( std::ifstream( frame->path, std::ios::binary | std::ios::ate ).tellg() ) : 0;
+			uint64_t now   = ofGetElapsedTimeMicros();
+			frame->cloud.clear();
+
+			std::lock_guard<std::mutex> lock( m_mutex );
+			if ( ok ) {
+				++m_stats.written;
+				m_stats.bytesWritten += bytes;
+			} else {
+				++m_stats.failed;
+			}
+			m_stats.lastWriteMs = ( now - start ) / 1000.f;
+
+			if ( m_windowStart == 0 ) m_windowStart = start;
+			m_windowBytes += bytes;
+			if ( now > m_windowStart ) m_stats.bytesPerSecond = m_windowBytes * 1e6 / ( now - m_windowStart );
+			if ( now - m_windowStart >= 1000000 ) {
+				m_windowStart = now;
+				m_windowBytes = 0;
+			}
+			if ( m_spare.size() < m_maxQueued ) m_spare.push_back( std::move( frame ) );
+		}
+	}
+
+	size_t m_maxQueued;
+	WriterOverflow m_overflow;
+	PcdEncoding m_encoding;
+
+	// guarded by m_mutex
+	mutable std::mutex m_mutex;
+	std::condition_variable m_queueChanged;
+	std::deque<std::unique_ptr<Frame>> m_queue;
+	std::vector<std::unique_ptr<Frame>> m_spare;  // written frames whose buffers are handed back by write()
+	bool m_running = false;
+	CloudWriterStats m_stats;
+	uint64_t m_windowStart = 0;
+	uint64_t m_windowBytes = 0;
+};
+
+}  // namespace ofxPointCloudLibrary
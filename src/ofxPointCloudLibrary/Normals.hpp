@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/CloudPool.hpp"
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+namespace detail {
+
+// one point's normal and curvature from its neighbors, flipped towards viewpoint. nan when there are none or the fit fails
+inline bool estimateNormal( const PointCloud& cloud, size_t i, const std::vector<int>* neighbors, const Eigen::Vector4f& viewpoint, float* normal, float& curvature )
+{
+	Eigen::Vector4f plane;
+	if ( !neighbors || !pcl::computePointNormal( cloud, *neighbors, plane, curvature ) ) {
+		normal[0] = normal[1] = normal[2] = curvature = std::numeric_limits<float>::quiet_NaN();
+		return false;
+	}
+	normal[0] = plane[0];
+	normal[1] = plane[1];
+	normal[2] = plane[2];
+	pcl::flipNormalTowardsViewpoint( cloud.points[i], viewpoint[0], viewpoint[1], viewpoint[2], normal[0], normal[1], normal[2] );
+	return true;
+}
+
+/* pcl::NormalEstimationOMP's per point work on the ThreadPool: plane fit over each point's neighbors, normal
+ * flipped towards viewpoint. neighbors( i, indices, squaredDistances ) returns point i's neighbor list, using
+ * the scratch vectors if it has to, or null when there is none. non-finite points and failed fits get nan
+ * normals and curvature, returns whether every point got a normal. the free pcl::computePointNormal keeps its
+ * covariance on the stack, so threads share nothing */
+template <typename Neighbors>
+bool computeNormals( const PointCloud& cloud, const Eigen::Vector4f& viewpoint, const Neighbors& neighbors, float* normals, size_t normalStride, float* curvatures, size_t curvatureStride, size_t numThreads )
+{
+	std::atomic<bool> dense{ true };
+	getThreadPool().parallelFor( 0, cloud.size(), [&]( size_t begin, size_t end ) {
+		std::vector<int> indices;
+		std::vector<float> squaredDistances;
+		bool chunkDense = true;
+		for ( size_t i = begin; i < end; ++i ) {
+			const std::vector<int>* pointNeighbors = pcl::isFinite( cloud.points[i] ) ? neighbors( i, indices, squaredDistances ) : nullptr;
+			if ( !estimateNormal( cloud, i, pointNeighbors, viewpoint, normals + i * normalStride, curvatures[i * curvatureStride] ) ) chunkDense = false;
+		}
+		if ( !chunkDense ) dense = false;
+	}, numThreads );
+	return dense;
+}
+
+// neighbors from the SearchCache's search of the cloud (organized or kd-tree)
+inline std::function<const std::vector<int>*( size_t, std::vector<int>&, std::vector<float>& )> searchNeighbors( const PointCloud::ConstPtr& pointCloud, int k )
+{
+	auto search = getSearchCache().getSearch( pointCloud );
+	return [search, pointCloud, k]( size_t i, std::vector<int>& indices, std::vector<float>& squaredDistances ) {
+		return search->nearestKSearch( pointCloud->points[i], k, indices, squaredDistances ) > 0 ? &indices : nullptr;
+	};
+}
+
+// neighbors from precomputed lists, e.g. findNearestNeighbors shared with other feature stages
+inline std::function<const std::vector<int>*( size_t, std::vector<int>&, std::vector<float>& )> listedNeighbors( const std::vector<std::vector<int>>& lists )
+{
+	return [&lists]( size_t i, std::vector<int>&, std::vector<float>& ) { return lists[i].empty() ? nullptr : &lists[i]; };
+}
+
+template <typename Neighbors>
+void computeNormals( const PointCloud::ConstPtr& pointCloud, const Neighbors& neighbors, pcl::PointCloud<pcl::Normal>& output, size_t numThreads )
+{
+	output.resize( pointCloud->size() );
+	output.header   = pointCloud->header;
+	output.width    = pointCloud->width;
+	output.height   = pointCloud->height;
+	output.is_dense = true;
+	if ( pointCloud->empty() ) return;
+	const size_t stride = sizeof( pcl::Normal ) / sizeof( float );
+	output.is_dense     = computeNormals( *pointCloud, pointCloud->sensor_origin_, neighbors, output.points[0].normal, stride, &output.points[0].curvature, stride, numThreads );
+}
+
+}  // namespace detail
+
+/* normals from the k nearest neighbors, the work of pcl::NormalEstimationOMP split across the ofxPcl
+ * ThreadPool (numThreads == 0 uses the whole pool) instead of an OpenMP team per call. the neighbor search
+ * comes from the SearchCache, so stages that search the same cloud share it; after editing the cloud in place,
+ * bump its header.seq or call getSearchCache().invalidate() first. normals point towards the cloud's sensor
+ * origin like in pcl, points without a normal get nan */
+inline void computeNormals( const PointCloud::ConstPtr& pointCloud, int k, pcl::PointCloud<pcl::Normal>& normals, size_t numThreads = 0 )
+{
+	detail::computeNormals( pointCloud, detail::searchNeighbors( pointCloud, k ), normals, numThreads );
+}
+
+// with neighbor lists computed once for several stages, see findNearestNeighbors
+inline void computeNormals( const PointCloud::ConstPtr& pointCloud, const std::vector<std::vector<int>>& neighbors, pcl::PointCloud<pcl::Normal>& normals, size_t numThreads = 0 )
+{
+	if ( neighbors.size() != pointCloud->size() ) {
+		ofLogError( "ofxPcl::computeNormals" ) << neighbors.size() << " neighbor lists for " << pointCloud->size() << " points";
+		return;
+	}
+	detail::computeNormals( pointCloud, detail::listedNeighbors( neighbors ), normals, numThreads );
+}
+
+// points and normals packed together, as the point-to-plane registration uses them
+inline void computeNormals( const PointCloud::ConstPtr& pointCloud, int k, pcl::PointCloud<pcl::PointNormal>& output, size_t numThreads = 0 )
+{
+	pcl::copyPointCloud( *pointCloud, output );
+	if ( pointCloud->empty() ) return;
+	const size_t stride = sizeof( pcl::PointNormal ) / sizeof( float );
+	output.is_dense     = detail::computeNormals( *pointCloud, pointCloud->sensor_origin_, detail::searchNeighbors( pointCloud, k ), output.points[0].normal, stride, &output.points[0].curvature, stride, numThreads );
+}
+
+/* normals for the mesh vertices written straight into the mesh, oriented towards viewpoint.
+ * vertices without a normal get nan */
+inline void computeNormals( ofMesh& mesh, int k, const glm::vec3& viewpoint = glm::vec3( 0.f ), size_t numThreads = 0 )
+{
+	const auto& vertices = mesh.getVertices();
+	auto& normals        = mesh.getNormals();
+	normals.resize( vertices.size() );
+	if ( vertices.empty() ) return;
+
+	auto cloud = getCloudPool().acquire( vertices.size() );
+	toPcl( vertices, *cloud );
+	std::vector<float> curvatures( vertices.size() );
+	detail::computeNormals( *cloud, Eigen::Vector4f( viewpoint.x, viewpoint.y, viewpoint.z, 0.f ), detail::searchNeighbors( cloud, k ), &normals[0].x, 3, curvatures.data(), 1, numThreads );
+}
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/SearchCache.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+// pinhole camera intrinsics in pixels
+struct CameraIntrinsics
+{
+	float fx = 0.f;  // focal lengths
+	float fy = 0.f;
+	float cx = 0.f;  // principal point
+	float cy = 0.f;
+};
+
+/* depth image -> organized cloud with one point per pixel, in the camera frame (x right, y down, z forward).
+ * depth is multiplied by depthScale to get meters. pixels without depth (0 or not finite) become nan points
+ * and clear is_dense, so the grid structure survives for the organized normals and search. every call bumps
+ * output.header.seq: a reused frame keeps its buffer and size, and the SearchCache must not hand back its old tree */
+template <typename DepthT>
+bool depthToCloud( const DepthT* depth, size_t width, size_t height, const CameraIntrinsics& intrinsics, float depthScale, PointCloud& output )
+{
+	if ( !( intrinsics.fx > 0.f ) || !( intrinsics.fy > 0.f ) ) {
+		ofLogError( "ofxPcl::depthToCloud" ) << "focal lengths must be positive";
+		return false;
+	}
+	output.resize( width * height );
+	++output.header.seq;
+	output.width               = static_cast<uint32_t>( width );
+	output.height              = static_cast<uint32_t>( height );
+	output.sensor_origin_      = Eigen::Vector4f::Zero();
+	output.sensor_orientation_ = Eigen::Quaternionf::Identity();
+	if ( width == 0 || height == 0 ) {
+		output.is_dense = true;
+		return true;
+	}
+
+	// per column x / z, the rows use the same for y / z
+	std::vector<float> columnScale( width );
+	for ( size_t u = 0; u < width; ++u ) columnScale[u] = ( u - intrinsics.cx ) / intrinsics.fx;
+
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	std::atomic<bool> dense{ true };
+	getThreadPool().parallelFor( 0, height, [&]( size_t rowBegin, size_t rowEnd ) {
+		bool rowsDense = true;
+		for ( size_t v = rowBegin; v < rowEnd; ++v ) {
+			const float rowScale = ( v - intrinsics.cy ) / intrinsics.fy;
+			const DepthT* row    = depth + v * width;
+			Point* points        = &output.points[v * width];
+			for ( size_t u = 0; u < width; ++u ) {
+				float z = static_cast<float>( row[u] ) * depthScale;
+				if ( z > 0.f && std::isfinite( z ) ) {
+					points[u] = { columnScale[u] * z, rowScale * z, z };
+				} else {
+					points[u] = { nan, nan, nan };
+					rowsDense = false;
+				}
+			}
+		}
+		if ( !rowsDense ) dense = false;
+	} );
+	output.is_dense = dense;
+	return true;
+}
+
+// 16 bit depth frames, millimeters by default (kinect, realsense)
+inline bool depthToCloud( const ofShortPixels& depth, const CameraIntrinsics& intrinsics, PointCloud& output, float depthScale = 0.001f )
+{
+	if ( depth.getNumChannels() != 1 ) {
+		ofLogError( "ofxPcl::depthToCloud" ) << "expected single channel depth pixels, got " << depth.getNumChannels() << " channels";
+		return false;
+	}
+	return depthToCloud( depth.getData(), depth.getWidth(), depth.getHeight(), intrinsics, depthScale, output );
+}
+
+// float depth frames, meters by default
+inline bool depthToCloud( const ofFloatPixels& depth, const CameraIntrinsics& intrinsics, PointCloud& output, float depthScale = 1.f )
+{
+	if ( depth.getNumChannels() != 1 ) {
+		ofLogError( "ofxPcl::depthToCloud" ) << "expected single channel depth pixels, got " << depth.getNumChannels() << " channels";
+		return false;
+	}
+	return depthToCloud( depth.getData(), depth.getWidth(), depth.getHeight(), intrinsics, depthScale, output );
+}
+
+// how pcl::IntegralImageNormalEstimation combines the integral images
+enum class OrganizedNormalMethod
+{
+	COVARIANCE_MATRIX,     // 9 integral images, normal from the local covariance
+	AVERAGE_3D_GRADIENT,   // 6 integral images, cross product of smoothed gradients
+	AVERAGE_DEPTH_CHANGE,  // 1 integral image of depth, fastest
+	SIMPLE_3D_GRADIENT     // gradients without smoothing
+};
+
+struct OrganizedNormalSettings
+{
+	OrganizedNormalMethod method  = OrganizedNormalMethod::AVERAGE_3D_GRADIENT;
+	float maxDepthChangeFactor    = 0.02f;  // depth change that counts as an object border
+	float smoothingSize           = 10.f;   // smoothing window in pixels
+	bool depthDependentSmoothing  = false;  // grow the window with depth
+};
+
+/* normals of an organized cloud from integral images, constant time per pixel instead of a kNN search.
+ * points without a valid normal get nan normals */
+inline bool computeOrganizedNormals( const PointCloud::ConstPtr& pointCloud, pcl::PointCloud<pcl::Normal>& normals, const OrganizedNormalSettings& settings = OrganizedNormalSettings() )
+{
+	if ( !pointCloud->isOrganized() ) {
+		ofLogError( "ofxPcl::computeOrganizedNormals" ) << "cloud isn't organized, use computeNormals";
+		return false;
+	}
+	using Estimation = pcl::IntegralImageNormalEstimation<Point, pcl::Normal>;
+	static const Estimation::NormalEstimationMethod methods[] = { Estimation::COVARIANCE_MATRIX, Estimation::AVERAGE_3D_GRADIENT, Estimation::AVERAGE_DEPTH_CHANGE, Estimation::SIMPLE_3D_GRADIENT };
+
+	Estimation estimation;
+	estimation.setNormalEstimationMethod( methods[static_cast<int>( settings.method )] );
+	estimation.setMaxDepthChangeFactor( settings.maxDepthChangeFactor );
+	estimation.setNormalSmoothingSize( settings.smoothingSize );
+	estimation.setDepthDependentSmoothing( settings.depthDependentSmoothing );
+	estimation.setInputCloud( pointCloud );
+	estimation.compute( normals );
+	return true;
+}
+
+inline bool computeOrganizedNormals( const PointCloud::ConstPtr& pointCloud, pcl::PointCloud<pcl::PointNormal>& output, const OrganizedNormalSettings& settings = OrganizedNormalSettings() )
+{
+	pcl::PointCloud<pcl::Normal> normals;
+	if ( !computeOrganizedNormals( pointCloud, normals, settings ) ) return false;
+	pcl::concatenateFields( *pointCloud, normals, output );
+	return true;
+}
+
+/* k nearest neighbors of every point, queried in parallel. organized clouds from a projective device are
+ * searched through the image grid (pcl::search::OrganizedNeighbor), others with the cloud's cached kd-tree.
+ * both come from the SearchCache, a cloud edited in place needs a new header.seq or an invalidate().
+ * lists are sorted by distance and include the point itself; non-finite points get empty lists */
+inline void findNearestNeighbors( const PointCloud::ConstPtr& pointCloud, int k, std::vector<std::vector<int>>& neighbors )
+{
+	neighbors.resize( pointCloud->size() );
+	auto search = getSearchCache().getSearch( pointCloud );
+	getThreadPool().parallelFor( 0, pointCloud->size(), [&]( size_t begin, size_t end ) {
+		std::vector<float> squaredDistances;
+		for ( size_t i = begin; i < end; ++i ) {
+			const Point& point = pointCloud->points[i];
+			if ( pcl::isFinite( point ) ) {
+				search->nearestKSearch( point, k, neighbors[i], squaredDistances );
+			} else {
+				neighbors[i].clear();
+			}
+		}
+	} );
+}
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,348 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+static_assert( sizeof( glm::vec3 ) == 3 * sizeof( float ), "glm::vec3 must be 3 packed floats" );
+
+/* non-owning, strided view of xyz float triplets
+ * can point into a std::vector<glm::vec3>, ofMesh vertices/normals, or any pcl::PointCloud (16+ byte points) */
+template <typename T>
+class BasicPointsView
+{
+	using Byte = typename std::conditional<std::is_const<T>::value, const unsigned char, unsigned char>::type;
+
+public:
+	class Iterator
+	{
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type        = glm::vec3;
+		using difference_type   = std::ptrdiff_t;
+		using pointer           = T*;
+		using reference         = T&;
+
+		Iterator() {}
+		Iterator( Byte* ptr, size_t stride )
+		    : m_ptr( ptr ), m_stride( stride ) {}
+
+		reference operator*() const { return *reinterpret_cast<T*>( m_ptr ); }
+		pointer operator->() const { return reinterpret_cast<T*>( m_ptr ); }
+		reference operator[]( difference_type n ) const { return *( *this + n ); }
+
+		Iterator& operator++()
+		{
+			m_ptr += m_stride;
+			return *this;
+		}
+		Iterator& operator--()
+		{
+			m_ptr -= m_stride;
+			return *this;
+		}
+		Iterator operator++( int )
+		{
+			Iterator it = *this;
+			++*this;
+			return it;
+		}
+		Iterator operator--( int )
+		{
+			Iterator it = *this;
+			--*this;
+			return it;
+		}
+		Iterator& operator+=( difference_type n )
+		{
+			m_ptr += n * static_cast<difference_type>( m_stride );
+			return *this;
+		}
+		Iterator& operator-=( difference_type n ) { return *this += -n; }
+		Iterator operator+( difference_type n ) const { return Iterator( *this ) += n; }
+		Iterator operator-( difference_type n ) const { return Iterator( *this ) -= n; }
+		difference_type operator-( const Iterator& other ) const { return ( m_ptr - other.m_ptr ) / static_cast<difference_type>( m_stride ); }
+
+		bool operator==( const Iterator& other ) const { return m_ptr == other.m_ptr; }
+		bool operator!=( const Iterator& other ) const { return m_ptr != other.m_ptr; }
+		bool operator<( const Iterator& other ) const { return m_ptr < other.m_ptr; }
+		bool operator>( const Iterator& other ) const { return m_ptr > other.m_ptr; }
+		bool operator<=( const Iterator& other ) const { return m_ptr <= other.m_ptr; }
+		bool operator>=( const Iterator& other ) const { return m_ptr >= other.m_ptr; }
+
+	private:
+		Byte* m_ptr     = nullptr;
+		size_t m_stride = sizeof( glm::vec3 );
+	};
+
+	BasicPointsView() {}
+	BasicPointsView( T* data, size_t size, size_t stride = sizeof( glm::vec3 ) )
+	    : m_data( reinterpret_cast<Byte*>( data ) ), m_size( size ), m_stride( stride ) {}
+
+	// a mutable view converts to a read-only view
+	template <typename U, typename = typename std::enable_if<std::is_same<const U, T>::value>::type>
+	BasicPointsView( const BasicPointsView<U>& other )
+	    : BasicPointsView( other.data(), other.size(), other.stride() ) {}
+
+	T& operator[]( size_t i ) const { return *reinterpret_cast<T*>( m_data + i * m_stride ); }
+
+	T* data() const { return reinterpret_cast<T*>( m_data ); }
+	size_t size() const { return m_size; }
+	size_t stride() const { return m_stride; }
+	bool empty() const { return m_size == 0; }
+
+	// true when points are tightly packed (12 byte stride), i.e. a plain glm::vec3 array
+	bool isPacked() const { return m_stride == sizeof( glm::vec3 ); }
+
+	Iterator begin() const { return Iterator( m_data, m_stride ); }
+	Iterator end() const { return Iterator( m_data + m_size * m_stride, m_stride ); }
+
+	// sub-range [offset, offset + count)
+	BasicPointsView subview( size_t offset, size_t count ) const
+	{
+		return BasicPointsView( &( *this )[offset], count, m_stride );
+	}
+
+private:
+	Byte* m_data    = nullptr;
+	size_t m_size   = 0;
+	size_t m_stride = sizeof( glm::vec3 );
+};
+
+using PointsView        = BasicPointsView<const glm::vec3>;
+using MutablePointsView = BasicPointsView<glm::vec3>;
+
+// -------------------------
+// views (no copies are made)
+// -------------------------
+
+inline PointsView view( const std::vector<glm::vec3>& points )
+{
+	return { points.data(), points.size() };
+}
+
+inline MutablePointsView view( std::vector<glm::vec3>& points )
+{
+	return { points.data(), points.size() };
+}
+
+inline PointsView view( const ofMesh& mesh )
+{
+	return view( mesh.getVertices() );
+}
+
+inline MutablePointsView view( ofMesh& mesh )
+{
+	return view( mesh.getVertices() );
+}
+
+// view the xyz fields of any PCL point type (PointXYZ, PointNormal, PointXYZRGBA...)
+template <typename PointT>
+inline PointsView view( const pcl::PointCloud<PointT>& pointCloud )
+{
+	if ( pointCloud.empty() ) return {};
+	return { reinterpret_cast<const glm::vec3*>( &pointCloud.points[0].x ), pointCloud.size(), sizeof( PointT ) };
+}
+
+template <typename PointT>
+inline MutablePointsView view( pcl::PointCloud<PointT>& pointCloud )
+{
+	if ( pointCloud.empty() ) return {};
+	return { reinterpret_cast<glm::vec3*>( &pointCloud.points[0].x ), pointCloud.size(), sizeof( PointT ) };
+}
+
+// view the normal_x/y/z fields of a PCL point type with normals
+template <typename PointT>
+inline PointsView viewNormals( const pcl::PointCloud<PointT>& pointCloud )
+{
+	if ( pointCloud.empty() ) return {};
+	return { reinterpret_cast<const glm::vec3*>( &pointCloud.points[0].normal_x ), pointCloud.size(), sizeof( PointT ) };
+}
+
+template <typename PointT>
+inline MutablePointsView viewNormals( pcl::PointCloud<PointT>& pointCloud )
+{
+	if ( pointCloud.empty() ) return {};
+	return { reinterpret_cast<glm::vec3*>( &pointCloud.points[0].normal_x ), pointCloud.size(), sizeof( PointT ) };
+}
+
+// copy a view into an existing PCL cloud, reusing its storage when large enough
+inline void toPcl( const PointsView& points, PointCloud& pointCloud )
+{
+	pointCloud.resize( points.size() );
+	pointCloud.width  = static_cast<uint32_t>( points.size() );
+	pointCloud.height = 1;
+	if ( points.empty() ) return;
+	if ( points.isPacked() ) {
+		simd::packedToPadded( &points[0].x, pointCloud.points[0].data, 4, points.size(), 1.f );
+	} else {
+		for ( size_t i = 0; i < points.size(); ++i ) pointCloud.points[i] = toPcl( points[i] );
+	}
+}
+
+// copy a view into an existing glm buffer, reusing its storage when large enough
+inline void toOf( const PointsView& points, std::vector<glm::vec3>& out )
+{
+	if ( points.stride() % sizeof( float ) == 0 && points.stride() >= 4 * sizeof( float ) ) {
+		out.resize( points.size() );
+		if ( !points.empty() ) simd::paddedToPacked( &points[0].x, points.stride() / sizeof( float ), &out[0].x, points.size() );
+	} else {
+		out.assign( points.begin(), points.end() );
+	}
+}
+
+/* kd-tree built directly over a PointsView: only an index permutation and the nodes are stored, never the points
+ * the viewed buffer must outlive the tree and must not be reallocated while it is in use
+ * searches are const and may run concurrently from several threads */
+class PointsKdTree
+{
+public:
+	PointsKdTree() {}
+	explicit PointsKdTree( const PointsView& points, int maxLeafSize = 15 ) { setInput( points, maxLeafSize ); }
+
+	void setInput( const PointsView& points, int maxLeafSize = 15 )
+	{
+		m_points      = points;
+		m_maxLeafSize = std::max( maxLeafSize, 1 );
+		m_nodes.clear();
+		m_indices.resize( points.size() );
+		for ( size_t i = 0; i < m_indices.size(); ++i ) m_indices[i] = static_cast<int>( i );
+		if ( !points.empty() ) build( 0, static_cast<int>( m_indices.size() ) );
+	}
+
+	const PointsView& getInput() const { return m_points; }
+
+	// find k nearest neighbours of query sorted by distance, returns number of neighbours found
+	int nearestKSearch( const glm::vec3& query, int k, std::vector<int>& indices, std::vector<float>& sqrDistances ) const
+	{
+		indices.clear();
+		sqrDistances.clear();
+		if ( m_nodes.empty() || k <= 0 ) return 0;
+
+		std::vector<std::pair<float, int>> heap;  // max-heap on distance
+		heap.reserve( k );
+		searchKnn( 0, query, static_cast<size_t>( k ), heap );
+
+		std::sort_heap( heap.begin(), heap.end() );
+		for ( const auto& h : heap ) {
+			sqrDistances.push_back( h.first );
+			indices.push_back( h.second );
+		}
+		return static_cast<int>( indices.size() );
+	}
+
+	// find all neighbours of query within radius sorted by distance; maxNN == 0 means unlimited
+	int radiusSearch( const glm::vec3& query, float radius, std::vector<int>& indices, std::vector<float>& sqrDistances, unsigned int maxNN = 0 ) const
+	{
+		indices.clear();
+		sqrDistances.clear();
+		if ( m_nodes.empty() ) return 0;
+
+		std::vector<std::pair<float, int>> found;
+		searchRadius( 0, query, radius * radius, found );
+		std::sort( found.begin(), found.end() );
+		if ( maxNN > 0 && found.size() > maxNN ) found.resize( maxNN );
+
+		indices.reserve( found.size() );
+		sqrDistances.reserve( found.size() );
+		for ( const auto& f : found ) {
+			sqrDistances.push_back( f.first );
+			indices.push_back( f.second );
+		}
+		return static_cast<int>( indices.size() );
+	}
+
+protected:
+	struct Node
+	{
+		int begin, end;          // range in m_indices
+		int left = -1, right = -1;  // children, -1 for leaves
+		int axis    = 0;
+		float split = 0.f;
+	};
+
+	int build( int begin, int end )
+	{
+		int nodeId = static_cast<int>( m_nodes.size() );
+		m_nodes.push_back( Node() );
+		m_nodes[nodeId].begin = begin;
+		m_nodes[nodeId].end   = end;
+		if ( end - begin <= m_maxLeafSize ) return nodeId;
+
+		// split the widest axis at the median
+		glm::vec3 lo( std::numeric_limits<float>::max() ), hi( std::numeric_limits<float>::lowest() );
+		for ( int i = begin; i < end; ++i ) {
+			const glm::vec3& p = m_points[m_indices[i]];
+			lo                 = glm::min( lo, p );
+			hi                 = glm::max( hi, p );
+		}
+		glm::vec3 extent = hi - lo;
+		int axis         = extent.x >= extent.y ? ( extent.x >= extent.z ? 0 : 2 ) : ( extent.y >= extent.z ? 1 : 2 );
+
+		int mid = begin + ( end - begin ) / 2;
+		std::nth_element( m_indices.begin() + begin, m_indices.begin() + mid, m_indices.begin() + end, [&]( int a, int b ) {
+			return m_points[a][axis] < m_points[b][axis];
+		} );
+
+		float split = m_points[m_indices[mid]][axis];
+		int left    = build( begin, mid );
+		int right   = build( mid, end );
+
+		Node& node = m_nodes[nodeId];
+		node.axis  = axis;
+		node.split = split;
+		node.left  = left;
+		node.right = right;
+		return nodeId;
+	}
+
+	void searchKnn( int nodeId, const glm::vec3& query, size_t k, std::vector<std::pair<float, int>>& heap ) const
+	{
+		const Node& node = m_nodes[nodeId];
+		if ( node.left < 0 ) {
+			for ( int i = node.begin; i < node.end; ++i ) {
+				int idx = m_indices[i];
+				float d = glm::length2( m_points[idx] - query );
+				if ( heap.size() < k ) {
+					heap.emplace_back( d, idx );
+					std::push_heap( heap.begin(), heap.end() );
+				} else if ( d < heap.front().first ) {
+					std::pop_heap( heap.begin(), heap.end() );
+					heap.back() = std::make_pair( d, idx );
+					std::push_heap( heap.begin(), heap.end() );
+				}
+			}
+			return;
+		}
+
+		float diff = query[node.axis] - node.split;
+		int nearChild = diff < 0.f ? node.left : node.right;
+		int farChild  = diff < 0.f ? node.right : node.left;
+		searchKnn( nearChild, query, k, heap );
+		if ( heap.size() < k || diff * diff < heap.front().first ) searchKnn( farChild, query, k, heap );
+	}
+
+	void searchRadius( int nodeId, const glm::vec3& query, float sqrRadius, std::vector<std::pair<float, int>>& found ) const
+	{
+		const Node& node = m_nodes[nodeId];
+		if ( node.left < 0 ) {
+			for ( int i = node.begin; i < node.end; ++i ) {
+				int idx = m_indices[i];
+				float d = glm::length2( m_points[idx] - query );
+				if ( d <= sqrRadius ) found.emplace_back( d, idx );
+			}
+			return;
+		}
+
+		float diff = query[node.axis] - node.split;
+		if ( diff < 0.f || diff * diff <= sqrRadius ) searchRadius( node.left, query, sqrRadius, found );
+		if ( diff >= 0.f || diff * diff <= sqrRadius ) searchRadius( node.right, query, sqrRadius, found );
+	}
+
+	PointsView m_points;
+	int m_maxLeafSize = 15;
+	std::vector<int> m_indices;
+	std::vector<Node> m_nodes;
+};
+
+}  // namespace ofxPointCloudLibrary
@@ -0,0 +1,474 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Normals.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+/* registration engines selectable in ofxPcl::Alignment */
+enum class AlignmentMethod
+{
+	ICP,              // point-to-point icp, svd transformation estimation
+	ICP_NONLINEAR,    // point-to-point icp, levenberg-marquardt transformation estimation
+	GENERALIZED_ICP,  // plane-to-plane icp on local covariances
+	NDT,              // normal distributions transform, no correspondences
+	POINT_TO_PLANE,   // point-to-plane icp, linear least squares (needs target normals, computed per target)
+};
+
+/* thrown from inside a running alignment to abort it */
+struct AlignmentCancelled : public std::exception
+{
+	const char* what() const noexcept override { return "ofxPcl::Alignment cancelled"; }
+};
+
+/* parameters shared by all engines, values < 0 keep the engine's own pcl default */
+struct RegistrationSettings
+{
+	int maxIterations                = -1;
+	float transformationEpsilon      = -1.f;
+	float euclideanFitnessEpsilon    = -1.f;
+	int normalNeighbours             = 15;    // k for the target normal estimation (POINT_TO_PLANE)
+	int gicpCorrespondenceRandomness = -1;    // k for GENERALIZED_ICP covariances
+	float ndtResolution              = 1.f;   // NDT voxel size at full resolution
+	float ndtStepSize                = -1.f;  // NDT max More-Thuente step length
+	int numThreads                   = 0;     // correspondence search threads for the icp family, 0 uses the whole ThreadPool
+};
+
+/* drop-in replacement for pcl's CorrespondenceEstimation that splits the source points across
+ * the ThreadPool. results are identical to the serial version, in the same order (by source index)
+ * install with setCorrespondenceEstimation() on any pcl icp */
+template <typename PointT>
+class ParallelCorrespondenceEstimation : public pcl::registration::CorrespondenceEstimation<PointT, PointT>
+{
+public:
+	using Base     = pcl::registration::CorrespondenceEstimation<PointT, PointT>;
+	using Ptr      = boost::shared_ptr<ParallelCorrespondenceEstimation<PointT>>;
+	using ConstPtr = boost::shared_ptr<const ParallelCorrespondenceEstimation<PointT>>;
+
+	// numThreads == 0 uses the whole pool, 1 runs serially on the calling thread
+	explicit ParallelCorrespondenceEstimation( size_t numThreads = 0 )
+	    : m_numThreads( numThreads )
+	{
+		this->corr_name_ = "ParallelCorrespondenceEstimation";
+	}
+
+	void setNumThreads( size_t numThreads ) { m_numThreads = numThreads; }
+	size_t getNumThreads() const { return m_numThreads; }
+
+	void determineCorrespondences( pcl::Correspondences& correspondences, double maxDistance = std::numeric_limits<double>::max() ) override
+	{
+		if ( !this->initCompute() ) return;
+		search( correspondences, maxDistance, false );
+		this->deinitCompute();
+	}
+
+	void determineReciprocalCorrespondences( pcl::Correspondences& correspondences, double maxDistance = std::numeric_limits<double>::max() ) override
+	{
+		if ( !this->initCompute() ) return;
+		if ( !this->initComputeReciprocal() ) return;
+		search( correspondences, maxDistance, true );
+		this->deinitCompute();
+	}
+
+	typename pcl::registration::CorrespondenceEstimationBase<PointT, PointT>::Ptr clone() const override
+	{
+		return Ptr( new ParallelCorrespondenceEstimation<PointT>( *this ) );
+	}
+
+protected:
+	void search( pcl::Correspondences& correspondences, double maxDistance, bool reciprocal )
+	{
+		const std::vector<int>& indices = *this->indices_;
+		const auto& source              = this->input_->points;
+		const auto& target              = this->target_->points;
+		const auto& tree                = *this->tree_;
+		const auto* reciprocalTree      = reciprocal ? this->tree_reciprocal_.get() : nullptr;
+		const double maxDistSqr         = maxDistance * maxDistance;
+
+		// one slot per source index, invalid ones are marked and compacted afterwards to keep pcl's order
+		correspondences.resize( indices.size() );
+		size_t numThreads = m_numThreads ? m_numThreads : getThreadPool().getNumThreads();
+		numThreads        = std::max<size_t>( 1, std::min( numThreads, indices.size() / 1024 ) );  // threading small clouds costs more than it saves
+
+		auto searchRange = [&]( size_t begin, size_t end ) {
+			std::vector<int> index( 1 ), indexReciprocal( 1 );
+			std::vector<float> distance( 1 ), distanceReciprocal( 1 );
+			for ( size_t i = begin; i < end; ++i ) {
+				pcl::Correspondence& corr = correspondences[i];
+				corr.index_query          = -1;
+				tree.nearestKSearch( source[indices[i]], 1, index, distance );
+				if ( distance[0] > maxDistSqr ) continue;
+				if ( reciprocalTree ) {
+					reciprocalTree->nearestKSearch( target[index[0]], 1, indexReciprocal, distanceReciprocal );
+					if ( distanceReciprocal[0] > maxDistSqr || indices[i] != indexReciprocal[0] ) continue;
+				}
+				corr.index_query = indices[i];
+				corr.index_match = index[0];
+				corr.distance    = distance[0];
+			}
+		};
+		getThreadPool().parallelFor( 0, indices.size(), searchRange, numThreads );
+
+		size_t nValid = 0;
+		for ( size_t i = 0; i < correspondences.size(); ++i ) {
+			if ( correspondences[i].index_query >= 0 ) correspondences[nValid++] = correspondences[i];
+		}
+		correspondences.resize( nValid );
+	}
+
+	size_t m_numThreads;
+};
+
+namespace detail {
+
+/* forwards to the wrapped transformation estimation and calls onIteration before each estimate,
+ * i.e. once per icp iteration. pcl 1.9.1's icp never invokes its registerVisualizationCallback hook,
+ * so this is where progress is reported and cancellation is checked for the icp family */
+template <typename PointT>
+class ObservedTransformationEstimation : public pcl::registration::TransformationEstimation<PointT, PointT>
+{
+public:
+	using Base    = pcl::registration::TransformationEstimation<PointT, PointT>;
+	using Matrix4 = typename Base::Matrix4;
+	using Ptr     = boost::shared_ptr<ObservedTransformationEstimation<PointT>>;
+
+	ObservedTransformationEstimation( const typename Base::Ptr& estimation, const std::function<void()>& onIteration )
+	    : m_estimation( estimation ), m_onIteration( onIteration ) {}
+
+	void estimateRigidTransformation( const pcl::PointCloud<PointT>& src, const pcl::PointCloud<PointT>& tgt, Matrix4& transform ) const override
+	{
+		m_onIteration();
+		m_estimation->estimateRigidTransformation( src, tgt, transform );
+	}
+
+	void estimateRigidTransformation( const pcl::PointCloud<PointT>& src, const std::vector<int>& srcIndices, const pcl::PointCloud<PointT>& tgt, Matrix4& transform ) const override
+	{
+		m_onIteration();
+		m_estimation->estimateRigidTransformation( src, srcIndices, tgt, transform );
+	}
+
+	void estimateRigidTransformation( const pcl::PointCloud<PointT>& src, const std::vector<int>& srcIndices, const pcl::PointCloud<PointT>& tgt, const std::vector<int>& tgtIndices, Matrix4& transform ) const override
+	{
+		m_onIteration();
+		m_estimation->estimateRigidTransformation( src, srcIndices, tgt, tgtIndices, transform );
+	}
+
+	void estimateRigidTransformation( const pcl::PointCloud<PointT>& src, const pcl::PointCloud<PointT>& tgt, const pcl::Correspondences& correspondences, Matrix4& transform ) const override
+	{
+		m_onIteration();
+		m_estimation->estimateRigidTransformation( src, tgt, correspondences, transform );
+	}
+
+protected:
+	typename Base::Ptr m_estimation;
+	std::function<void()> m_onIteration;
+};
+
+/* gicp runs its own BFGS optimizer instead of a TransformationEstimation, so the hook wraps that */
+template <typename PointT>
+class ObservedGeneralizedIcp : public pcl::GeneralizedIterativeClosestPoint<PointT, PointT>
+{
+public:
+	ObservedGeneralizedIcp( const std::function<void()>& onIteration )
+	{
+		auto estimate                          = this->rigid_transformation_estimation_;
+		this->rigid_transformation_estimation_ = [estimate, onIteration]( const pcl::PointCloud<PointT>& src, const std::vector<int>& srcIndices, const pcl::PointCloud<PointT>& tgt, const std::vector<int>& tgtIndices, Eigen::Matrix4f& transform ) {
+			onIteration();
+			estimate( src, srcIndices, tgt, tgtIndices, transform );
+		};
+	}
+
+	// compute the target covariances up front instead of on the first align, so they can be shared
+	void computeTargetCovariances()
+	{
+		if ( this->target_covariances_ && !this->target_covariances_->empty() ) return;
+		this->target_covariances_.reset( new typename pcl::GeneralizedIterativeClosestPoint<PointT, PointT>::MatricesVector );
+		this->template computeCovariances<PointT>( this->target_, this->tree_, *this->target_covariances_ );
+	}
+
+	const typename pcl::GeneralizedIterativeClosestPoint<PointT, PointT>::MatricesVectorPtr& getTargetCovariances() const { return this->target_covariances_; }
+};
+
+/* ndt whose target grid can be copied from another instance instead of being rebuilt */
+template <typename PointT>
+class SharedTargetNdt : public pcl::NormalDistributionsTransform<PointT, PointT>
+{
+public:
+	// prepared must have the same resolution and target
+	void shareTarget( const SharedTargetNdt<PointT>& prepared, const typename pcl::PointCloud<PointT>::ConstPtr& target )
+	{
+		pcl::Registration<PointT, PointT>::setInputTarget( target );  // skips init()
+		this->target_cells_ = prepared.target_cells_;
+	}
+};
+
+// the target an engine registers against: xyz clouds are used as they are, normals are computed on demand
+inline PointCloud::ConstPtr toRegistrationCloud( const PointCloud::ConstPtr& pointCloud, const RegistrationSettings&, PointCloud::Ptr& )
+{
+	return pointCloud;
+}
+
+inline pcl::PointCloud<pcl::PointNormal>::ConstPtr toRegistrationCloud( const PointCloud::ConstPtr& pointCloud, const RegistrationSettings& settings, pcl::PointCloud<pcl::PointNormal>::Ptr& buffer )
+{
+	if ( !buffer ) buffer.reset( new pcl::PointCloud<pcl::PointNormal> );
+	ofxPointCloudLibrary::computeNormals( pointCloud, settings.normalNeighbours, *buffer, std::max( 0, settings.numThreads ) );
+	return buffer;
+}
+
+/* the source an engine registers. point-to-plane only reads the target's normals and the correspondences
+ * are searched on xyz, so source normals are left at zero instead of being estimated every align */
+inline PointCloud::ConstPtr toRegistrationSource( const PointCloud::ConstPtr& pointCloud, PointCloud::Ptr& )
+{
+	return pointCloud;
+}
+
+inline pcl::PointCloud<pcl::PointNormal>::ConstPtr toRegistrationSource( const PointCloud::ConstPtr& pointCloud, pcl::PointCloud<pcl::PointNormal>::Ptr& buffer )
+{
+	if ( !buffer ) buffer.reset( new pcl::PointCloud<pcl::PointNormal> );
+	pcl::copyPointCloud( *pointCloud, *buffer );
+	return buffer;
+}
+
+template <typename PointT>
+typename pcl::registration::TransformationEstimation<PointT, PointT>::Ptr observe( const typename pcl::registration::TransformationEstimation<PointT, PointT>::Ptr& estimation, const std::function<void()>& onIteration )
+{
+	return typename ObservedTransformationEstimation<PointT>::Ptr( new ObservedTransformationEstimation<PointT>( estimation, onIteration ) );
+}
+
+// xyz engines, leafSize is the pyramid level's voxel size (0 at full resolution)
+template <typename PointT>
+typename ParallelCorrespondenceEstimation<PointT>::Ptr createCorrespondenceEstimation( const RegistrationSettings& settings )
+{
+	return typename ParallelCorrespondenceEstimation<PointT>::Ptr( new ParallelCorrespondenceEstimation<PointT>( std::max( 0, settings.numThreads ) ) );
+}
+
+inline void createRegistration( AlignmentMethod method, const RegistrationSettings& settings, float leafSize, const std::function<void()>& onIteration, pcl::Registration<Point, Point>::Ptr& registration )
+{
+	switch ( method ) {
+		case AlignmentMethod::GENERALIZED_ICP: {
+			auto gicp = new ObservedGeneralizedIcp<Point>( onIteration );
+			if ( settings.gicpCorrespondenceRandomness > 0 ) gicp->setCorrespondenceRandomness( settings.gicpCorrespondenceRandomness );
+			registration.reset( gicp );
+			break;
+		}
+		case AlignmentMethod::NDT: {
+			auto ndt = new SharedTargetNdt<Point>;
+			// coarse levels need cells at least a couple of voxels wide
+			ndt->setResolution( std::max( settings.ndtResolution, 2.f * leafSize ) );
+			if ( settings.ndtStepSize > 0.f ) ndt->setStepSize( settings.ndtStepSize );
+
+			// unlike icp, ndt does call the visualization hook, once per iteration
+			boost::function<void( const PointCloud&, const std::vector<int>&, const PointCloud&, const std::vector<int>& )> callback =
+			    [onIteration]( const PointCloud&, const std::vector<int>&, const PointCloud&, const std::vector<int>& ) { onIteration(); };
+			ndt->registerVisualizationCallback( callback );
+			registration.reset( ndt );
+			break;
+		}
+		case AlignmentMethod::ICP_NONLINEAR: {
+			auto icp = new pcl::IterativeClosestPointNonLinear<Point, Point>;
+			icp->setCorrespondenceEstimation( createCorrespondenceEstimation<Point>( settings ) );
+			icp->setTransformationEstimation( observe<Point>( pcl::registration::TransformationEstimationLM<Point, Point>::Ptr( new pcl::registration::TransformationEstimationLM<Point, Point> ), onIteration ) );
+			registration.reset( icp );
+			break;
+		}
+		default: {
+			auto icp = new pcl::IterativeClosestPoint<Point, Point>;
+			icp->setCorrespondenceEstimation( createCorrespondenceEstimation<Point>( settings ) );
+			icp->setTransformationEstimation( observe<Point>( pcl::registration::TransformationEstimationSVD<Point, Point>::Ptr( new pcl::registration::TransformationEstimationSVD<Point, Point> ), onIteration ) );
+			registration.reset( icp );
+			break;
+		}
+	}
+}
+
+// engines on points with normals
+inline void createRegistration( AlignmentMethod, const RegistrationSettings& settings, float, const std::function<void()>& onIteration, pcl::Registration<pcl::PointNormal, pcl::PointNormal>::Ptr& registration )
+{
+	auto icp = new pcl::IterativeClosestPoint<pcl::PointNormal, pcl::PointNormal>;
+	icp->setCorrespondenceEstimation( createCorrespondenceEstimation<pcl::PointNormal>( settings ) );
+	icp->setTransformationEstimation( observe<pcl::PointNormal>( pcl::registration::TransformationEstimationPointToPlaneLLS<pcl::PointNormal, pcl::PointNormal>::Ptr( new pcl::registration::TransformationEstimationPointToPlaneLLS<pcl::PointNormal, pcl::PointNormal> ), onIteration ) );
+	registration.reset( icp );
+}
+
+// set the target of a new registration, reusing the target state already built by prepared
+inline void shareTarget( AlignmentMethod method, pcl::Registration<Point, Point>& registration, const pcl::Registration<Point, Point>& prepared, const PointCloud::ConstPtr& target )
+{
+	switch ( method ) {
+		case AlignmentMethod::GENERALIZED_ICP: {
+			auto& gicp = static_cast<ObservedGeneralizedIcp<Point>&>( registration );
+			gicp.setInputTarget( target );
+			gicp.setTargetCovariances( static_cast<const ObservedGeneralizedIcp<Point>&>( prepared ).getTargetCovariances() );
+			break;
+		}
+		case AlignmentMethod::NDT:
+			static_cast<SharedTargetNdt<Point>&>( registration ).shareTarget( static_cast<const SharedTargetNdt<Point>&>( prepared ), target );
+			break;
+		default:
+			registration.setInputTarget( target );
+			break;
+	}
+}
+
+inline void shareTarget( AlignmentMethod, pcl::Registration<pcl::PointNormal, pcl::PointNormal>& registration, const pcl::Registration<pcl::PointNormal, pcl::PointNormal>&, const pcl::PointCloud<pcl::PointNormal>::ConstPtr& target )
+{
+	registration.setInputTarget( target );
+}
+
+// build the target state that is otherwise computed lazily inside the first align
+inline void prepareTarget( AlignmentMethod method, pcl::Registration<Point, Point>& registration )
+{
+	if ( method == AlignmentMethod::GENERALIZED_ICP ) static_cast<ObservedGeneralizedIcp<Point>&>( registration ).computeTargetCovariances();
+}
+
+inline void prepareTarget( AlignmentMethod, pcl::Registration<pcl::PointNormal, pcl::PointNormal>& ) {}
+
+/* a target cloud at one resolution, leafSize == 0 for full resolution */
+struct TargetLevel
+{
+	PointCloud::ConstPtr cloud;
+	float leafSize = 0.f;
+};
+
+/* point type independent interface the Alignment drives */
+class RegistrationEngine
+{
+public:
+	virtual ~RegistrationEngine() {}
+
+	// prepare per-level state (search trees, normals, covariances, ndt grids) once per target
+	virtual void setTargets( const std::vector<TargetLevel>& levels ) = 0;
+
+	// update iteration and convergence criteria without touching the target state
+	virtual void setSettings( const RegistrationSettings& settings ) = 0;
+
+	// align source to target level, writes the transformed source to output
+	// maxCorrespondenceDistance <= 0 keeps the engine's default
+	virtual void align( size_t level, const PointCloud::ConstPtr& source, const Eigen::Matrix4f& guess, float maxCorrespondenceDistance, PointCloud& output ) = 0;
+
+	// a new engine with its own registration objects, sharing this engine's read-only target state
+	// (clouds, search trees, normals, gicp covariances; ndt grids are copied), for use on another thread
+	virtual std::unique_ptr<RegistrationEngine> fork( const std::function<void()>& onIteration ) const = 0;
+
+	virtual Eigen::Matrix4f getFinalTransformation() const = 0;
+	virtual bool hasConverged() const                      = 0;
+	virtual double getFitnessScore()                       = 0;
+};
+
+/* one pcl::Registration per target level, so switching levels never rebuilds a level's target state */
+template <typename PointT>
+class RegistrationEngineT : public RegistrationEngine
+{
+public:
+	using Cloud        = pcl::PointCloud<PointT>;
+	using Registration = pcl::Registration<PointT, PointT>;
+
+	RegistrationEngineT( AlignmentMethod method, const RegistrationSettings& settings, const std::function<void()>& onIteration )
+	    : m_method( method ), m_settings( settings ), m_onIteration( onIteration ) {}
+
+	void setTargets( const std::vector<TargetLevel>& levels ) override
+	{
+		m_levels.clear();
+		m_current.reset();
+		for ( const auto& targetLevel : levels ) {
+			Level level;
+			if ( targetLevel.cloud->empty() ) {
+				m_levels.push_back( level );  // keeps the level indices, Alignment skips empty levels
+				continue;
+			}
+			level.target       = toRegistrationCloud( targetLevel.cloud, m_settings, level.buffer );
+			level.leafSize     = targetLevel.leafSize;
+			level.registration = create( level.leafSize );
+
+			// ndt only searches it for the fitness score, the icp family every iteration. new targets may be
+			// pooled or converted buffers refilled in place, so their trees are rebuilt
+			getSearchCache<PointT>().invalidate( level.target.get() );
+			level.tree = getSearchCache<PointT>().getTree( level.target );
+			level.registration->setSearchMethodTarget( level.tree, true );  // never rebuilt inside pcl
+			level.registration->setInputTarget( level.target );
+			prepareTarget( m_method, *level.registration );
+			m_levels.push_back( level );
+		}
+	}
+
+	std::unique_ptr<RegistrationEngine> fork( const std::function<void()>& onIteration ) const override
+	{
+		std::unique_ptr<RegistrationEngineT<PointT>> engine( new RegistrationEngineT<PointT>( m_method, m_settings, onIteration ) );
+		for ( const auto& level : m_levels ) {
+			Level shared = level;
+			if ( level.registration ) {
+				shared.registration = engine->create( level.leafSize );
+				shared.registration->setSearchMethodTarget( level.tree, true );
+				shareTarget( m_method, *shared.registration, *level.registration, level.target );
+			}
+			engine->m_levels.push_back( shared );
+		}
+		return engine;
+	}
+
+	void setSettings( const RegistrationSettings& settings ) override
+	{
+		m_settings = settings;
+		for ( auto& level : m_levels ) {
+			if ( level.registration ) configure( *level.registration );
+		}
+	}
+
+	void align( size_t levelIndex, const PointCloud::ConstPtr& source, const Eigen::Matrix4f& guess, float maxCorrespondenceDistance, PointCloud& output ) override
+	{
+		m_current = m_levels[levelIndex].registration;
+		if ( maxCorrespondenceDistance > 0.f && m_method != AlignmentMethod::NDT ) m_current->setMaxCorrespondenceDistance( maxCorrespondenceDistance );
+		m_current->setInputSource( toRegistrationSource( source, m_sourceBuffer ) );
+		m_current->align( m_output, guess );
+		pcl::copyPointCloud( m_output, output );
+	}
+
+	Eigen::Matrix4f getFinalTransformation() const override { return m_current ? m_current->getFinalTransformation() : Eigen::Matrix4f::Identity(); }
+	bool hasConverged() const override { return m_current && m_current->hasConverged(); }
+	double getFitnessScore() override { return m_current ? m_current->getFitnessScore() : std::numeric_limits<double>::max(); }
+
+protected:
+	struct Level
+	{
+		typename Cloud::ConstPtr target;
+		typename Cloud::Ptr buffer;
+		typename pcl::search::KdTree<PointT>::Ptr tree;
+		typename Registration::Ptr registration;
+		float leafSize = 0.f;
+	};
+
+	typename Registration::Ptr create( float leafSize )
+	{
+		typename Registration::Ptr registration;
+		createRegistration( m_method, m_settings, leafSize, m_onIteration, registration );
+		configure( *registration );
+		return registration;
+	}
+
+	void configure( Registration& registration ) const
+	{
+		if ( m_settings.maxIterations > 0 ) registration.setMaximumIterations( m_settings.maxIterations );
+		if ( m_settings.transformationEpsilon >= 0.f ) registration.setTransformationEpsilon( m_settings.transformationEpsilon );
+		if ( m_settings.euclideanFitnessEpsilon >= 0.f ) registration.setEuclideanFitnessEpsilon( m_settings.euclideanFitnessEpsilon );
+	}
+
+	AlignmentMethod m_method;
+	RegistrationSettings m_settings;
+	std::function<void()> m_onIteration;
+
+	std::vector<Level> m_levels;
+	typename Registration::Ptr m_current;
+	typename Cloud::Ptr m_sourceBuffer;
+	Cloud m_output;
+};
+
+inline std::unique_ptr<RegistrationEngine> createRegistrationEngine( AlignmentMethod method, const RegistrationSettings& settings, const std::function<void()>& onIteration )
+{
+	if ( method == AlignmentMethod::POINT_TO_PLANE ) {
+		return std::unique_ptr<RegistrationEngine>( new RegistrationEngineT<pcl::PointNormal>( method, settings, onIteration ) );
+	}
+	return std::unique_ptr<RegistrationEngine>( new RegistrationEngineT<Point>( method, settings, onIteration ) );
+}
+
+}  // namespace detail
+}  // namespace ofxPointCloudLibrary
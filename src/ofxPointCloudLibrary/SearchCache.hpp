@@ -0,0 +1,199 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Types.hpp"
+
+#include <mutex>
+
+namespace ofxPointCloudLibrary {
+
+struct SearchCacheStats
+{
+	size_t hits    = 0;  // searches handed out without a build
+	size_t builds  = 0;  // searches built for a new or changed cloud
+	size_t entries = 0;  // clouds currently cached
+};
+
+/* one shared kd-tree per cloud, so the wrappers that search the same cloud in a frame (registration, normals,
+ * outlier removal, clustering) build it once. clouds are keyed by address, and a cloud counts as changed when
+ * its point buffer, size, header.seq or header.stamp differ from when its tree was built. in-place edits that
+ * keep all of those must bump header.seq or call invalidate(). the trees are shared and read-only: searching
+ * from several threads is fine, setInputCloud() is not. an entry keeps its cloud alive until the next getTree()
+ * after the last outside reference is gone; beyond maxEntries the least recently used entries are dropped */
+template <typename PointT = Point>
+class SearchCache
+{
+public:
+	using Cloud   = pcl::PointCloud<PointT>;
+	using Tree    = pcl::search::KdTree<PointT>;
+	using TreePtr = typename Tree::Ptr;
+
+	using OrganizedSearch = pcl::search::OrganizedNeighbor<PointT>;
+	using SearchPtr       = typename pcl::search::Search<PointT>::Ptr;
+
+	explicit SearchCache( size_t maxEntries = 16 )
+	    : m_maxEntries( maxEntries ) {}
+
+	SearchCache( const SearchCache& ) = delete;
+	SearchCache& operator=( const SearchCache& ) = delete;
+
+	// tree over the whole cloud, built on first use and whenever the cloud changed since
+	TreePtr getTree( const typename Cloud::ConstPtr& cloud )
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		Entry entry;
+		Entry& cached = find( cloud, entry );
+		if ( cached.tree ) {
+			++m_stats.hits;
+		} else {
+			long references = cloud.use_count();
+			cached.tree.reset( new Tree );
+			cached.tree->setInputCloud( cloud );
+			cached.ownReferences += cloud.use_count() - references;
+			++m_stats.builds;
+		}
+		return cached.tree;
+	}
+
+	/* the fastest exact search for the cloud: a pcl::search::OrganizedNeighbor walking the image grid for
+	 * organized clouds from a projective device (e.g. depthToCloud), otherwise the cloud's tree */
+	SearchPtr getSearch( const typename Cloud::ConstPtr& cloud )
+	{
+		if ( !cloud->isOrganized() ) return getTree( cloud );
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+			Entry entry;
+			Entry& cached = find( cloud, entry );
+			if ( !cached.organizedChecked ) {
+				long references = cloud.use_count();
+				typename OrganizedSearch::Ptr organized( new OrganizedSearch );
+				organized->setInputCloud( cloud );
+				if ( organized->isValid() ) cached.organized = organized;
+				organized.reset();
+				cached.ownReferences += cloud.use_count() - references;
+				cached.organizedChecked = true;
+				++m_stats.builds;
+			} else if ( cached.organized ) {
+				++m_stats.hits;
+			}
+			if ( cached.organized ) return cached.organized;
+		}
+		return getTree( cloud );
+	}
+
+	// forget the tree of a cloud edited in place, the next getTree() rebuilds it
+	void invalidate( const Cloud* cloud )
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_entries.erase( std::remove_if( m_entries.begin(), m_entries.end(), [cloud]( const Entry& entry ) { return entry.cloud.get() == cloud; } ), m_entries.end() );
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_entries.clear();
+	}
+
+	void setMaxEntries( size_t maxEntries )
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		m_maxEntries = maxEntries;
+		while ( m_entries.size() > m_maxEntries ) {
+			m_entries.erase( std::min_element( m_entries.begin(), m_entries.end(), []( const Entry& a, const Entry& b ) { return a.lastUsed < b.lastUsed; } ) );
+		}
+	}
+
+	SearchCacheStats getStats() const
+	{
+		std::lock_guard<std::mutex> lock( m_mutex );
+		SearchCacheStats stats = m_stats;
+		stats.entries          = m_entries.size();
+		return stats;
+	}
+
+protected:
+	// what a tree was built from, to tell when the cloud changed
+	struct Signature
+	{
+		Signature() {}
+		explicit Signature( const Cloud& cloud )
+		    : points( cloud.points.data() ), size( cloud.size() ), seq( cloud.header.seq ), stamp( cloud.header.stamp ) {}
+
+		bool operator==( const Signature& other ) const { return points == other.points && size == other.size && seq == other.seq && stamp == other.stamp; }
+
+		const PointT* points = nullptr;
+		size_t size          = 0;
+		uint32_t seq         = 0;
+		uint64_t stamp       = 0;
+	};
+
+	struct Entry
+	{
+		typename Cloud::ConstPtr cloud;
+		Signature signature;
+		TreePtr tree;
+		typename OrganizedSearch::Ptr organized;
+		bool organizedChecked = false;  // organized is null when the cloud isn't from a projective device
+		long ownReferences    = 0;      // references to cloud held by the entry and its searches
+		uint64_t lastUsed     = 0;
+	};
+
+	/* the cloud's entry with its searches cleared if the cloud changed, a new one if it isn't cached.
+	 * with maxEntries == 0 nothing is cached and scratch is used */
+	Entry& find( const typename Cloud::ConstPtr& cloud, Entry& scratch )
+	{
+		purge();
+		++m_tick;
+		for ( auto& entry : m_entries ) {
+			if ( entry.cloud != cloud ) continue;
+			entry.lastUsed = m_tick;
+			if ( !( entry.signature == Signature( *cloud ) ) ) reset( entry, cloud );
+			return entry;
+		}
+		if ( m_maxEntries == 0 ) {
+			reset( scratch, cloud );
+			return scratch;
+		}
+		if ( m_entries.size() >= m_maxEntries ) {
+			m_entries.erase( std::min_element( m_entries.begin(), m_entries.end(), []( const Entry& a, const Entry& b ) { return a.lastUsed < b.lastUsed; } ) );
+		}
+		m_entries.emplace_back();
+		m_entries.back().lastUsed = m_tick;
+		reset( m_entries.back(), cloud );
+		return m_entries.back();
+	}
+
+	// searches already handed out are left to their holders
+	void reset( Entry& entry, const typename Cloud::ConstPtr& cloud )
+	{
+		entry.cloud.reset();
+		entry.tree.reset();
+		entry.organized.reset();
+		entry.organizedChecked = false;
+		long references        = cloud.use_count();
+		entry.cloud            = cloud;
+		entry.ownReferences    = cloud.use_count() - references;
+		entry.signature        = Signature( *cloud );
+	}
+
+	// drop entries whose cloud nobody outside the cache references any more
+	void purge()
+	{
+		m_entries.erase( std::remove_if( m_entries.begin(), m_entries.end(), []( const Entry& entry ) { return entry.cloud.use_count() <= entry.ownReferences; } ), m_entries.end() );
+	}
+
+	mutable std::mutex m_mutex;
+	std::vector<Entry> m_entries;
+	size_t m_maxEntries;
+	uint64_t m_tick = 0;
+	SearchCacheStats m_stats;
+};
+
+// process wide cache per point type used by the ofxPcl wrappers
+template <typename PointT = Point>
+SearchCache<PointT>& getSearchCache()
+{
+	static SearchCache<PointT> cache;
+	return cache;
+}
+
+}  // namespace ofxPointCloudLibrary
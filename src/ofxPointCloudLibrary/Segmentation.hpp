@@ -0,0 +1,277 @@
+#pragma once
+
+#include "ofxPointCloudLibrary/Filters.hpp"
+#include "ofxPointCloudLibrary/ThreadPool.hpp"
+#include "ofxPointCloudLibrary/Types.hpp"
+
+namespace ofxPointCloudLibrary {
+
+namespace detail {
+
+/* union-find over n elements that threads can unite concurrently without locks. unite hangs the larger root
+ * under the smaller with a compare and swap, retrying if another thread got there first, and find halves the
+ * path as it goes. parents are always smaller than their children, so every set ends up rooted at its smallest
+ * element whatever the order of the unites */
+class UnionFind
+{
+public:
+	explicit UnionFind( size_t n )
+	    : m_parents( n )
+	{
+		for ( size_t i = 0; i < n; ++i ) m_parents[i].store( static_cast<uint32_t>( i ), std::memory_order_relaxed );
+	}
+
+	uint32_t find( uint32_t i )
+	{
+		for ( ;; ) {
+			uint32_t parent = m_parents[i].load( std::memory_order_relaxed );
+			if ( parent == i ) return i;
+			uint32_t grandparent = m_parents[parent].load( std::memory_order_relaxed );
+			if ( grandparent != parent ) m_parents[i].compare_exchange_weak( parent, grandparent, std::memory_order_relaxed );
+			i = grandparent;
+		}
+	}
+
+	void unite( uint32_t a, uint32_t b )
+	{
+		for ( ;; ) {
+			a = find( a );
+			b = find( b );
+			if ( a == b ) return;
+			if ( a > b ) std::swap( a, b );
+			uint32_t expected = b;  // fails if b stopped being a root meanwhile
+			if ( m_parents[b].compare_exchange_strong( expected, a ) ) return;
+		}
+	}
+
+protected:
+	std::vector<std::atomic<uint32_t>> m_parents;
+};
+
+// pcl's neighbor test: flann's L2_Simple squared distance, summed in float, strictly below the squared tolerance
+inline bool withinTolerance( const float* a, const float* b, float squaredTolerance )
+{
+	float distance = 0.f;
+	for ( int k = 0; k < 3; ++k ) {
+		float d = a[k] - b[k];
+		distance += d * d;
+	}
+	return distance < squaredTolerance;
+}
+
+/* points hashed into cubic cells of a little over the tolerance, so neighbors are at most one cell apart, and
+ * grouped by cell then by octant of the cell. an octant's diagonal is under the tolerance, so all points of an
+ * octant are neighbors. cells are in order of their first point */
+struct ClusterGrid
+{
+	enum : uint32_t { kNone = 0xffffffff };
+
+	VoxelMap map;
+	std::vector<VoxelKey> keys;
+	std::vector<uint32_t> start;      // first slot of each octant, 8 per cell, then the end
+	std::vector<uint32_t> slots;      // each point's slot, kNone for points in no cell
+	std::vector<float> xyz;           // the points in slot order
+	std::vector<VoxelKey> offsets;    // half of the neighbor cells, so each pair of cells is visited once
+	std::vector<uint8_t> reachable;   // [offset][octant][neighbor octant], whether the octants can hold neighbors
+
+	ClusterGrid( const float* points, size_t stride, size_t n, float tolerance )
+	    : map( n / 8 )
+	    , slots( n, kNone )
+	{
+		// keys in double so large coordinates can't round points of different cells together
+		const double cellSize        = tolerance * 1.0001;
+		const double inverseCellSize = 1. / cellSize;
+		const double limit           = 2147483647.;
+		std::vector<uint32_t> octants( n, kNone );
+		std::vector<uint32_t> counts;
+		for ( size_t i = 0; i < n; ++i ) {
+			const float* p = points + i * stride;
+			double v[3];
+			uint32_t octant = 0;
+			for ( int k = 0; k < 3; ++k ) {
+				double scaled = p[k] * inverseCellSize;
+				v[k]          = std::floor( scaled );
+				octant        = octant * 2 + ( scaled - v[k] >= 0.5 ? 1 : 0 );
+			}
+			if ( !( v[0] >= -limit && v[0] <= limit && v[1] >= -limit && v[1] <= limit && v[2] >= -limit && v[2] <= limit ) ) continue;  // also catches nan
+			VoxelKey key = { int32_t( v[0] ), int32_t( v[1] ), int32_t( v[2] ) };
+			bool inserted;
+			uint32_t cell = map.findOrInsert( key, hashVoxel( key ), static_cast<uint32_t>( keys.size() ), inserted );
+			if ( inserted ) {
+				keys.push_back( key );
+				counts.resize( counts.size() + 8, 0 );
+			}
+			octants[i] = cell * 8 + octant;
+			++counts[octants[i]];
+		}
+		start.resize( counts.size() + 1 );
+		uint32_t offset = 0;
+		for ( size_t o = 0; o < counts.size(); ++o ) {
+			start[o] = offset;
+			offset += counts[o];
+		}
+		start.back() = offset;
+		xyz.resize( offset * 3 );
+		std::vector<uint32_t> fill( start.begin(), start.end() - 1 );
+		for ( size_t i = 0; i < n; ++i ) {
+			if ( octants[i] == kNone ) continue;
+			slots[i] = fill[octants[i]]++;
+			std::copy( points + i * stride, points + i * stride + 3, &xyz[slots[i] * 3] );
+		}
+
+		// octants are half cells, two of them can hold neighbors when their gap is under the tolerance
+		auto canReach = [&]( int dx, int dy, int dz ) {
+			double gap = 0.;
+			for ( int d : { dx, dy, dz } ) gap += std::pow( std::max( std::abs( d ) - 1, 0 ) * cellSize * 0.5, 2 );
+			return gap < double( tolerance ) * tolerance;
+		};
+		for ( int x = 0; x <= 1; ++x ) {
+			for ( int y = -1; y <= 1; ++y ) {
+				for ( int z = -1; z <= 1; ++z ) {
+					if ( x == 0 && ( y < 0 || ( y == 0 && z <= 0 ) ) ) continue;
+					offsets.push_back( { x, y, z } );
+					for ( int a = 0; a < 8; ++a ) {
+						for ( int b = 0; b < 8; ++b ) reachable.push_back( canReach( 2 * x + ( b >> 2 ) - ( a >> 2 ), 2 * y + ( ( b >> 1 ) & 1 ) - ( ( a >> 1 ) & 1 ), 2 * z + ( b & 1 ) - ( a & 1 ) ) );
+					}
+				}
+			}
+		}
+	}
+
+	size_t size() const { return keys.size(); }
+
+	// index of the cell at offsets[o] from cell, false if it's empty
+	bool findNeighbor( size_t cell, size_t o, uint32_t& neighbor ) const
+	{
+		const VoxelKey& key  = keys[cell];
+		VoxelKey neighborKey = { key.x + offsets[o].x, key.y + offsets[o].y, key.z + offsets[o].z };
+		return map.find( neighborKey, hashVoxel( neighborKey ), neighbor );
+	}
+};
+
+/* pcl::EuclideanClusterExtraction over n strided xyz points: the connected components of the points closer than
+ * tolerance, as ascending index lists, largest first (ties in order of their first point). the points of each
+ * octant of the ClusterGrid are neighbors, so only pairs of octants of the same or neighboring cells are tested,
+ * each until the first pair of points within tolerance, in parallel into a lock-free union-find.
+ * non-finite points belong to no cluster */
+inline bool extractClusters( const float* points, size_t stride, size_t n, float tolerance, size_t minSize, size_t maxSize, std::vector<std::vector<int>>& clusters, size_t numThreads )
+{
+	clusters.clear();
+	if ( !( tolerance > 0.f ) ) {
+		ofLogError( "ofxPcl::extractClusters" ) << "tolerance must be positive";
+		return false;
+	}
+	if ( n >= ( 1ull << 29 ) ) {
+		ofLogError( "ofxPcl::extractClusters" ) << "more than 2^29 - 1 points";  // octant ids are 32 bit
+		return false;
+	}
+	if ( n == 0 ) return true;
+	const float squaredTolerance = static_cast<float>( double( tolerance ) * tolerance );  // as pcl::KdTreeFLANN
+	const ClusterGrid grid( points, stride, n, tolerance );
+	const std::vector<uint32_t>& start = grid.start;
+	const float* xyz                   = grid.xyz.data();
+
+	// union-find over slots, octants are runs of slots. connect links the points of octants a and b unless they
+	// already are, which is only worth looking up before testing more than a few pairs of points
+	UnionFind sets( start.back() );
+	auto connect = [&]( uint32_t a, uint32_t b ) {
+		const uint64_t pairs = uint64_t( start[a + 1] - start[a] ) * ( start[b + 1] - start[b] );
+		if ( pairs > 4 && sets.find( start[a] ) == sets.find( start[b] ) ) return;
+		for ( uint32_t i = start[a]; i < start[a + 1]; ++i ) {
+			for ( uint32_t j = start[b]; j < start[b + 1]; ++j ) {
+				if ( withinTolerance( &xyz[i * 3], &xyz[j * 3], squaredTolerance ) ) {
+					sets.unite( i, j );
+					return;
+				}
+			}
+		}
+	};
+	// octants of a cell that hold points
+	auto occupied = [&]( uint32_t cell, uint32_t* octants ) {
+		uint32_t count = 0;
+		for ( uint32_t o = cell * 8; o < cell * 8 + 8; ++o ) {
+			if ( start[o] != start[o + 1] ) octants[count++] = o;
+		}
+		return count;
+	};
+
+	getThreadPool().parallelFor( 0, grid.size(), [&]( size_t begin, size_t end ) {
+		uint32_t octants[8], neighborOctants[8];
+		for ( size_t c = begin; c < end; ++c ) {
+			const uint32_t numOctants = occupied( static_cast<uint32_t>( c ), octants );
+			for ( uint32_t k = 0; k < numOctants; ++k ) {
+				const uint32_t a = octants[k];
+				for ( uint32_t i = start[a] + 1; i < start[a + 1]; ++i ) sets.unite( start[a], i );
+				for ( uint32_t l = 0; l < k; ++l ) connect( octants[l], a );
+			}
+			for ( size_t o = 0; o < grid.offsets.size(); ++o ) {
+				uint32_t neighbor;
+				if ( !grid.findNeighbor( c, o, neighbor ) ) continue;
+				const uint32_t numNeighborOctants = occupied( neighbor, neighborOctants );
+				const uint8_t* reachable          = &grid.reachable[o * 64];
+				for ( uint32_t k = 0; k < numOctants; ++k ) {
+					for ( uint32_t l = 0; l < numNeighborOctants; ++l ) {
+						if ( reachable[( octants[k] & 7 ) * 8 + ( neighborOctants[l] & 7 )] ) connect( octants[k], neighborOctants[l] );
+					}
+				}
+			}
+		}
+	}, numThreads );
+
+	// component sizes, components in order of their first point
+	const std::vector<uint32_t>& slots = grid.slots;
+	std::vector<uint32_t> roots( n, ClusterGrid::kNone );
+	std::vector<uint32_t> sizes( start.back(), 0 );
+	std::vector<uint32_t> components;
+	for ( size_t i = 0; i < n; ++i ) {
+		if ( slots[i] == ClusterGrid::kNone ) continue;
+		roots[i] = sets.find( slots[i] );
+		if ( sizes[roots[i]]++ == 0 ) components.push_back( roots[i] );
+	}
+	std::vector<uint32_t> kept;
+	for ( uint32_t root : components ) {
+		if ( sizes[root] >= minSize && sizes[root] <= maxSize ) kept.push_back( root );
+	}
+	std::stable_sort( kept.begin(), kept.end(), [&]( uint32_t a, uint32_t b ) { return sizes[a] > sizes[b]; } );
+
+	std::vector<uint32_t> clusterOf( start.back(), ClusterGrid::kNone );
+	clusters.resize( kept.size() );
+	for ( size_t k = 0; k < kept.size(); ++k ) {
+		clusterOf[kept[k]] = static_cast<uint32_t>( k );
+		clusters[k].reserve( sizes[kept[k]] );
+	}
+	for ( size_t i = 0; i < n; ++i ) {
+		if ( roots[i] != ClusterGrid::kNone && clusterOf[roots[i]] != ClusterGrid::kNone ) clusters[clusterOf[roots[i]]].push_back( static_cast<int>( i ) );
+	}
+	return true;
+}
+
+}  // namespace detail
+
+/* euclidean cluster extraction: groups of points connected by steps shorter than tolerance, the same clusters
+ * as pcl::EuclideanClusterExtraction without its serial radius search per point. clusters are ascending index
+ * lists, largest first, and only those of minSize to maxSize points are kept. non-finite points are skipped */
+inline bool extractClusters( const PointCloud& pointCloud, float tolerance, std::vector<std::vector<int>>& clusters, size_t minSize = 1, size_t maxSize = std::numeric_limits<size_t>::max(), size_t numThreads = 0 )
+{
+	return detail::extractClusters( pointCloud.empty() ? nullptr : pointCloud.points[0].data, sizeof( Point ) / sizeof( float ), pointCloud.size(), tolerance, minSize, maxSize, clusters, numThreads );
+}
+
+inline bool extractClusters( const std::vector<glm::vec3>& points, float tolerance, std::vector<std::vector<int>>& clusters, size_t minSize = 1, size_t maxSize = std::numeric_limits<size_t>::max(), size_t numThreads = 0 )
+{
+	return detail::extractClusters( points.empty() ? nullptr : &points[0].x, 3, points.size(), tolerance, minSize, maxSize, clusters, numThreads );
+}
+
+// the clusters' points instead of their indices
+inline bool extractClusters( const std::vector<glm::vec3>& points, float tolerance, std::vector<std::vector<glm::vec3>>& clusters, size_t minSize = 1, size_t maxSize = std::numeric_limits<size_t>::max(), size_t numThreads = 0 )
+{
+	std::vector<std::vector<int>> indices;
+	bool success = extractClusters( points, tolerance, indices, minSize, maxSize, numThreads );
+	clusters.resize( indices.size() );
+	for ( size_t k = 0; k < indices.size(); ++k ) {
+		clusters[k].resize( indices[k].size() );
+		for ( size_t j = 0; j < indices[k].size(); ++j ) clusters[k][j] = points[indices[k][j]];
+	}
+	return success;
+}
+
+}  // namespace ofxPointCloudLibrary
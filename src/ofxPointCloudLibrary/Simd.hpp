@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// instruction sets are picked at compile time (e.g. /arch:AVX2 or -mavx2), with a scalar fallback
+#if defined( __AVX2__ )
+#define OFXPCL_USE_AVX2 1
+#endif
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define OFXPCL_USE_SSE2 1
+#endif
+
+#if defined( OFXPCL_USE_AVX2 )
+#include <immintrin.h>
+#elif defined( OFXPCL_USE_SSE2 )
+#include <emmintrin.h>
+#endif
+
+namespace ofxPointCloudLibrary {
+
+/* bulk conversion kernels between packed float3 arrays (glm::vec3, 12 bytes)
+ * and padded float4 point fields (PCL points, 16 byte aligned)
+ * strides are given in floats */
+namespace simd {
+
+// packed xyz -> padded xyzw, writes w into the padding float
+inline void packedToPadded( const float* src, float* dst, size_t dstStride, size_t n, float w )
+{
+	size_t i = 0;
+#if defined( OFXPCL_USE_AVX2 )
+	if ( dstStride == 4 ) {
+		// two points per iteration, the 8 float load reads into the following point so stop 3 points early
+		const __m256i perm = _mm256_setr_epi32( 0, 1, 2, 2, 3, 4, 5, 5 );
+		const __m256 wv    = _mm256_set1_ps( w );
+		for ( ; i + 3 <= n; i += 2 ) {
+			__m256 v = _mm256_permutevar8x32_ps( _mm256_loadu_ps( src + 3 * i ), perm );
+			_mm256_storeu_ps( dst + 4 * i, _mm256_blend_ps( v, wv, 0x88 ) );
+		}
+	}
+#endif
+#if defined( OFXPCL_USE_SSE2 )
+	{
+		const __m128 mask = _mm_castsi128_ps( _mm_setr_epi32( -1, -1, -1, 0 ) );
+		const __m128 wv   = _mm_setr_ps( 0.f, 0.f, 0.f, w );
+		for ( ; i + 1 < n; ++i ) {
+			__m128 v = _mm_loadu_ps( src + 3 * i );
+			_mm_storeu_ps( dst + dstStride * i, _mm_or_ps( _mm_and_ps( v, mask ), wv ) );
+		}
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		float* d = dst + dstStride * i;
+		d[0]     = src[3 * i];
+		d[1]     = src[3 * i + 1];
+		d[2]     = src[3 * i + 2];
+		d[3]     = w;
+	}
+}
+
+// padded xyzw -> packed xyz
+inline void paddedToPacked( const float* src, size_t srcStride, float* dst, size_t n )
+{
+	size_t i = 0;
+#if defined( OFXPCL_USE_AVX2 )
+	if ( srcStride == 4 ) {
+		// the 8 float store spills 2 floats into the following point, which is overwritten next
+		const __m256i perm = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 7, 7 );
+		for ( ; i + 3 <= n; i += 2 ) {
+			_mm256_storeu_ps( dst + 3 * i, _mm256_permutevar8x32_ps( _mm256_loadu_ps( src + 4 * i ), perm ) );
+		}
+	}
+#endif
+#if defined( OFXPCL_USE_SSE2 )
+	for ( ; i + 1 < n; ++i ) {
+		_mm_storeu_ps( dst + 3 * i, _mm_loadu_ps( src + srcStride * i ) );
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		const float* s = src + srcStride * i;
+		dst[3 * i]     = s[0];
+		dst[3 * i + 1] = s[1];
+		dst[3 * i + 2] = s[2];
+	}
+}
+
+// float rgba in [0, 1] (ofFloatColor) -> PCL packed bgra bytes (rgba field), strides in floats / uint32
+inline void floatColorsToRgba( const float* src, uint32_t* dst, size_t dstStride, size_t n )
+{
+	size_t i = 0;
+#if defined( OFXPCL_USE_SSE2 )
+	const __m128 scale = _mm_set1_ps( 255.f );
+	const __m128 zero  = _mm_setzero_ps();
+	for ( ; i < n; ++i ) {
+		__m128 c = _mm_loadu_ps( src + 4 * i );
+		c        = _mm_shuffle_ps( c, c, _MM_SHUFFLE( 3, 0, 1, 2 ) );  // rgba -> bgra
+		c        = _mm_min_ps( _mm_max_ps( _mm_mul_ps( c, scale ), zero ), scale );
+		__m128i b = _mm_cvtps_epi32( c );
+		b         = _mm_packus_epi16( _mm_packs_epi32( b, b ), b );
+		dst[dstStride * i] = static_cast<uint32_t>( _mm_cvtsi128_si32( b ) );
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		const float* c = src + 4 * i;
+		uint32_t bgra  = 0;
+		const int order[4] = { 2, 1, 0, 3 };
+		for ( int k = 0; k < 4; ++k ) {
+			float v = std::fmin( std::fmax( c[order[k]] * 255.f, 0.f ), 255.f );
+			bgra |= static_cast<uint32_t>( std::lrint( v ) ) << ( 8 * k );
+		}
+		dst[dstStride * i] = bgra;
+	}
+}
+
+// PCL packed bgra bytes -> float rgba in [0, 1]
+inline void rgbaToFloatColors( const uint32_t* src, size_t srcStride, float* dst, size_t n )
+{
+	size_t i = 0;
+#if defined( OFXPCL_USE_SSE2 )
+	const __m128 scale = _mm_set1_ps( 255.f );
+	const __m128i zero = _mm_setzero_si128();
+	for ( ; i < n; ++i ) {
+		__m128i b = _mm_cvtsi32_si128( static_cast<int>( src[srcStride * i] ) );
+		b         = _mm_unpacklo_epi16( _mm_unpacklo_epi8( b, zero ), zero );
+		__m128 c  = _mm_div_ps( _mm_cvtepi32_ps( b ), scale );
+		_mm_storeu_ps( dst + 4 * i, _mm_shuffle_ps( c, c, _MM_SHUFFLE( 3, 0, 1, 2 ) ) );  // bgra -> rgba
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		uint32_t bgra = src[srcStride * i];
+		float* c      = dst + 4 * i;
+		c[2]          = ( bgra & 0xff ) / 255.f;
+		c[1]          = ( ( bgra >> 8 ) & 0xff ) / 255.f;
+		c[0]          = ( ( bgra >> 16 ) & 0xff ) / 255.f;
+		c[3]          = ( ( bgra >> 24 ) & 0xff ) / 255.f;
+	}
+}
+
+// affine transform of xyz triplets, m is a column major 4x4 (glm / Eigen). translate = false applies only the
+// linear part, for normals. strides in floats: 3 for packed glm::vec3, 4 or more for PCL points, whose fourth
+// float is copied from src. dst may alias src when the strides match
+inline void transformPoints( const float* m, bool translate, const float* src, size_t srcStride, float* dst, size_t dstStride, size_t n )
+{
+	size_t i = 0;
+#if defined( OFXPCL_USE_SSE2 )
+	const __m128 c0 = _mm_loadu_ps( m ), c1 = _mm_loadu_ps( m + 4 ), c2 = _mm_loadu_ps( m + 8 );
+	const __m128 c3 = translate ? _mm_loadu_ps( m + 12 ) : _mm_setzero_ps();
+	if ( srcStride == 3 && dstStride == 3 ) {
+		// four points per iteration: deinterleave 12 floats to x y z registers and back, so in place is safe
+		__m128 r[3][4];
+		for ( int row = 0; row < 3; ++row ) {
+			for ( int col = 0; col < 4; ++col ) r[row][col] = _mm_set1_ps( col < 3 || translate ? m[col * 4 + row] : 0.f );
+		}
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128 a = _mm_loadu_ps( src + 3 * i ), b = _mm_loadu_ps( src + 3 * i + 4 ), c = _mm_loadu_ps( src + 3 * i + 8 );
+			__m128 v[3];
+			v[0] = _mm_shuffle_ps( a, _mm_shuffle_ps( b, c, _MM_SHUFFLE( 1, 1, 2, 2 ) ), _MM_SHUFFLE( 2, 0, 3, 0 ) );
+			v[1] = _mm_shuffle_ps( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 0, 0, 1, 1 ) ), _mm_shuffle_ps( b, c, _MM_SHUFFLE( 2, 2, 3, 3 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) );
+			v[2] = _mm_shuffle_ps( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 1, 1, 2, 2 ) ), _mm_shuffle_ps( c, c, _MM_SHUFFLE( 3, 3, 0, 0 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) );
+			__m128 t[3];
+			for ( int row = 0; row < 3; ++row ) {
+				t[row] = _mm_add_ps( _mm_mul_ps( r[row][0], v[0] ), r[row][3] );
+				t[row] = _mm_add_ps( t[row], _mm_mul_ps( r[row][1], v[1] ) );
+				t[row] = _mm_add_ps( t[row], _mm_mul_ps( r[row][2], v[2] ) );
+			}
+			_mm_storeu_ps( dst + 3 * i, _mm_shuffle_ps( _mm_shuffle_ps( t[0], t[1], _MM_SHUFFLE( 0, 0, 0, 0 ) ), _mm_shuffle_ps( t[2], t[0], _MM_SHUFFLE( 1, 1, 0, 0 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+			_mm_storeu_ps( dst + 3 * i + 4, _mm_shuffle_ps( _mm_shuffle_ps( t[1], t[2], _MM_SHUFFLE( 1, 1, 1, 1 ) ), _mm_shuffle_ps( t[0], t[1], _MM_SHUFFLE( 2, 2, 2, 2 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+			_mm_storeu_ps( dst + 3 * i + 8, _mm_shuffle_ps( _mm_shuffle_ps( t[2], t[0], _MM_SHUFFLE( 3, 3, 2, 2 ) ), _mm_shuffle_ps( t[1], t[2], _MM_SHUFFLE( 3, 3, 3, 3 ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+		}
+	} else if ( srcStride >= 4 && dstStride >= 4 ) {
+#if defined( OFXPCL_USE_AVX2 )
+		if ( srcStride == 4 && dstStride == 4 ) {
+			// two PointXYZ per iteration, one per 128 bit lane
+			const __m256 w0 = _mm256_broadcast_ps( &c0 ), w1 = _mm256_broadcast_ps( &c1 ), w2 = _mm256_broadcast_ps( &c2 ), w3 = _mm256_broadcast_ps( &c3 );
+			for ( ; i + 2 <= n; i += 2 ) {
+				__m256 v = _mm256_loadu_ps( src + 4 * i );
+				__m256 t = _mm256_add_ps( _mm256_mul_ps( w0, _mm256_permute_ps( v, 0x00 ) ), w3 );
+				t        = _mm256_add_ps( t, _mm256_mul_ps( w1, _mm256_permute_ps( v, 0x55 ) ) );
+				t        = _mm256_add_ps( t, _mm256_mul_ps( w2, _mm256_permute_ps( v, 0xaa ) ) );
+				_mm256_storeu_ps( dst + 4 * i, _mm256_blend_ps( t, v, 0x88 ) );
+			}
+		}
+#endif
+		const __m128 keepW = _mm_castsi128_ps( _mm_setr_epi32( 0, 0, 0, -1 ) );
+		for ( ; i < n; ++i ) {
+			__m128 v = _mm_loadu_ps( src + srcStride * i );
+			__m128 t = _mm_add_ps( _mm_mul_ps( c0, _mm_shuffle_ps( v, v, 0x00 ) ), c3 );
+			t        = _mm_add_ps( t, _mm_mul_ps( c1, _mm_shuffle_ps( v, v, 0x55 ) ) );
+			t        = _mm_add_ps( t, _mm_mul_ps( c2, _mm_shuffle_ps( v, v, 0xaa ) ) );
+			_mm_storeu_ps( dst + dstStride * i, _mm_or_ps( _mm_andnot_ps( keepW, t ), _mm_and_ps( keepW, v ) ) );
+		}
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		const float* s = src + srcStride * i;
+		float* d       = dst + dstStride * i;
+		float x = s[0], y = s[1], z = s[2];
+		for ( int row = 0; row < 3; ++row ) d[row] = m[row] * x + ( translate ? m[12 + row] : 0.f ) + m[4 + row] * y + m[8 + row] * z;
+		if ( srcStride >= 4 && dstStride >= 4 ) d[3] = s[3];
+	}
+}
+
+// set bits of a movemask
+inline size_t bitCount( int mask )
+{
+	size_t count = 0;
+	for ( ; mask; mask &= mask - 1 ) ++count;
+	return count;
+}
+
+/* kernels over separate x, y and z columns (ColumnCloud). points with a non-finite coordinate are skipped,
+ * like pcl's getMinMax3D and compute3DCentroid do for clouds that aren't dense */
+
+// min / max of the finite points, returns how many there are
+inline size_t columnBounds( const float* x, const float* y, const float* z, size_t n, float minOut[3], float maxOut[3] )
+{
+	const float inf   = std::numeric_limits<float>::infinity();
+	float lo[3]       = { inf, inf, inf };
+	float hi[3]       = { -inf, -inf, -inf };
+	const float* c[3] = { x, y, z };
+	size_t count      = 0;
+	size_t i          = 0;
+#if defined( OFXPCL_USE_AVX2 )
+	{
+		const __m256 pinf = _mm256_set1_ps( inf ), ninf = _mm256_set1_ps( -inf ), zero = _mm256_setzero_ps();
+		__m256 vlo[3] = { pinf, pinf, pinf }, vhi[3] = { ninf, ninf, ninf };
+		for ( ; i + 8 <= n; i += 8 ) {
+			__m256 v[3], finite = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+			for ( int k = 0; k < 3; ++k ) {
+				v[k]   = _mm256_loadu_ps( c[k] + i );
+				finite = _mm256_and_ps( finite, _mm256_cmp_ps( _mm256_sub_ps( v[k], v[k] ), zero, _CMP_EQ_OQ ) );  // inf - inf and nan are nan
+			}
+			for ( int k = 0; k < 3; ++k ) {
+				vlo[k] = _mm256_min_ps( vlo[k], _mm256_blendv_ps( pinf, v[k], finite ) );
+				vhi[k] = _mm256_max_ps( vhi[k], _mm256_blendv_ps( ninf, v[k], finite ) );
+			}
+			count += bitCount( _mm256_movemask_ps( finite ) );
+		}
+		for ( int k = 0; k < 3; ++k ) {
+			alignas( 32 ) float l[8], h[8];
+			_mm256_store_ps( l, vlo[k] );
+			_mm256_store_ps( h, vhi[k] );
+			for ( int j = 0; j < 8; ++j ) {
+				lo[k] = std::fmin( lo[k], l[j] );
+				hi[k] = std::fmax( hi[k], h[j] );
+			}
+		}
+	}
+#elif defined( OFXPCL_USE_SSE2 )
+	{
+		const __m128 pinf = _mm_set1_ps( inf ), ninf = _mm_set1_ps( -inf ), zero = _mm_setzero_ps();
+		__m128 vlo[3] = { pinf, pinf, pinf }, vhi[3] = { ninf, ninf, ninf };
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128 v[3], finite = _mm_castsi128_ps( _mm_set1_epi32( -1 ) );
+			for ( int k = 0; k < 3; ++k ) {
+				v[k]   = _mm_loadu_ps( c[k] + i );
+				finite = _mm_and_ps( finite, _mm_cmpeq_ps( _mm_sub_ps( v[k], v[k] ), zero ) );
+			}
+			for ( int k = 0; k < 3; ++k ) {
+				vlo[k] = _mm_min_ps( vlo[k], _mm_or_ps( _mm_and_ps( finite, v[k] ), _mm_andnot_ps( finite, pinf ) ) );
+				vhi[k] = _mm_max_ps( vhi[k], _mm_or_ps( _mm_and_ps( finite, v[k] ), _mm_andnot_ps( finite, ninf ) ) );
+			}
+			count += bitCount( _mm_movemask_ps( finite ) );
+		}
+		for ( int k = 0; k < 3; ++k ) {
+			alignas( 16 ) float l[4], h[4];
+			_mm_store_ps( l, vlo[k] );
+			_mm_store_ps( h, vhi[k] );
+			for ( int j = 0; j < 4; ++j ) {
+				lo[k] = std::fmin( lo[k], l[j] );
+				hi[k] = std::fmax( hi[k], h[j] );
+			}
+		}
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		if ( !std::isfinite( x[i] ) || !std::isfinite( y[i] ) || !std::isfinite( z[i] ) ) continue;
+		for ( int k = 0; k < 3; ++k ) {
+			lo[k] = std::fmin( lo[k], c[k][i] );
+			hi[k] = std::fmax( hi[k], c[k][i] );
+		}
+		++count;
+	}
+	for ( int k = 0; k < 3; ++k ) {
+		minOut[k] = lo[k];
+		maxOut[k] = hi[k];
+	}
+	return count;
+}
+
+// sum of the finite points, returns how many there are.
+// lanes accumulate in float over blocks of 4096 points, blocks in double
+inline size_t columnSum( const float* x, const float* y, const float* z, size_t n, double sumOut[3] )
+{
+	const float* c[3] = { x, y, z };
+	double sum[3]     = { 0., 0., 0. };
+	size_t count      = 0;
+	size_t i          = 0;
+#if defined( OFXPCL_USE_AVX2 )
+	{
+		const __m256 zero = _mm256_setzero_ps();
+		while ( i + 8 <= n ) {
+			__m256 acc[3] = { zero, zero, zero };
+			size_t blockEnd = std::min( n, i + 4096 );
+			for ( ; i + 8 <= blockEnd; i += 8 ) {
+				__m256 v[3], finite = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+				for ( int k = 0; k < 3; ++k ) {
+					v[k]   = _mm256_loadu_ps( c[k] + i );
+					finite = _mm256_and_ps( finite, _mm256_cmp_ps( _mm256_sub_ps( v[k], v[k] ), zero, _CMP_EQ_OQ ) );
+				}
+				for ( int k = 0; k < 3; ++k ) acc[k] = _mm256_add_ps( acc[k], _mm256_and_ps( finite, v[k] ) );
+				count += bitCount( _mm256_movemask_ps( finite ) );
+			}
+			for ( int k = 0; k < 3; ++k ) {
+				alignas( 32 ) float a[8];
+				_mm256_store_ps( a, acc[k] );
+				for ( int j = 0; j < 8; ++j ) sum[k] += a[j];
+			}
+		}
+	}
+#elif defined( OFXPCL_USE_SSE2 )
+	{
+		const __m128 zero = _mm_setzero_ps();
+		while ( i + 4 <= n ) {
+			__m128 acc[3] = { zero, zero, zero };
+			size_t blockEnd = std::min( n, i + 4096 );
+			for ( ; i + 4 <= blockEnd; i += 4 ) {
+				__m128 v[3], finite = _mm_castsi128_ps( _mm_set1_epi32( -1 ) );
+				for ( int k = 0; k < 3; ++k ) {
+					v[k]   = _mm_loadu_ps( c[k] + i );
+					finite = _mm_and_ps( finite, _mm_cmpeq_ps( _mm_sub_ps( v[k], v[k] ), zero ) );
+				}
+				for ( int k = 0; k < 3; ++k ) acc[k] = _mm_add_ps( acc[k], _mm_and_ps( finite, v[k] ) );
+				count += bitCount( _mm_movemask_ps( finite ) );
+			}
+			for ( int k = 0; k < 3; ++k ) {
+				alignas( 16 ) float a[4];
+				_mm_store_ps( a, acc[k] );
+				for ( int j = 0; j < 4; ++j ) sum[k] += a[j];
+			}
+		}
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		if ( !std::isfinite( x[i] ) || !std::isfinite( y[i] ) || !std::isfinite( z[i] ) ) continue;
+		for ( int k = 0; k < 3; ++k ) sum[k] += c[k][i];
+		++count;
+	}
+	for ( int k = 0; k < 3; ++k ) sumOut[k] = sum[k];
+	return count;
+}
+
+// dst = m * src for a column major 4x4 (glm / Eigen), with or without its translation. dst may alias src
+inline void columnTransform( const float* m, bool translate, const float* x, const float* y, const float* z, float* xOut, float* yOut, float* zOut, size_t n )
+{
+	float* dst[3] = { xOut, yOut, zOut };
+	size_t i      = 0;
+#if defined( OFXPCL_USE_AVX2 )
+	{
+		__m256 r[3][4];
+		for ( int row = 0; row < 3; ++row ) {
+			for ( int col = 0; col < 4; ++col ) r[row][col] = _mm256_set1_ps( col < 3 || translate ? m[col * 4 + row] : 0.f );
+		}
+		for ( ; i + 8 <= n; i += 8 ) {
+			__m256 vx = _mm256_loadu_ps( x + i ), vy = _mm256_loadu_ps( y + i ), vz = _mm256_loadu_ps( z + i );
+			for ( int row = 0; row < 3; ++row ) {
+				__m256 v = _mm256_add_ps( _mm256_mul_ps( r[row][0], vx ), r[row][3] );
+				v        = _mm256_add_ps( v, _mm256_mul_ps( r[row][1], vy ) );
+				v        = _mm256_add_ps( v, _mm256_mul_ps( r[row][2], vz ) );
+				_mm256_storeu_ps( dst[row] + i, v );
+			}
+		}
+	}
+#elif defined( OFXPCL_USE_SSE2 )
+	{
+		__m128 r[3][4];
+		for ( int row = 0; row < 3; ++row ) {
+			for ( int col = 0; col < 4; ++col ) r[row][col] = _mm_set1_ps( col < 3 || translate ? m[col * 4 + row] : 0.f );
+		}
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128 vx = _mm_loadu_ps( x + i ), vy = _mm_loadu_ps( y + i ), vz = _mm_loadu_ps( z + i );
+			for ( int row = 0; row < 3; ++row ) {
+				__m128 v = _mm_add_ps( _mm_mul_ps( r[row][0], vx ), r[row][3] );
+				v        = _mm_add_ps( v, _mm_mul_ps( r[row][1], vy ) );
+				v        = _mm_add_ps( v, _mm_mul_ps( r[row][2], vz ) );
+				_mm_storeu_ps( dst[row] + i, v );
+			}
+		}
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		float vx = x[i], vy = y[i], vz = z[i];
+		for ( int row = 0; row < 3; ++row ) {
+			float t     = translate ? m[12 + row] : 0.f;
+			dst[row][i] = m[row] * vx + t + m[4 + row] * vy + m[8 + row] * vz;
+		}
+	}
+}
+
+// append the indices of the points inside the box [minIn, maxIn]. non-finite points are never inside
+inline void columnCropBox( const float* x, const float* y, const float* z, size_t n, const float minIn[3], const float maxIn[3], std::vector<int>& indices )
+{
+	const float* c[3] = { x, y, z };
+	size_t i          = 0;
+#if defined( OFXPCL_USE_AVX2 )
+	{
+		__m256 lo[3], hi[3];
+		for ( int k = 0; k < 3; ++k ) {
+			lo[k] = _mm256_set1_ps( minIn[k] );
+			hi[k] = _mm256_set1_ps( maxIn[k] );
+		}
+		for ( ; i + 8 <= n; i += 8 ) {
+			__m256 inside = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+			for ( int k = 0; k < 3; ++k ) {
+				__m256 v = _mm256_loadu_ps( c[k] + i );
+				inside   = _mm256_and_ps( inside, _mm256_and_ps( _mm256_cmp_ps( v, lo[k], _CMP_GE_OQ ), _mm256_cmp_ps( v, hi[k], _CMP_LE_OQ ) ) );
+			}
+			int mask = _mm256_movemask_ps( inside );
+			for ( int j = 0; mask; ++j, mask >>= 1 ) {
+				if ( mask & 1 ) indices.push_back( static_cast<int>( i ) + j );
+			}
+		}
+	}
+#elif defined( OFXPCL_USE_SSE2 )
+	{
+		__m128 lo[3], hi[3];
+		for ( int k = 0; k < 3; ++k ) {
+			lo[k] = _mm_set1_ps( minIn[k] );
+			hi[k] = _mm_set1_ps( maxIn[k] );
+		}
+		for ( ; i + 4 <= n; i += 4 ) {
+			__m128 inside = _mm_castsi128_ps( _mm_set1_epi32( -1 ) );
+			for ( int k = 0; k < 3; ++k ) {
+				__m128 v = _mm_loadu_ps( c[k] + i );
+				inside   = _mm_and_ps( inside, _mm_and_ps( _mm_cmpge_ps( v, lo[k] ), _mm_cmple_ps( v, hi[k] ) ) );
+			}
+			int mask = _mm_movemask_ps( inside );
+			for ( int j = 0; mask; ++j, mask >>= 1 ) {
+				if ( mask & 1 ) indices.push_back( static_cast<int>( i ) + j );
+			}
+		}
+	}
+#endif
+	for ( ; i < n; ++i ) {
+		if ( x[i] >= minIn[0] && x[i] <= maxIn[0] && y[i] >= minIn[1] && y[i] <= maxIn[1] && z[i] >= minIn[2] && z[i] <= maxIn[2] ) indices.push_back( static_cast<int>( i ) );
+	}
+}
+
+}  // namespace simd
+}  // namespace ofxPointCloudLibrary
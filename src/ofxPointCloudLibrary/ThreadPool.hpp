@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ofxPointCloudLibrary {
+
+/* fixed size worker pool shared by the ofxPcl background and parallel algorithms */
+class ThreadPool
+{
+public:
+	// numThreads == 0 uses one worker per hardware thread
+	explicit ThreadPool( size_t numThreads = 0 )
+	{
+		if ( numThreads == 0 ) numThreads = std::max( 1u, std::thread::hardware_concurrency() );
+		for ( size_t i = 0; i < numThreads; ++i ) {
+			m_workers.emplace_back( [this] { workerLoop(); } );
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+			m_stopping = true;
+		}
+		m_condition.notify_all();
+		for ( auto& worker : m_workers ) worker.join();
+	}
+
+	ThreadPool( const ThreadPool& ) = delete;
+	ThreadPool& operator=( const ThreadPool& ) = delete;
+
+	size_t getNumThreads() const { return m_workers.size(); }
+
+	// run task on a worker thread, the returned future holds its result or exception
+	template <typename F>
+	std::future<typename std::result_of<F()>::type> submit( F&& task )
+	{
+		using Result = typename std::result_of<F()>::type;
+		auto packaged = std::make_shared<std::packaged_task<Result()>>( std::forward<F>( task ) );
+		std::future<Result> future = packaged->get_future();
+		enqueue( [packaged] { ( *packaged )(); } );
+		return future;
+	}
+
+	/* split [begin, end) into chunks and call fn( chunkBegin, chunkEnd ) on up to numThreads threads
+	 * the calling thread works on chunks too, so nested calls from inside pool tasks can't deadlock
+	 * numThreads == 0 uses the whole pool, the first exception thrown by fn is rethrown here */
+	void parallelFor( size_t begin, size_t end, const std::function<void( size_t, size_t )>& fn, size_t numThreads = 0 )
+	{
+		if ( end <= begin ) return;
+		size_t count = end - begin;
+		if ( numThreads == 0 ) numThreads = getNumThreads();
+		numThreads = std::min( numThreads, count );
+		if ( numThreads <= 1 ) {
+			fn( begin, end );
+			return;
+		}
+
+		struct State
+		{
+			std::atomic<size_t> next{ 0 };
+			std::atomic<size_t> done{ 0 };
+			size_t nChunks = 0;
+			std::mutex mutex;
+			std::condition_variable finished;
+			std::exception_ptr error;
+		};
+		auto state     = std::make_shared<State>();
+		state->nChunks = std::min( count, numThreads * 4 );  // a few chunks per thread to even out load
+		size_t chunk   = ( count + state->nChunks - 1 ) / state->nChunks;
+		state->nChunks = ( count + chunk - 1 ) / chunk;
+
+		// fn is only referenced while chunks remain, and the caller waits for all of them
+		const auto* fnPtr = &fn;
+		auto work         = [state, fnPtr, begin, end, chunk] {
+			size_t i;
+			while ( ( i = state->next++ ) < state->nChunks ) {
+				size_t b = begin + i * chunk;
+				try {
+					( *fnPtr )( b, std::min( b + chunk, end ) );
+				} catch ( ... ) {
+					std::lock_guard<std::mutex> lock( state->mutex );
+					if ( !state->error ) state->error = std::current_exception();
+				}
+				if ( ++state->done == state->nChunks ) {
+					std::lock_guard<std::mutex> lock( state->mutex );
+					state->finished.notify_all();
+				}
+			}
+		};
+
+		size_t nHelpers = std::min( numThreads - 1, getNumThreads() );
+		for ( size_t i = 0; i < nHelpers; ++i ) enqueue( work );
+		work();
+
+		std::unique_lock<std::mutex> lock( state->mutex );
+		state->finished.wait( lock, [&] { return state->done == state->nChunks; } );
+		if ( state->error ) std::rethrow_exception( state->error );
+	}
+
+protected:
+	void enqueue( std::function<void()> task )
+	{
+		{
+			std::lock_guard<std::mutex> lock( m_mutex );
+			m_tasks.push_back( std::move( task ) );
+		}
+		m_condition.notify_one();
+	}
+
+	void workerLoop()
+	{
+		for ( ;; ) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock( m_mutex );
+				m_condition.wait( lock, [this] { return m_stopping || !m_tasks.empty(); } );
+				if ( m_stopping && m_tasks.empty() ) return;
+				task = std::move( m_tasks.front() );
+				m_tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> m_workers;
+	std::deque<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_stopping = false;
+};
+
+// process wide pool used by default
+inline ThreadPool& getThreadPool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+}  // namespace ofxPointCloudLibrary
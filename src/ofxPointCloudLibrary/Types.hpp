@@ -2,6 +2,7 @@
 
 #include "ofMain.h"
 #include "ofxPointCloudLibrary/Common.hpp"
+#include "ofxPointCloudLibrary/Simd.hpp"
 
 namespace ofxPointCloudLibrary {
 
@@ -42,22 +43,121 @@ inline Point toPcl( const glm::vec3& point )
 	return { point.x, point.y, point.z };
 }
 
-// PointCloud
+// PointCloud (bulk conversions into existing buffers, reusing their storage)
+inline void toOf( const PointCloud& pointCloud, std::vector<glm::vec3>& points )
+{
+	points.resize( pointCloud.size() );
+	if ( points.empty() ) return;
+	simd::paddedToPacked( pointCloud.points[0].data, 4, &points[0].x, points.size() );
+}
+
+inline void toPcl( const std::vector<glm::vec3>& points, PointCloud& pointCloud )
+{
+	pointCloud.resize( points.size() );
+	pointCloud.width  = static_cast<uint32_t>( points.size() );
+	pointCloud.height = 1;
+	if ( points.empty() ) return;
+	simd::packedToPadded( &points[0].x, pointCloud.points[0].data, 4, points.size(), 1.f );
+}
+
+// image structured version: keeps the width x height grid of e.g. a depth frame, points in row major order
+inline void toPcl( const std::vector<glm::vec3>& points, const PointCloudData& structure, PointCloud& pointCloud )
+{
+	toPcl( points, pointCloud );
+	if ( structure.width * structure.height != points.size() ) {
+		ofLogError( "ofxPcl::toPcl" ) << structure.width << "x" << structure.height << " doesn't match " << points.size() << " points, cloud left unorganized";
+		return;
+	}
+	pointCloud.width    = static_cast<uint32_t>( structure.width );
+	pointCloud.height   = static_cast<uint32_t>( structure.height );
+	pointCloud.is_dense = structure.isDense;
+}
+
 inline std::vector<glm::vec3> toOf( const PointCloud& pointCloud )
 {
 	std::vector<glm::vec3> points;
-	points.reserve( pointCloud.size() );
-	for ( const auto& p : pointCloud ) {
-		points.emplace_back( p.x, p.y, p.z );
-	}
+	toOf( pointCloud, points );
+	return points;
 }
 
 inline PointCloud toPcl( const std::vector<glm::vec3>& points )
 {
-	auto pc = PointCloud( points.size(), 1 );
-	for ( int i = 0; i < points.size(); ++i ) pc[i] = toPcl( points[i] );
+	PointCloud pc;
+	toPcl( points, pc );
 	return pc;
 }
 
+// ofMesh vertices + normals <--> PointNormal cloud (missing normals are written as zero)
+inline void toPcl( const ofMesh& mesh, pcl::PointCloud<pcl::PointNormal>& pointCloud )
+{
+	const auto& verts   = mesh.getVertices();
+	const auto& normals = mesh.getNormals();
+	size_t n            = verts.size();
+
+	pointCloud.resize( n );
+	pointCloud.width  = static_cast<uint32_t>( n );
+	pointCloud.height = 1;
+	if ( n == 0 ) return;
+
+	const size_t stride = sizeof( pcl::PointNormal ) / sizeof( float );
+	simd::packedToPadded( &verts[0].x, pointCloud.points[0].data, stride, n, 1.f );
+
+	size_t nNormals = std::min( normals.size(), n );
+	if ( nNormals > 0 ) simd::packedToPadded( &normals[0].x, pointCloud.points[0].data_n, stride, nNormals, 0.f );
+	for ( size_t i = nNormals; i < n; ++i ) pointCloud.points[i].getNormalVector4fMap().setZero();
+	for ( auto& p : pointCloud.points ) p.curvature = 0.f;
+}
+
+inline void toOf( const pcl::PointCloud<pcl::PointNormal>& pointCloud, ofMesh& mesh )
+{
+	auto& verts   = mesh.getVertices();
+	auto& normals = mesh.getNormals();
+	size_t n      = pointCloud.size();
+
+	verts.resize( n );
+	normals.resize( n );
+	if ( n == 0 ) return;
+
+	const size_t stride = sizeof( pcl::PointNormal ) / sizeof( float );
+	simd::paddedToPacked( pointCloud.points[0].data, stride, &verts[0].x, n );
+	simd::paddedToPacked( pointCloud.points[0].data_n, stride, &normals[0].x, n );
+}
+
+// ofMesh vertices + colors <--> PointXYZRGBA cloud (missing colors are written as opaque white)
+inline void toPcl( const ofMesh& mesh, pcl::PointCloud<pcl::PointXYZRGBA>& pointCloud )
+{
+	static_assert( sizeof( ofFloatColor ) == 4 * sizeof( float ), "ofFloatColor must be 4 packed floats" );
+
+	const auto& verts  = mesh.getVertices();
+	const auto& colors = mesh.getColors();
+	size_t n           = verts.size();
+
+	pointCloud.resize( n );
+	pointCloud.width  = static_cast<uint32_t>( n );
+	pointCloud.height = 1;
+	if ( n == 0 ) return;
+
+	const size_t stride = sizeof( pcl::PointXYZRGBA ) / sizeof( float );
+	simd::packedToPadded( &verts[0].x, pointCloud.points[0].data, stride, n, 1.f );
+
+	size_t nColors = std::min( colors.size(), n );
+	if ( nColors > 0 ) simd::floatColorsToRgba( &colors[0].r, &pointCloud.points[0].rgba, stride, nColors );
+	for ( size_t i = nColors; i < n; ++i ) pointCloud.points[i].rgba = 0xffffffff;
+}
+
+inline void toOf( const pcl::PointCloud<pcl::PointXYZRGBA>& pointCloud, ofMesh& mesh )
+{
+	auto& verts  = mesh.getVertices();
+	auto& colors = mesh.getColors();
+	size_t n     = pointCloud.size();
+
+	verts.resize( n );
+	colors.resize( n );
+	if ( n == 0 ) return;
+
+	const size_t stride = sizeof( pcl::PointXYZRGBA ) / sizeof( float );
+	simd::paddedToPacked( pointCloud.points[0].data, stride, &verts[0].x, n );
+	simd::rgbaToFloatColors( &pointCloud.points[0].rgba, stride, &colors[0].r, n );
+}
 
 }  // namespace ofxPointCloudLibrary
\ No newline at end of file
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstring>
 #include <glm/gtx/matrix_decompose.hpp>
 #include <ofxPointCloudLibrary/Common.hpp>
+#include <ofxPointCloudLibrary/ThreadPool.hpp>
 #include <ofxPointCloudLibrary/Types.hpp>
 
 #include "ofMain.h"
@@ -12,32 +14,37 @@ namespace ofxPointCloudLibrary {
 // oF <--> Eigen conversions
 // -------------------------
 
+// glm and eigen matrices are both 16 contiguous column major floats, and glm quats store x y z w
+// like eigen's coeffs(), so conversions are plain copies
+static_assert( sizeof( glm::mat4 ) == sizeof( Eigen::Matrix4f ), "glm::mat4 and Eigen::Matrix4f layouts differ" );
+static_assert( sizeof( glm::quat ) == sizeof( Eigen::Quaternionf ), "glm::quat and Eigen::Quaternionf layouts differ" );
+
 // convert eigen 4x4 matrix -> glm 4x4 matrix
 inline glm::mat4 toOf( const Eigen::Matrix4f& mat )
 {
-	// transpose
 	glm::mat4 res;
-	for ( int i = 0; i < 4; ++i )
-		for ( int j = 0; j < 4; ++j )
-			res[j][i] = mat( i, j );
+	std::memcpy( &res[0][0], mat.data(), sizeof( res ) );
 	return res;
 }
 
 // convert glm 4x4 matrix -> eigen 4x4 matrix
 inline Eigen::Matrix4f toPcl( const glm::mat4& mat )
 {
-	// transpose
 	Eigen::Matrix4f res;
-	for ( int i = 0; i < 4; ++i )
-		for ( int j = 0; j < 4; ++j )
-			res( j, i ) = mat[i][j];
+	std::memcpy( res.data(), &mat[0][0], sizeof( res ) );
 	return res;
 }
 
 // convert eigen Quaternion -> glm quat
 inline glm::quat toOf( const Eigen::Quaternionf& quat )
 {
-	return { quat.x(), quat.y(), quat.z(), quat.w() };
+#if defined( GLM_FORCE_QUAT_DATA_WXYZ )
+	return glm::quat( quat.w(), quat.x(), quat.y(), quat.z() );
+#else
+	glm::quat res;
+	std::memcpy( &res[0], quat.coeffs().data(), sizeof( res ) );
+	return res;
+#endif
 }
 
 // convert glm quat -> eigen Quaternion
@@ -47,6 +54,47 @@ inline Eigen::Quaternionf toPcl( const glm::quat& quat )
 	return { quat.w, quat.x, quat.y, quat.z };
 }
 
+// bulk versions over count items, e.g. poses streamed from tracking into the scene graph
+inline void toOf( const Eigen::Matrix4f* mats, size_t count, glm::mat4* out )
+{
+	if ( count ) std::memcpy( &out[0][0][0], mats[0].data(), count * sizeof( glm::mat4 ) );
+}
+
+inline void toPcl( const glm::mat4* mats, size_t count, Eigen::Matrix4f* out )
+{
+	if ( count ) std::memcpy( out[0].data(), &mats[0][0][0], count * sizeof( glm::mat4 ) );
+}
+
+inline void toOf( const Eigen::Quaternionf* quats, size_t count, glm::quat* out )
+{
+#if defined( GLM_FORCE_QUAT_DATA_WXYZ )
+	for ( size_t i = 0; i < count; ++i ) out[i] = toOf( quats[i] );
+#else
+	if ( count ) std::memcpy( &out[0][0], quats[0].coeffs().data(), count * sizeof( glm::quat ) );
+#endif
+}
+
+inline void toPcl( const glm::quat* quats, size_t count, Eigen::Quaternionf* out )
+{
+#if defined( GLM_FORCE_QUAT_DATA_WXYZ )
+	for ( size_t i = 0; i < count; ++i ) out[i] = toPcl( quats[i] );
+#else
+	if ( count ) std::memcpy( out[0].coeffs().data(), &quats[0][0], count * sizeof( glm::quat ) );
+#endif
+}
+
+inline void toOf( const std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>& mats, std::vector<glm::mat4>& out )
+{
+	out.resize( mats.size() );
+	toOf( mats.data(), mats.size(), out.data() );
+}
+
+inline void toPcl( const std::vector<glm::mat4>& mats, std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>& out )
+{
+	out.resize( mats.size() );
+	toPcl( mats.data(), mats.size(), out.data() );
+}
+
 //
 // custom matrix decompose, to fix bugs in GLM version
 //
@@ -123,26 +171,26 @@ inline bool decomposeTransform( const glm::mat4& transformMatrix, glm::vec3& sca
 	// Compute X scale factor and normalize first row.
 	scaleOut.x = length( Row[0] );  // v3Length(Row[0]);
 
-	Row[0] = detail::scale( Row[0], static_cast<float>( 1 ) );
+	Row[0] = glm::detail::scale( Row[0], static_cast<float>( 1 ) );
 
 	// Compute XY shear factor and make 2nd row orthogonal to 1st.
 	skewOut.z = dot( Row[0], Row[1] );
-	Row[1]    = detail::combine( Row[1], Row[0], static_cast<float>( 1 ), -skewOut.z );
+	Row[1]    = glm::detail::combine( Row[1], Row[0], static_cast<float>( 1 ), -skewOut.z );
 
 	// Now, compute Y scale and normalize 2nd row.
 	scaleOut.y = length( Row[1] );
-	Row[1]     = detail::scale( Row[1], static_cast<float>( 1 ) );
+	Row[1]     = glm::detail::scale( Row[1], static_cast<float>( 1 ) );
 	skewOut.z /= scaleOut.y;
 
 	// Compute XZ and YZ shears, orthogonalize 3rd row.
 	skewOut.y = glm::dot( Row[0], Row[2] );
-	Row[2]    = detail::combine( Row[2], Row[0], static_cast<float>( 1 ), -skewOut.y );
+	Row[2]    = glm::detail::combine( Row[2], Row[0], static_cast<float>( 1 ), -skewOut.y );
 	skewOut.x = glm::dot( Row[1], Row[2] );
-	Row[2]    = detail::combine( Row[2], Row[1], static_cast<float>( 1 ), -skewOut.x );
+	Row[2]    = glm::detail::combine( Row[2], Row[1], static_cast<float>( 1 ), -skewOut.x );
 
 	// Next, get Z scale and normalize 3rd row.
 	scaleOut.z = length( Row[2] );
-	Row[2]     = detail::scale( Row[2], static_cast<float>( 1 ) );
+	Row[2]     = glm::detail::scale( Row[2], static_cast<float>( 1 ) );
 	skewOut.y /= scaleOut.z;
 	skewOut.x /= scaleOut.z;
 
@@ -210,4 +258,153 @@ inline bool decomposeTransform( const glm::mat4& transformMatrix, glm::vec3& sca
 	return true;
 }
 
+//
+// fast decompose for rigid and similarity transforms (rotation, translation, uniform scale),
+// as returned by the alignment. no perspective, skew or non-uniform scale, no inverse
+//
+
+// scaleOut is negative for mirroring transforms. the orientation has glm::quat_cast's sign.
+// any 4x4 float expression, e.g. an Eigen::Map, is read without a copy
+template <typename Derived>
+void decomposeRigid( const Eigen::MatrixBase<Derived>& transform, glm::quat& orientationOut, glm::vec3& translationOut, float& scaleOut )
+{
+	Eigen::Matrix3f linear = transform.template topLeftCorner<3, 3>();
+	scaleOut               = linear.col( 0 ).norm();
+	if ( linear.determinant() < 0.f ) scaleOut = -scaleOut;
+	if ( scaleOut != 0.f ) linear *= 1.f / scaleOut;
+
+	Eigen::Quaternionf q( linear );
+	// eigen keeps w positive when the trace is, quat_cast the component it solves for, picked the same way
+	const float squared[4] = { linear.trace(), linear( 0, 0 ) - linear( 1, 1 ) - linear( 2, 2 ), linear( 1, 1 ) - linear( 0, 0 ) - linear( 2, 2 ), linear( 2, 2 ) - linear( 0, 0 ) - linear( 1, 1 ) };
+	int biggest            = 0;
+	for ( int c = 1; c < 4; ++c ) {
+		if ( squared[c] > squared[biggest] ) biggest = c;
+	}
+	const float components[4] = { q.w(), q.x(), q.y(), q.z() };
+	if ( components[biggest] < 0.f ) q.coeffs() *= -1.f;
+	orientationOut = glm::quat( q.w(), q.x(), q.y(), q.z() );
+	translationOut = glm::vec3( transform( 0, 3 ), transform( 1, 3 ), transform( 2, 3 ) );
+}
+
+// glm and eigen are both column major, so the glm matrix is read in place
+inline void decomposeRigid( const glm::mat4& transform, glm::quat& orientationOut, glm::vec3& translationOut, float& scaleOut )
+{
+	decomposeRigid( Eigen::Map<const Eigen::Matrix4f>( &transform[0][0] ), orientationOut, translationOut, scaleOut );
+}
+
+// batched versions over count matrices, scalesOut may be null for rigid transforms
+inline void decomposeRigid( const Eigen::Matrix4f* transforms, size_t count, glm::quat* orientationsOut, glm::vec3* translationsOut, float* scalesOut = nullptr )
+{
+	float scale;
+	for ( size_t i = 0; i < count; ++i ) {
+		decomposeRigid( transforms[i], orientationsOut[i], translationsOut[i], scalesOut ? scalesOut[i] : scale );
+	}
+}
+
+inline void decomposeRigid( const glm::mat4* transforms, size_t count, glm::quat* orientationsOut, glm::vec3* translationsOut, float* scalesOut = nullptr )
+{
+	float scale;
+	for ( size_t i = 0; i < count; ++i ) {
+		decomposeRigid( transforms[i], orientationsOut[i], translationsOut[i], scalesOut ? scalesOut[i] : scale );
+	}
+}
+
+//
+// cloud transforms: SIMD kernels, split across the ThreadPool from 65536 points up.
+// output may be the input, for in place transforms
+//
+
+namespace detail {
+
+// transform n strided points, and their normals at normalOffset floats if given
+inline void transformPoints( const float* matrix, const float* src, float* dst, size_t stride, size_t n, int normalOffset = -1 )
+{
+	size_t numThreads = std::max<size_t>( 1, std::min( getThreadPool().getNumThreads(), n / 65536 ) );
+	getThreadPool().parallelFor( 0, n, [&]( size_t begin, size_t end ) {
+		simd::transformPoints( matrix, true, src + begin * stride, stride, dst + begin * stride, stride, end - begin );
+		if ( normalOffset >= 0 ) simd::transformPoints( matrix, false, src + begin * stride + normalOffset, stride, dst + begin * stride + normalOffset, stride, end - begin );
+	}, numThreads );
+}
+
+// everything but the points
+template <typename PointT>
+void copyCloudMetadata( const pcl::PointCloud<PointT>& cloud, pcl::PointCloud<PointT>& output )
+{
+	output.header              = cloud.header;
+	output.width               = cloud.width;
+	output.height              = cloud.height;
+	output.is_dense            = cloud.is_dense;
+	output.sensor_origin_      = cloud.sensor_origin_;
+	output.sensor_orientation_ = cloud.sensor_orientation_;
+	output.points.resize( cloud.points.size() );
+}
+
+}  // namespace detail
+
+inline void transformCloud( const std::vector<glm::vec3>& points, const glm::mat4& transform, std::vector<glm::vec3>& output )
+{
+	output.resize( points.size() );
+	if ( points.empty() ) return;
+	detail::transformPoints( &transform[0][0], &points[0].x, &output[0].x, 3, points.size() );
+}
+
+inline void transformCloud( std::vector<glm::vec3>& points, const glm::mat4& transform )
+{
+	transformCloud( points, transform, points );
+}
+
+inline void transformCloud( const PointCloud& cloud, const Eigen::Matrix4f& transform, PointCloud& output )
+{
+	if ( &output != &cloud ) detail::copyCloudMetadata( cloud, output );
+	if ( cloud.empty() ) return;
+	detail::transformPoints( transform.data(), cloud.points[0].data, output.points[0].data, sizeof( Point ) / sizeof( float ), cloud.size() );
+}
+
+// positions are transformed, normals rotated. the transform is expected to be rigid
+inline void transformCloud( const pcl::PointCloud<pcl::PointNormal>& cloud, const Eigen::Matrix4f& transform, pcl::PointCloud<pcl::PointNormal>& output )
+{
+	if ( &output != &cloud ) {
+		detail::copyCloudMetadata( cloud, output );
+		for ( size_t i = 0; i < cloud.size(); ++i ) output.points[i].curvature = cloud.points[i].curvature;
+	}
+	if ( cloud.empty() ) return;
+	const int normalOffset = static_cast<int>( cloud.points[0].data_n - cloud.points[0].data );
+	detail::transformPoints( transform.data(), cloud.points[0].data, output.points[0].data, sizeof( pcl::PointNormal ) / sizeof( float ), cloud.size(), normalOffset );
+}
+
+inline void transformCloud( PointCloud& cloud, const Eigen::Matrix4f& transform )
+{
+	transformCloud( cloud, transform, cloud );
+}
+
+inline void transformCloud( pcl::PointCloud<pcl::PointNormal>& cloud, const Eigen::Matrix4f& transform )
+{
+	transformCloud( cloud, transform, cloud );
+}
+
+inline void transformCloud( std::vector<glm::vec3>& points, const Eigen::Matrix4f& transform )
+{
+	transformCloud( points, toOf( transform ), points );
+}
+
+inline void transformCloud( const PointCloud& cloud, const glm::mat4& transform, PointCloud& output )
+{
+	transformCloud( cloud, toPcl( transform ), output );
+}
+
+inline void transformCloud( PointCloud& cloud, const glm::mat4& transform )
+{
+	transformCloud( cloud, toPcl( transform ), cloud );
+}
+
+inline void transformCloud( const pcl::PointCloud<pcl::PointNormal>& cloud, const glm::mat4& transform, pcl::PointCloud<pcl::PointNormal>& output )
+{
+	transformCloud( cloud, toPcl( transform ), output );
+}
+
+inline void transformCloud( pcl::PointCloud<pcl::PointNormal>& cloud, const glm::mat4& transform )
+{
+	transformCloud( cloud, toPcl( transform ), cloud );
+}
+
 }  // namespace ofxPointCloudLibrary